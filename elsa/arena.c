@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "elsa.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Smallest block malloc-ed when the arena runs out of space */
+#ifndef JSON_ARENA_BLOCK_SIZE
+#define JSON_ARENA_BLOCK_SIZE 4096
+#endif
+
+/* Alignment of the allocations, enough for any scalar */
+#define ARENA_ALIGN 8
+
+/* Header of a malloc-ed block, followed by its space */
+struct arena_block {
+  struct arena_block *next; /* Older block */
+  size_t size;
+};
+
+#define ARENA_HEADER_SIZE \
+  ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void json_arena_init(struct json_arena *arena, void *buf, size_t size) {
+  arena->buf = arena->init = (char *) buf;
+  arena->size = arena->init_size = buf == NULL ? 0 : size;
+  arena->used = 0;
+  arena->blocks = NULL;
+}
+
+void *json_arena_alloc(struct json_arena *arena, size_t size) {
+  size_t pad = 0, avail = arena->size - arena->used;
+  void *p;
+
+  if (arena->buf != NULL) {
+    pad = (size_t) -(uintptr_t)(arena->buf + arena->used) & (ARENA_ALIGN - 1);
+  }
+  if (arena->buf == NULL || avail < pad || avail - pad < size) {
+    /* Chain a new block, at least twice the size of the current one */
+    struct arena_block *b;
+    size_t block_size = arena->size * 2;
+    if (block_size < JSON_ARENA_BLOCK_SIZE) block_size = JSON_ARENA_BLOCK_SIZE;
+    if (block_size < size) block_size = size;
+    if (block_size > (size_t) -1 - ARENA_HEADER_SIZE) return NULL;
+    b = (struct arena_block *) malloc(ARENA_HEADER_SIZE + block_size);
+    if (b == NULL) return NULL;
+    b->next = (struct arena_block *) arena->blocks;
+    b->size = block_size;
+    arena->blocks = b;
+    arena->buf = (char *) b + ARENA_HEADER_SIZE;
+    arena->size = block_size;
+    arena->used = 0;
+    pad = 0;
+  }
+
+  p = arena->buf + arena->used + pad;
+  arena->used += size + pad;
+  return p;
+}
+
+void json_arena_reset(struct json_arena *arena) {
+  struct arena_block *b = (struct arena_block *) arena->blocks, *next;
+
+  if (b == NULL) {
+    arena->buf = arena->init;
+    arena->size = arena->init_size;
+  } else {
+    /* Keep the newest block, the largest one, to not malloc() next time */
+    struct arena_block *older = b->next;
+    b->next = NULL;
+    for (; older != NULL; older = next) {
+      next = older->next;
+      free(older);
+    }
+    arena->buf = (char *) b + ARENA_HEADER_SIZE;
+    arena->size = b->size;
+  }
+  arena->used = 0;
+}
+
+void json_arena_free(struct json_arena *arena) {
+  struct arena_block *b = (struct arena_block *) arena->blocks, *next;
+
+  for (; b != NULL; b = next) {
+    next = b->next;
+    free(b);
+  }
+  json_arena_init(arena, arena->init, arena->init_size);
+}
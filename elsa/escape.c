@@ -17,33 +17,70 @@
 
 #include "elsa.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include "util.h"
 
+#ifndef JSON_NO_SIMD
+#define ESC_SWAR 1
+
+#define ESC_ONES 0x0101010101010101ULL
+#define ESC_HIGH 0x8080808080808080ULL
+
+/*
+ * Non-0 if none of the eight bytes at `p` needs escaping: none is a control
+ * character, '"', '\\' or past ASCII. Bytes are tested all at once (SWAR),
+ * with a false positive at times, never a false negative.
+ */
+static int esc_is_8_plain(const char *p) {
+  uint64_t v, q, b;
+  memcpy(&v, p, sizeof(v));
+  q = v ^ (ESC_ONES * '"');
+  b = v ^ (ESC_ONES * '\\');
+  return ((((v - ESC_ONES * 0x20) & ~v) | v | (v + ESC_ONES) |
+           ((q - ESC_ONES) & ~q) | ((b - ESC_ONES) & ~b)) &
+          ESC_HIGH) == 0;
+}
+#endif
+
 int json_escape(struct json_out *out, const char *p, size_t len) {
-  size_t i, cl, n = 0;
+  size_t i, cl, n = 0, start = 0;
   const char *hex_digits = "0123456789abcdef";
   const char *specials = "btnvfr";
 
+  /* Runs of characters that need no escaping are printed as they are */
   for (i = 0; i < len; i++) {
-    unsigned char ch = ((unsigned char *) p)[i];
+    unsigned char ch;
+    char esc[6];
+    int esc_len = 2;
+#ifdef ESC_SWAR
+    if (len - i >= 8 && esc_is_8_plain(p + i)) {
+      i += 7;
+      continue;
+    }
+#endif
+    ch = ((unsigned char *) p)[i];
+    esc[0] = '\\';
     if (ch == '"' || ch == '\\') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, p + i, 1);
+      esc[1] = (char) ch;
     } else if (ch >= '\b' && ch <= '\r') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, &specials[ch - '\b'], 1);
+      esc[1] = specials[ch - '\b'];
     } else if (is_print(ch)) {
-      n += out->printer(out, p + i, 1);
+      continue;
     } else if ((cl = get_utf8_char_len(ch)) == 1) {
-      n += out->printer(out, "\\u00", 4);
-      n += out->printer(out, &hex_digits[(ch >> 4) % 0xf], 1);
-      n += out->printer(out, &hex_digits[ch % 0xf], 1);
+      memcpy(esc + 1, "u00", 3);
+      esc[4] = hex_digits[(ch >> 4) % 0xf];
+      esc[5] = hex_digits[ch % 0xf];
+      esc_len = 6;
     } else {
-      n += out->printer(out, p + i, cl);
       i += cl - 1;
+      continue;
     }
+    if (i > start) n += json_out_ref(out, p + start, i - start);
+    n += out->printer(out, esc, esc_len);
+    start = i + 1;
   }
+  if (len > start) n += json_out_ref(out, p + start, len - start);
 
   return n;
 }
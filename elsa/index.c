@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "elsa.h"
+#include <stddef.h>
+#include <string.h>
+#include "util.h"
+
+struct index_data {
+  struct json_index *idx;
+  int max_tokens;
+  int num_tokens; /* Number of tokens seen, may exceed max_tokens */
+  int parent;     /* Currently open container, -1 at the top level */
+  int overflow;   /* Non-0 if `tokens` turned out to be too small */
+};
+
+static int index_cb(void *userdata, const struct json_walk_event *ev,
+                    const struct json_token *t) {
+  struct index_data *d = (struct index_data *) userdata;
+  struct json_index_token *toks = d->idx->tokens, *p;
+  int n;
+
+  if (d->overflow) {
+    /* Out of space: only count the remaining values */
+    if (t->type != JSON_TYPE_OBJECT_END && t->type != JSON_TYPE_ARRAY_END) {
+      d->num_tokens++;
+    }
+    return 0;
+  }
+
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+    /* Container is complete: now we know where it starts and ends */
+    p = &toks[d->parent];
+    p->ofs = t->ptr - d->idx->s;
+    p->len = t->len;
+    d->parent = p->parent;
+    return 0;
+  }
+
+  n = d->num_tokens++;
+  if (n >= d->max_tokens) {
+    d->overflow = 1;
+    return 0;
+  }
+
+  p = &toks[n];
+  p->parent = d->parent;
+  p->next = -1;
+  p->key_ofs = -1;
+  p->key_len = 0;
+  if (d->parent >= 0) {
+    struct json_index_token *parent = &toks[d->parent];
+    /* While a container is open, its `len` holds its last child */
+    if (parent->len >= 0) toks[parent->len].next = n;
+    parent->len = n;
+    if (ev->name != NULL) {
+      p->key_ofs = ev->name - d->idx->s;
+      p->key_len = ev->name_len;
+    }
+  }
+
+  switch (t->type) {
+    case JSON_TYPE_OBJECT_START:
+    case JSON_TYPE_ARRAY_START:
+      p->type = t->type == JSON_TYPE_OBJECT_START ? JSON_TYPE_OBJECT_END
+                                                   : JSON_TYPE_ARRAY_END;
+      p->ofs = 0;
+      p->len = -1;
+      d->parent = n;
+      break;
+    default:
+      p->type = t->type;
+      p->ofs = t->ptr - d->idx->s;
+      p->len = t->len;
+      break;
+  }
+
+  return 0;
+}
+
+int json_index(const char *s, int len, struct json_index_token *tokens,
+               int max_tokens, struct json_index *idx) {
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  struct index_data d;
+  int res;
+
+  idx->s = s;
+  idx->len = len;
+  idx->tokens = tokens;
+  idx->num_tokens = 0;
+
+  d.idx = idx;
+  d.max_tokens = max_tokens;
+  d.num_tokens = 0;
+  d.parent = -1;
+  d.overflow = 0;
+
+  res = json_walk_ex(s, len, &opts, index_cb, &d);
+  if (res < 0) return res;
+  if (!d.overflow) idx->num_tokens = d.num_tokens;
+  return d.num_tokens;
+}
+
+int json_index_find(const struct json_index *idx, int from, const char *path) {
+  int i = from;
+
+  if (from < 0 || from >= idx->num_tokens) return -1;
+
+  while (*path != '\0') {
+    const struct json_index_token *t = &idx->tokens[i];
+    int child = i + 1, found = -1;
+
+    /* First child, if any, immediately follows its container */
+    if (child >= idx->num_tokens || idx->tokens[child].parent != i) {
+      child = -1;
+    }
+
+    if (path[0] == '.' && t->type == JSON_TYPE_OBJECT_END) {
+      int key_len = strcspn(path + 1, ".[");
+      /* With duplicate keys, the last one wins, like in json_scanf() */
+      for (; child >= 0; child = idx->tokens[child].next) {
+        const struct json_index_token *c = &idx->tokens[child];
+        if (c->key_len == key_len &&
+            memcmp(idx->s + c->key_ofs, path + 1, key_len) == 0) {
+          found = child;
+        }
+      }
+      path += key_len + 1;
+    } else if (path[0] == '[' && t->type == JSON_TYPE_ARRAY_END &&
+               is_digit(path[1])) {
+      int n = 0;
+      for (path++; is_digit(*path); path++) n = n * 10 + (*path - '0');
+      if (*path++ != ']') return -1;
+      for (; child >= 0 && n > 0; n--) child = idx->tokens[child].next;
+      found = child;
+    }
+
+    if (found < 0) return -1;
+    i = found;
+  }
+
+  return i;
+}
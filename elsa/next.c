@@ -17,76 +17,182 @@
 
 #include "elsa.h"
 #include <stddef.h>
-#include <stdlib.h>
-#include <string.h>
-
-struct next_data {
-  void *handle;            /* Passed handle. Changed if a next entry is found */
-  const char *path;        /* Path to the iterated object/array */
-  int path_len;            /* Path length - optimisation */
-  int found;               /* Non-0 if found the next entry */
-  struct json_token *key;  /* Object's key */
-  struct json_token *val;  /* Object's value */
-  int *idx;                /* Array index */
-};
-
-static void next_set_key(struct next_data *d, const char *name, int name_len,
-                         int is_array) {
-  if (is_array) {
-    /* Array. Set index and reset key  */
-    if (d->key != NULL) {
-      d->key->len = 0;
-      d->key->ptr = NULL;
-    }
-    if (d->idx != NULL) *d->idx = atoi(name);
+#include "util.h"
+
+/*
+ * Count the elements of the array at `path` that come before `elem`. The
+ * handle only tells where the previous element is, so the index is found
+ * again on each step, jumping over the elements without parsing them.
+ */
+static ptrdiff_t next_index(const char *s, const char *end, const char *path,
+                            const char *elem) {
+  const char *p = json_scan_path(s, end, path);
+  ptrdiff_t n = 0;
+  if (p == NULL) return -1;
+  for (p = json_scan_spaces(p + 1, end); p < elem; n++) {
+    if ((p = json_scan_skip(p, end)) == NULL) return -1;
+    p = json_scan_spaces(p, end);
+    if (p < end && *p == ',') p = json_scan_spaces(p + 1, end);
+  }
+  return n;
+}
+
+/*
+ * The handle is the beginning of the previous value, so each step only
+ * scans from there to the end of the next one, skipping nested containers
+ * in bulk instead of reporting everything inside them. Each value found is
+ * still checked, so the iteration stops at a malformed one, the way
+ * json_walk() does.
+ */
+static void *json_next(const char *s, size_t len, void *handle,
+                       const char *path, struct json_token64 *key,
+                       struct json_token64 *val, ptrdiff_t *i) {
+  const char *end = s + len, *p = (const char *) handle, *v;
+  struct json_token64 tmpval, *t = val == NULL ? &tmpval : val;
+  struct json_token64 k;
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  int is_object;
+
+  if (p == NULL) {
+    /* First iteration: find the container and step inside it */
+    if ((p = json_scan_path(s, end, path)) == NULL) return NULL;
+    if (*p != '{' && *p != '[') return NULL;
+    is_object = *p++ == '{';
+    if (i != NULL) *i = -1;
+  } else if (p <= s || p >= end) {
+    return NULL;
   } else {
-    /* Object. Set key and make index -1 */
-    if (d->key != NULL) {
-      d->key->ptr = name;
-      d->key->len = name_len;
+    /* Only the value of an object member follows a colon */
+    for (v = p - 1; v > s && is_space(*v); v--) {
     }
-    if (d->idx != NULL) *d->idx = -1;
+    is_object = *v == ':';
+    if ((p = json_scan_skip(p, end)) == NULL) return NULL;
   }
-}
 
-static void next_cb(void *userdata, const char *name, size_t name_len,
-                    const char *path, const struct json_token *t) {
-  struct next_data *d = (struct next_data *) userdata;
-  const char *p = path + d->path_len;
-  if (d->found) return;
-  if (d->path_len >= (int) strlen(path)) return;
-  if (strncmp(d->path, path, d->path_len) != 0) return;
-  if (strchr(p + 1, '.') != NULL) return; /* More nested objects - skip */
-  if (strchr(p + 1, '[') != NULL) return; /* Ditto for arrays */
-  /* {OBJECT,ARRAY}_END types do not pass name, _START does. Save key. */
-  if (t->type == JSON_TYPE_OBJECT_START || t->type == JSON_TYPE_ARRAY_START) {
-    next_set_key(d, name, name_len, p[0] == '[');
-  } else if (d->handle == NULL || d->handle < (void *) t->ptr) {
-    if (t->type != JSON_TYPE_OBJECT_END && t->type != JSON_TYPE_ARRAY_END) {
-      next_set_key(d, name, name_len, p[0] == '[');
+  /* Comma between the members is optional */
+  p = json_scan_spaces(p, end);
+  if (handle != NULL && p < end && *p == ',') p = json_scan_spaces(p + 1, end);
+  if (p >= end || *p == '}' || *p == ']') return NULL;
+
+  if (is_object) {
+    /* Object. Set key and make index -1 */
+    if ((v = json_scan_key(p, end, &k)) == NULL) return NULL;
+    if (*p == '"' && json_walk_ex64(p, k.len + 2, &opts, NULL, NULL) !=
+                         (ptrdiff_t) k.len + 2) {
+      return NULL;
+    }
+    if (key != NULL) *key = k;
+    if (i != NULL) *i = -1;
+    p = json_scan_spaces(v, end);
+  } else {
+    /* Array. Reset key and set index */
+    if (key != NULL) {
+      key->ptr = NULL;
+      key->len = 0;
+    }
+    if (i != NULL) {
+      *i = handle == NULL ? 0 : next_index(s, end, path, p);
+      if (*i < 0) return NULL;
     }
-    if (d->val != NULL) *d->val = *t;
-    d->handle = (void *) t->ptr;
-    d->found = 1;
   }
+
+  return json_scan_valid_value(p, end, t) == NULL ? NULL : (void *) p;
 }
 
-static void *json_next(const char *s, int len, void *handle, const char *path,
-                       struct json_token *key, struct json_token *val, int *i) {
-  struct json_token tmpval, *v = val == NULL ? &tmpval : val;
-  struct json_token tmpkey, *k = key == NULL ? &tmpkey : key;
-  int tmpidx, *pidx = i == NULL ? &tmpidx : i;
-  struct next_data data = {handle, path, strlen(path), 0, k, v, pidx};
-  json_walk(s, len, next_cb, &data);
-  return data.found ? data.handle : NULL;
+void *json_next_key64(const char *s, size_t len, void *handle,
+                      const char *path, struct json_token64 *key,
+                      struct json_token64 *val) {
+  return json_next(s, len, handle, path, key, val, NULL);
+}
+
+void *json_next_elem64(const char *s, size_t len, void *handle,
+                       const char *path, ptrdiff_t *idx,
+                       struct json_token64 *val) {
+  return json_next(s, len, handle, path, NULL, val, idx);
+}
+
+/* Copy a token found in the input smaller than 2 GiB */
+static void next_token(struct json_token *dst, const struct json_token64 *t) {
+  if (dst == NULL) return;
+  dst->ptr = t->ptr;
+  dst->len = (int) t->len;
+  dst->type = t->type;
 }
 
 void *json_next_key(const char *s, int len, void *handle, const char *path,
                     struct json_token *key, struct json_token *val) {
-  return json_next(s, len, handle, path, key, val, NULL);
+  struct json_token64 k, v;
+  if (len < 0) return NULL;
+  if ((handle = json_next(s, len, handle, path, &k, &v, NULL)) != NULL) {
+    if (key != NULL) {
+      key->ptr = k.ptr;
+      key->len = (int) k.len;
+    }
+    next_token(val, &v);
+  }
+  return handle;
 }
 
 void *json_next_elem(const char *s, int len, void *handle, const char *path,
                      int *idx, struct json_token *val) {
-  return json_next(s, len, handle, path, NULL, val, idx);
+  struct json_token64 v;
+  ptrdiff_t i;
+  if (len < 0) return NULL;
+  handle = json_next(s, len, handle, path, NULL, &v, idx == NULL ? NULL : &i);
+  if (handle != NULL) {
+    if (idx != NULL) *idx = (int) i;
+    next_token(val, &v);
+  }
+  return handle;
+}
+
+static void *json_index_next(const struct json_index *idx, void *handle,
+                             const char *path, struct json_token *key,
+                             struct json_token *val, int *i) {
+  const struct json_index_token *t = (const struct json_index_token *) handle;
+  int n;
+
+  if (t == NULL) {
+    /* First iteration: find the container and step to its first child */
+    if ((n = json_index_find(idx, 0, path)) < 0) return NULL;
+    if (idx->tokens[n].type != JSON_TYPE_OBJECT_END &&
+        idx->tokens[n].type != JSON_TYPE_ARRAY_END) {
+      return NULL;
+    }
+    if (n + 1 >= idx->num_tokens || idx->tokens[n + 1].parent != n) {
+      return NULL;
+    }
+    n++;
+    if (i != NULL) *i = -1;
+  } else if ((n = t->next) < 0) {
+    return NULL;
+  }
+
+  t = &idx->tokens[n];
+  if (key != NULL) {
+    key->ptr = t->key_ofs < 0 ? NULL : idx->s + t->key_ofs;
+    key->len = t->key_len;
+    key->type = JSON_TYPE_STRING;
+  }
+  if (i != NULL) {
+    /* Array index is the number of siblings before the token */
+    *i = -1;
+    if (idx->tokens[t->parent].type == JSON_TYPE_ARRAY_END) {
+      int k;
+      for (*i = 0, k = t->parent + 1; k != n; k = idx->tokens[k].next) (*i)++;
+    }
+  }
+  if (val != NULL) index_token(idx, n, val);
+  return (void *) t;
+}
+
+void *json_index_next_key(const struct json_index *idx, void *handle,
+                          const char *path, struct json_token *key,
+                          struct json_token *val) {
+  return json_index_next(idx, handle, path, key, val, NULL);
+}
+
+void *json_index_next_elem(const struct json_index *idx, void *handle,
+                           const char *path, int *i, struct json_token *val) {
+  return json_index_next(idx, handle, path, NULL, val, i);
 }
@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Number parsing for json_scanf(), and formatting for json_printf(), both
+ * independent of the C locale. Digits are read eight at a time on
+ * little-endian machines (SWAR: the eight bytes are checked and combined
+ * in a 64-bit register). Floating point numbers that have an exact double
+ * or float representation of both the mantissa and the power of ten are
+ * computed with a single rounding (Clinger's fast path); the rest goes to
+ * strtod(), without a decimal point, so the locale doesn't matter.
+ */
+
+#include "elsa.h"
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#if !defined(JSON_NO_SIMD) &&                                      \
+    ((defined(__BYTE_ORDER__) &&                                    \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) ||                 \
+     defined(_M_X64) || defined(_M_IX86) || defined(_M_ARM64))
+#define NUM_SWAR 1
+#endif
+
+/* Float arithmetic rounds once, as the fast path needs */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define NUM_FAST_PATH 1
+#endif
+
+#ifdef NUM_SWAR
+/* Non-0 if all eight bytes of `v` are ASCII digits */
+static int num_is_8_digits(uint64_t v) {
+  return ((v & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+/* Value of the eight digits in `v`, the first one in the lowest byte */
+static uint32_t num_8_digits(uint64_t v) {
+  v -= 0x3030303030303030ULL;
+  v = (v * 10) + (v >> 8);
+  v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >>
+      32;
+  return (uint32_t) v;
+}
+#endif
+
+/*
+ * Append the digits at `p` to `*mant` while it fits in 64 bits. Digits that
+ * don't fit are counted in `*dropped`, and `*inexact` is set if any of them
+ * is not 0. Return the end of the digits.
+ */
+static const char *num_digits(const char *p, const char *end, uint64_t *mant,
+                              int *taken, int *dropped, int *inexact) {
+#ifdef NUM_SWAR
+  while (end - p >= 8 && *mant < 100000000000ULL && *dropped == 0) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    if (!num_is_8_digits(v)) break;
+    *mant = *mant * 100000000 + num_8_digits(v);
+    *taken += 8;
+    p += 8;
+  }
+#endif
+  for (; p < end && is_digit(*p); p++) {
+    int d = *p - '0';
+    if (*dropped == 0 && (*mant < UINT64_MAX / 10 ||
+                          (*mant == UINT64_MAX / 10 && d <= 5))) {
+      *mant = *mant * 10 + d;
+      (*taken)++;
+    } else {
+      (*dropped)++;
+      if (d != 0) *inexact = 1;
+    }
+  }
+  return p;
+}
+
+const char *json_parse_int(const char *p, const char *end, int *neg,
+                           uint64_t *v) {
+  const char *digits;
+  int taken = 0, dropped = 0, inexact = 0;
+
+  *neg = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+  *v = 0;
+  digits = p;
+  p = num_digits(p, end, v, &taken, &dropped, &inexact);
+  return p == digits || dropped > 0 ? NULL : p;
+}
+
+#ifdef NUM_FAST_PATH
+static const double num_pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+
+static const float num_pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                   1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+#endif
+
+/*
+ * strtod() or strtof() the number at `p,end`, rewritten with the decimal
+ * point dropped and moved into the exponent: "-12.5e3" is read as
+ * "-125e2". Return 0 on allocation failure.
+ */
+static int num_slow(const char *p, const char *end, int single, double *d,
+                    float *f) {
+  char buf[128], *s = buf, *q;
+  long exp = 0, frac = 0;
+  int in_frac = 0, exp_neg = 0;
+
+  if (end - p + 24 > (int) sizeof(buf) &&
+      (s = (char *) malloc(end - p + 24)) == NULL) {
+    return 0;
+  }
+  for (q = s; p < end && *p != 'e' && *p != 'E'; p++) {
+    if (*p == '.') {
+      in_frac = 1;
+    } else {
+      *q++ = *p;
+      frac += in_frac;
+    }
+  }
+  if (p < end) {
+    p++;
+    exp_neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    /* Anything over this makes the number infinite or 0 anyway */
+    for (; p < end && exp < 100000; p++) exp = exp * 10 + (*p - '0');
+  }
+  sprintf(q, "e%ld", (exp_neg ? -exp : exp) - frac);
+  if (single) {
+    *f = strtof(s, NULL);
+  } else {
+    *d = strtod(s, NULL);
+  }
+  if (s != buf) free(s);
+  return 1;
+}
+
+/* Parse a decimal number into a double, or a float if `single` is non-0 */
+static const char *num_parse(const char *p, const char *end, int single,
+                             double *d, float *f) {
+  const char *start = p, *digits;
+  uint64_t mant = 0;
+  int neg, taken = 0, dropped = 0, inexact = 0;
+  long exp = 0;
+
+  neg = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+  digits = p;
+  p = num_digits(p, end, &mant, &taken, &dropped, &inexact);
+  exp = dropped;
+  if (p < end && *p == '.') {
+    const char *frac = ++p;
+    taken = 0;
+    p = num_digits(p, end, &mant, &taken, &dropped, &inexact);
+    exp -= taken;
+    if (p == frac && frac - 1 == digits) return NULL;
+  } else if (p == digits) {
+    return NULL;
+  }
+  if (p < end && (*p == 'e' || *p == 'E') && end - p > 1) {
+    const char *q = p + 1;
+    int exp_neg = *q == '-';
+    long e = 0;
+    if (*q == '-' || *q == '+') q++;
+    if (q < end && is_digit(*q)) {
+      for (; q < end && is_digit(*q); q++) {
+        if (e < 100000) e = e * 10 + (*q - '0');
+      }
+      exp += exp_neg ? -e : e;
+      p = q;
+    }
+  }
+
+#ifdef NUM_FAST_PATH
+  if (!inexact && mant == 0) {
+    if (single) {
+      *f = neg ? -0.0f : 0.0f;
+    } else {
+      *d = neg ? -0.0 : 0.0;
+    }
+    return p;
+  }
+  if (!inexact && single && mant <= (1ULL << 24) && exp >= -10 && exp <= 10) {
+    float v = (float) mant;
+    v = exp < 0 ? v / num_pow10f[-exp] : v * num_pow10f[exp];
+    *f = neg ? -v : v;
+    return p;
+  }
+  if (!inexact && !single && mant <= (1ULL << 53) && exp >= -22 &&
+      exp <= 22 + 15) {
+    double v = (double) mant;
+    if (exp > 22) {
+      /* Move some of the power into the mantissa, if it stays exact */
+      v *= num_pow10[exp - 22];
+      exp = 22;
+    }
+    if (v < 9007199254740992.0) {
+      v = exp < 0 ? v / num_pow10[-exp] : v * num_pow10[exp];
+      *d = neg ? -v : v;
+      return p;
+    }
+  }
+#endif
+
+  (void) inexact;
+  if (!num_slow(start, p, single, d, f)) return NULL;
+  return p;
+}
+
+const char *json_parse_double(const char *p, const char *end, double *v) {
+  p = num_parse(p, end, 0, v, NULL);
+  return p != NULL && *v - *v == 0 ? p : NULL;
+}
+
+const char *json_parse_float(const char *p, const char *end, float *v) {
+  p = num_parse(p, end, 1, NULL, v);
+  return p != NULL && *v - *v == 0 ? p : NULL;
+}
+
+/*
+ * Formatting. Integers are written two digits at a time from a table of
+ * digit pairs. Floating point numbers are written with the fewest digits
+ * that read back the same, found with Grisu3 (Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", 2010): the
+ * number and the bounds of the interval that rounds to it are scaled by a
+ * cached power of ten, so that the digits come out of 64-bit integer
+ * arithmetic. For the about 0.5% of the numbers where the error of the
+ * scaling leaves the result in doubt, the C library is asked instead.
+ * A number rounded to a given number of digits, as printf() does, is
+ * scaled by a power of ten with a single rounding, as for parsing, unless
+ * that is too close to halfway to tell.
+ */
+
+static const char num_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int json_format_int(char *buf, int neg, uint64_t v) {
+  char tmp[20], *p = tmp + sizeof(tmp);
+  int n;
+
+  for (; v >= 100; v /= 100) {
+    p -= 2;
+    memcpy(p, num_pairs + (v % 100) * 2, 2);
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, num_pairs + v * 2, 2);
+  } else {
+    *--p = (char) ('0' + v);
+  }
+  n = (int) (tmp + sizeof(tmp) - p);
+  if (neg) *buf++ = '-';
+  memcpy(buf, p, n);
+  return n + (neg ? 1 : 0);
+}
+
+int json_round(double v, int m, uint64_t *r) {
+#ifdef NUM_FAST_PATH
+  double x, rest;
+
+  if (m < -22 || m > 22) return 0;
+  /* A single rounding, which is off by half a unit in the last place */
+  x = m < 0 ? v / num_pow10[-m] : v * num_pow10[m];
+  if (!(x < 1e15)) return 0;
+  *r = (uint64_t) x;
+  rest = x - (double) *r;
+  if (rest - 0.5 <= x * DBL_EPSILON && 0.5 - rest <= x * DBL_EPSILON) {
+    return 0;
+  }
+  if (rest > 0.5) (*r)++;
+  return 1;
+#else
+  (void) v;
+  (void) m;
+  (void) r;
+  return 0;
+#endif
+}
+
+/* Number f * 2^e, the "do-it-yourself floating point" of Grisu */
+struct num_fp {
+  uint64_t f;
+  int e;
+};
+
+/* Normalized 10^(8i - 348) */
+static const uint64_t num_cached_f[] = {
+    0xFA8FD5A0081C0288ULL, 0xBAAEE17FA23EBF76ULL, 0x8B16FB203055AC76ULL,
+    0xCF42894A5DCE35EAULL, 0x9A6BB0AA55653B2DULL, 0xE61ACF033D1A45DFULL,
+    0xAB70FE17C79AC6CAULL, 0xFF77B1FCBEBCDC4FULL, 0xBE5691EF416BD60CULL,
+    0x8DD01FAD907FFC3CULL, 0xD3515C2831559A83ULL, 0x9D71AC8FADA6C9B5ULL,
+    0xEA9C227723EE8BCBULL, 0xAECC49914078536DULL, 0x823C12795DB6CE57ULL,
+    0xC21094364DFB5637ULL, 0x9096EA6F3848984FULL, 0xD77485CB25823AC7ULL,
+    0xA086CFCD97BF97F4ULL, 0xEF340A98172AACE5ULL, 0xB23867FB2A35B28EULL,
+    0x84C8D4DFD2C63F3BULL, 0xC5DD44271AD3CDBAULL, 0x936B9FCEBB25C996ULL,
+    0xDBAC6C247D62A584ULL, 0xA3AB66580D5FDAF6ULL, 0xF3E2F893DEC3F126ULL,
+    0xB5B5ADA8AAFF80B8ULL, 0x87625F056C7C4A8BULL, 0xC9BCFF6034C13053ULL,
+    0x964E858C91BA2655ULL, 0xDFF9772470297EBDULL, 0xA6DFBD9FB8E5B88FULL,
+    0xF8A95FCF88747D94ULL, 0xB94470938FA89BCFULL, 0x8A08F0F8BF0F156BULL,
+    0xCDB02555653131B6ULL, 0x993FE2C6D07B7FACULL, 0xE45C10C42A2B3B06ULL,
+    0xAA242499697392D3ULL, 0xFD87B5F28300CA0EULL, 0xBCE5086492111AEBULL,
+    0x8CBCCC096F5088CCULL, 0xD1B71758E219652CULL, 0x9C40000000000000ULL,
+    0xE8D4A51000000000ULL, 0xAD78EBC5AC620000ULL, 0x813F3978F8940984ULL,
+    0xC097CE7BC90715B3ULL, 0x8F7E32CE7BEA5C70ULL, 0xD5D238A4ABE98068ULL,
+    0x9F4F2726179A2245ULL, 0xED63A231D4C4FB27ULL, 0xB0DE65388CC8ADA8ULL,
+    0x83C7088E1AAB65DBULL, 0xC45D1DF942711D9AULL, 0x924D692CA61BE758ULL,
+    0xDA01EE641A708DEAULL, 0xA26DA3999AEF774AULL, 0xF209787BB47D6B85ULL,
+    0xB454E4A179DD1877ULL, 0x865B86925B9BC5C2ULL, 0xC83553C5C8965D3DULL,
+    0x952AB45CFA97A0B3ULL, 0xDE469FBD99A05FE3ULL, 0xA59BC234DB398C25ULL,
+    0xF6C69A72A3989F5CULL, 0xB7DCBF5354E9BECEULL, 0x88FCF317F22241E2ULL,
+    0xCC20CE9BD35C78A5ULL, 0x98165AF37B2153DFULL, 0xE2A0B5DC971F303AULL,
+    0xA8D9D1535CE3B396ULL, 0xFB9B7CD9A4A7443CULL, 0xBB764C4CA7A44410ULL,
+    0x8BAB8EEFB6409C1AULL, 0xD01FEF10A657842CULL, 0x9B10A4E5E9913129ULL,
+    0xE7109BFBA19C0C9DULL, 0xAC2820D9623BF429ULL, 0x80444B5E7AA7CF85ULL,
+    0xBF21E44003ACDD2DULL, 0x8E679C2F5E44FF8FULL, 0xD433179D9C8CB841ULL,
+    0x9E19DB92B4E31BA9ULL, 0xEB96BF6EBADF77D9ULL, 0xAF87023B9BF0EE6BULL};
+
+static const short num_cached_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066};
+
+static const uint64_t num_pow10_u64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL};
+
+/* Product, rounded to the upper 64 bits */
+static struct num_fp num_mul(struct num_fp x, struct num_fp y) {
+  const uint64_t m32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32) + (1ULL << 31);
+  struct num_fp r;
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static struct num_fp num_normalize(struct num_fp x) {
+  while (!(x.f & (1ULL << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+/*
+ * Remove from the last digit while that gets closer to the number, and
+ * stays within the interval: `rest` is what's left below the digits,
+ * `unsafe` the size of the interval, `dist` the distance to the number
+ * from its upper bound, all in units of the last digit times `ten_kappa`.
+ * The scaled numbers are off by up to `unit`: returns 0 if that leaves it
+ * open whether the digits are within the interval or the closest.
+ */
+static int num_weed(char *buf, int len, uint64_t dist, uint64_t unsafe,
+                    uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+  uint64_t small = dist - unit, big = dist + unit;
+
+  while (rest < small && unsafe - rest >= ten_kappa &&
+         (rest + ten_kappa < small ||
+          small - rest >= rest + ten_kappa - small)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+  if (rest < big && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big)) {
+    return 0;
+  }
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/*
+ * Generate the digits of the upper bound `hi` until they are within the
+ * interval from `lo`, widened by the error of the scaling. `*k` is
+ * decreased by the number of digits past the decimal point. Returns the
+ * number of digits, or 0 if they may not be the shortest.
+ */
+static int num_digit_gen(struct num_fp w, struct num_fp lo, struct num_fp hi,
+                         char *buf, int *k) {
+  const int shift = -w.e;
+  const uint64_t one = 1ULL << shift;
+  uint64_t unit = 1, too_high = hi.f + unit, unsafe = too_high - (lo.f - unit);
+  uint32_t p1 = (uint32_t) (too_high >> shift);
+  uint64_t p2 = too_high & (one - 1), dist = too_high - w.f;
+  int kappa = 1, len = 0;
+
+  while (kappa < 10 && p1 >= num_pow10_u64[kappa]) kappa++;
+  while (kappa > 0) {
+    uint32_t p = (uint32_t) num_pow10_u64[kappa - 1], d = p1 / p;
+    uint64_t rest;
+    p1 %= p;
+    if (d != 0 || len != 0) buf[len++] = (char) ('0' + d);
+    kappa--;
+    rest = ((uint64_t) p1 << shift) + p2;
+    if (rest < unsafe) {
+      *k += kappa;
+      return num_weed(buf, len, dist, unsafe, rest, (uint64_t) p << shift,
+                      unit) ? len : 0;
+    }
+  }
+  for (;;) {
+    int d;
+    p2 *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    d = (int) (p2 >> shift);
+    if (d != 0 || len != 0) buf[len++] = (char) ('0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < unsafe) {
+      *k += kappa;
+      return num_weed(buf, len, dist * unit, unsafe, p2, one, unit) ? len : 0;
+    }
+  }
+}
+
+/* Grisu3: the shortest digits, or 0 for the few numbers it can't tell */
+static int num_grisu(double v, int single, char *buf, int *k) {
+  struct num_fp w, hi, lo, c;
+  uint64_t hidden;
+  int closer, i;
+  double dk;
+
+  /* The number and the halfway points to its neighbours */
+  if (single) {
+    float f = (float) v;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    hidden = 1ULL << 23;
+    w.f = bits & (hidden - 1);
+    i = (int) ((bits >> 23) & 0xFF);
+    w.e = i != 0 ? i - 150 : -149;
+  } else {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    hidden = 1ULL << 52;
+    w.f = bits & (hidden - 1);
+    i = (int) ((bits >> 52) & 0x7FF);
+    w.e = i != 0 ? i - 1075 : -1074;
+  }
+  if (i != 0) w.f |= hidden;
+  /* The neighbour below is closer at a power of 2 */
+  closer = w.f == hidden && i > 1;
+  hi.f = (w.f << 1) + 1;
+  hi.e = w.e - 1;
+  hi = num_normalize(hi);
+  lo.f = closer ? (w.f << 2) - 1 : (w.f << 1) - 1;
+  lo.e = closer ? w.e - 2 : w.e - 1;
+  lo.f <<= lo.e - hi.e;
+  lo.e = hi.e;
+  w = num_normalize(w);
+
+  /* Scale by 10^-k, into the range where the digits fit in 32 bits */
+  dk = (-61 - hi.e) * 0.30102999566398114 + 347;
+  i = (int) dk;
+  if (dk - i > 0.0) i++;
+  i = (i >> 3) + 1;
+  *k = -(-348 + i * 8);
+  c.f = num_cached_f[i];
+  c.e = num_cached_e[i];
+  return num_digit_gen(num_mul(w, c), num_mul(lo, c), num_mul(hi, c), buf, k);
+}
+
+int json_shortest(double v, int single, char *buf, int *k) {
+  char tmp[40], *p;
+  int n;
+
+  n = num_grisu(v, single, buf, k);
+  if (n > 0) return n;
+
+  /*
+   * The first correctly rounded number that reads back, from the C
+   * library. The locale is the same both ways, and only the digits and
+   * the exponent are taken from it.
+   */
+  for (n = 1; n < (single ? 9 : 17); n++) {
+    snprintf(tmp, sizeof(tmp), "%.*e", n - 1, v);
+    if (single ? strtof(tmp, NULL) == (float) v : strtod(tmp, NULL) == v) {
+      break;
+    }
+  }
+  snprintf(tmp, sizeof(tmp), "%.*e", n - 1, v);
+  for (p = tmp, n = 0; *p != 'e'; p++) {
+    if (*p >= '0' && *p <= '9') buf[n++] = *p;
+  }
+  *k = atoi(p + 1) - (n - 1);
+  return n;
+}
+
+int json_format_double(char *buf, double v, int single) {
+  char digits[20];
+  int n, k, e, len = 0, i;
+
+  if (v < 0 || (v == 0 && 1 / v < 0)) {
+    buf[len++] = '-';
+    v = -v;
+  }
+  if (v == 0) {
+    buf[len++] = '0';
+    return len;
+  }
+  n = json_shortest(v, single, digits, &k);
+  /*
+   * Where %.15g would switch to an exponent, or %.17g for more digits, and
+   * %.6g or %.9g for a float
+   */
+  e = k + n - 1;
+  if (e < -4 || e >= (single ? (n <= 6 ? 6 : 9) : (n <= 15 ? 15 : 17))) {
+    buf[len++] = digits[0];
+    if (n > 1) {
+      buf[len++] = '.';
+      memcpy(buf + len, digits + 1, n - 1);
+      len += n - 1;
+    }
+    buf[len++] = 'e';
+    buf[len++] = e < 0 ? '-' : '+';
+    if (e < 0) e = -e;
+    if (e < 10) buf[len++] = '0';
+    len += json_format_int(buf + len, 0, (uint64_t) e);
+  } else if (e < 0) {
+    buf[len++] = '0';
+    buf[len++] = '.';
+    for (i = -1; i > e; i--) buf[len++] = '0';
+    memcpy(buf + len, digits, n);
+    len += n;
+  } else {
+    for (i = 0; i <= e; i++) buf[len++] = i < n ? digits[i] : '0';
+    if (n > e + 1) {
+      buf[len++] = '.';
+      memcpy(buf + len, digits + e + 1, n - e - 1);
+      len += n - e - 1;
+    }
+  }
+  return len;
+}
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "elsa.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+/*
+ * Worker threads are POSIX threads. Without them, or with JSON_NO_THREADS
+ * defined, all the work is done in the calling thread.
+ */
+#if !defined(JSON_NO_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#include <pthread.h>
+#define PAR_THREADS 1
+#define PAR_LOCK(p) pthread_mutex_lock(&(p)->lock)
+#define PAR_UNLOCK(p) pthread_mutex_unlock(&(p)->lock)
+#define PAR_WAIT(p) pthread_cond_wait(&(p)->cond, &(p)->lock)
+#define PAR_WAKE(p) pthread_cond_broadcast(&(p)->cond)
+#else
+#define PAR_THREADS 0
+#define PAR_LOCK(p) (void) (p)
+#define PAR_UNLOCK(p) (void) (p)
+#define PAR_WAIT(p) (void) (p)
+#define PAR_WAKE(p) (void) (p)
+#endif
+
+/* Input is handed out to the workers in batches of about this size */
+#define PAR_BATCH_SIZE 65536
+
+/* Callback invocation saved for replaying in order */
+struct par_event {
+  struct json_token token; /* JSON_TYPE_INVALID marks the end of a record */
+  const char *name; /* NULL if it's copied to par_worker::paths */
+  size_t name_len;
+  size_t path; /* Offset of the path in par_worker::paths, name follows */
+  int result;  /* json_walk() result, at the end of a record */
+};
+
+struct par_ctx {
+  const char *start, *end;
+  const struct json_walk_lines_opts *opts;
+  const char *next;   /* Beginning of the next batch to hand out */
+  int done;           /* Non-0 if there's nothing left to hand out */
+  size_t num_batches; /* Number of batches handed out so far */
+  size_t turn;        /* Batch to report next, in ordered mode */
+  size_t num_records;
+
+  /* For json_walk_array() */
+  int array;             /* Non-0 if walking array elements, not lines */
+  int next_index;        /* Index of the first element in the next batch */
+  const char *close;     /* Closing bracket of the array, once found */
+  const char *error_pos; /* Where the first error is, NULL if none */
+  int error;             /* Error code of that error */
+  int stopped;           /* Non-0 if an error is reported in ordered mode */
+#if PAR_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+
+struct par_worker {
+  struct par_ctx *ctx;
+  void *callback_data;
+  struct par_event *events;
+  size_t num_events, max_events;
+  char *paths;
+  size_t paths_len, paths_size;
+  int oom; /* Non-0 if the events didn't fit in memory */
+#if PAR_THREADS
+  pthread_t thread;
+#endif
+};
+
+static int par_reserve(void **buf, size_t *size, size_t need, size_t elem) {
+  void *p;
+  size_t n = *size == 0 ? 64 : *size;
+  if (need <= *size) return 1;
+  while (n < need) n *= 2;
+  if ((p = realloc(*buf, n * elem)) == NULL) return 0;
+  *buf = p;
+  *size = n;
+  return 1;
+}
+
+static void par_save(struct par_worker *w, const char *name, size_t name_len,
+                     const char *path, const struct json_token *token,
+                     int result) {
+  size_t path_len = path == NULL ? 0 : strlen(path) + 1, copy_len = 0;
+  struct par_event *ev;
+  /* Array indices are given as names, but they are not in the input */
+  if (name != NULL && (name < w->ctx->start || name >= w->ctx->end)) {
+    copy_len = name_len;
+  }
+  if (w->oom ||
+      !par_reserve((void **) &w->events, &w->max_events, w->num_events + 1,
+                   sizeof(*w->events)) ||
+      !par_reserve((void **) &w->paths, &w->paths_size,
+                   w->paths_len + path_len + copy_len, 1)) {
+    w->oom = 1;
+    return;
+  }
+  ev = &w->events[w->num_events++];
+  ev->token = *token;
+  ev->name = copy_len > 0 ? NULL : name;
+  ev->name_len = name_len;
+  ev->path = w->paths_len;
+  ev->result = result;
+  if (path_len > 0) memcpy(w->paths + w->paths_len, path, path_len);
+  if (copy_len > 0) memcpy(w->paths + w->paths_len + path_len, name, copy_len);
+  w->paths_len += path_len + copy_len;
+}
+
+static void par_save_cb(void *userdata, const char *name, size_t name_len,
+                        const char *path, const struct json_token *token) {
+  par_save((struct par_worker *) userdata, name, name_len, path, token, 0);
+}
+
+/* Remember the error if it is the first one in the input so far */
+static void par_error(struct par_ctx *ctx, const char *pos, int error) {
+  PAR_LOCK(ctx);
+  if (ctx->error_pos == NULL || pos < ctx->error_pos) {
+    ctx->error_pos = pos;
+    ctx->error = error;
+  }
+  PAR_UNLOCK(ctx);
+}
+
+/*
+ * Walk one record, or save its events to be reported later. Array elements
+ * are walked with their index as `index`, lines with `index` < 0.
+ * Return what json_walk() returns.
+ */
+static int par_walk(struct par_worker *w, const char *rec, size_t len,
+                    int index, int save) {
+  const struct json_walk_lines_opts *opts = w->ctx->opts;
+  json_walk_callback_t cb = save ? par_save_cb : opts->callback;
+  void *data = save ? (void *) w : w->callback_data;
+  struct json_token t;
+  ptrdiff_t res = JSON_STRING_INVALID;
+  t.ptr = rec;
+  t.len = len > INT_MAX ? INT_MAX : (int) len;
+  t.type = JSON_TYPE_INVALID;
+  if (index >= 0) {
+    /*
+     * The element must end where array_skip() says it does. The parser
+     * sees what follows it, to tell e.g. "n]" from an incomplete "null".
+     */
+    res = json_walk_element(rec, w->ctx->end - rec, index, cb, data);
+    if (res >= 0 && (size_t) res != len) res = JSON_STRING_INVALID;
+    if (res < 0) par_error(w->ctx, rec, (int) res);
+  } else if (len <= INT_MAX) {
+    res = json_walk(rec, t.len, cb, data);
+  }
+  if (res > INT_MAX) res = INT_MAX;
+  if (save) {
+    par_save(w, NULL, 0, NULL, &t, (int) res);
+  } else if (opts->result != NULL) {
+    opts->result(w->callback_data, rec, t.len, (int) res);
+  }
+  return (int) res;
+}
+
+/*
+ * Call the callbacks saved by par_walk(). An array element that fails to
+ * parse ends the walk, just like in json_walk(): return 0 after it.
+ */
+static int par_replay(struct par_worker *w) {
+  const struct json_walk_lines_opts *opts = w->ctx->opts;
+  int ok = 1;
+  size_t i;
+  for (i = 0; i < w->num_events && ok; i++) {
+    const struct par_event *ev = &w->events[i];
+    if (ev->token.type != JSON_TYPE_INVALID) {
+      const char *path = w->paths + ev->path, *name = ev->name;
+      if (name == NULL && ev->name_len > 0) name = path + strlen(path) + 1;
+      if (opts->callback != NULL) {
+        opts->callback(w->callback_data, name, ev->name_len, path,
+                       &ev->token);
+      }
+    } else {
+      if (opts->result != NULL) {
+        opts->result(w->callback_data, ev->token.ptr, ev->token.len,
+                     ev->result);
+      }
+      if (w->ctx->array && ev->result < 0) ok = 0;
+    }
+  }
+  w->num_events = w->paths_len = 0;
+  return ok;
+}
+
+/* Walk all non-blank lines in [p, end), return the number of them */
+static size_t lines_batch(struct par_worker *w, const char *p,
+                          const char *end, int save) {
+  size_t n = 0;
+  while (p < end) {
+    const char *eol = (const char *) memchr(p, '\n', end - p);
+    const char *next = eol == NULL ? end : eol + 1;
+    if (eol == NULL) eol = end;
+    if (json_scan_spaces(p, eol) < eol) {
+      par_walk(w, p, eol - p, -1, save);
+      n++;
+    }
+    p = next;
+  }
+  return n;
+}
+
+/* Take the lines from ctx->next to a line end at least a batch away */
+static const char *lines_next_batch(struct par_ctx *ctx) {
+  const char *p = ctx->next, *end = ctx->end;
+  if ((size_t) (end - p) > PAR_BATCH_SIZE) {
+    end = (const char *) memchr(p + PAR_BATCH_SIZE - 1, '\n',
+                                ctx->end - p - PAR_BATCH_SIZE + 1);
+    end = end == NULL ? ctx->end : end + 1;
+  }
+  return end;
+}
+
+/*
+ * End of the value at `p`, like json_scan_skip(), but scalars end where
+ * json_walk() stops parsing them: "1true" is two values for it.
+ */
+static const char *array_skip(const char *p, const char *end) {
+  const char *q = p, *d;
+  if (*p == 't' || *p == 'f' || *p == 'n') {
+    const char *lit = *p == 't' ? "true" : *p == 'f' ? "false" : "null";
+    size_t n = strlen(lit);
+    if ((size_t) (end - p) >= n && memcmp(p, lit, n) == 0) return p + n;
+  } else if (*p == '-' || is_digit(*p)) {
+    /* A malformed number ends early, and the parser reports it */
+    if (*q == '-') q++;
+    while (q < end && is_digit(*q)) q++;
+    if (q + 1 < end && *q == '.' && is_digit(q[1])) {
+      q++;
+      while (q < end && is_digit(*q)) q++;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+      d = q + 1;
+      if (d < end && (*d == '+' || *d == '-')) d++;
+      if (d < end && is_digit(*d)) {
+        q = d;
+        while (q < end && is_digit(*q)) q++;
+      }
+    }
+    return q;
+  }
+  return json_scan_skip(p, end);
+}
+
+/*
+ * Walk the array elements in [p, end), checked by array_next_batch().
+ * Like json_walk(), stop at the first one that fails to parse.
+ */
+static size_t array_batch(struct par_worker *w, const char *p,
+                          const char *end, int index, int save) {
+  size_t n = 0;
+  while ((p = json_scan_spaces(p, end)) < end) {
+    const char *e = array_skip(p, end);
+    if (e == NULL) e = end;
+    n++;
+    if (par_walk(w, p, e - p, index++, save) < 0) break;
+    p = json_scan_spaces(e, end);
+    if (p < end && *p == ',') p++;
+  }
+  return n;
+}
+
+/*
+ * Take array elements from ctx->next until there's a batch of them,
+ * jumping over them by counting quotes and brackets. What's between the
+ * elements is checked here, since nothing else parses it: like in
+ * json_walk(), commas are optional, and one is allowed before the end.
+ * Return the end of the batch, and set `count` to the number of elements.
+ */
+static const char *array_next_batch(struct par_ctx *ctx, int *count) {
+  const char *start = ctx->next, *p = start, *e = start, *v, *end = ctx->end;
+  int error = 0;
+
+  for (*count = 0; e - start < PAR_BATCH_SIZE && !ctx->done;) {
+    p = json_scan_spaces(p, end);
+    if (p >= end) {
+      error = JSON_STRING_INCOMPLETE;
+      break;
+    } else if (*p == ']') {
+      ctx->close = p;
+      break;
+    } else if ((v = array_skip(p, end)) == p) {
+      error = JSON_STRING_INVALID;
+      break;
+    }
+    /* Incomplete element is walked anyway, to report what's there */
+    ctx->done = v == NULL;
+    e = v == NULL ? end : v;
+    ++*count;
+    p = json_scan_spaces(e, end);
+    if (p < end && *p == ',') p++;
+  }
+
+  if (error != 0 && (ctx->error_pos == NULL || p < ctx->error_pos)) {
+    ctx->error_pos = p;
+    ctx->error = error;
+  }
+  if (error != 0 || ctx->close != NULL) ctx->done = 1;
+  ctx->next = p;
+  ctx->next_index += *count;
+  return e;
+}
+
+static void *par_worker_main(void *arg) {
+  struct par_worker *w = (struct par_worker *) arg;
+  struct par_ctx *ctx = w->ctx;
+  int ordered = ctx->opts->flags & JSON_WALK_LINES_ORDERED;
+
+  for (;;) {
+    const char *p, *end;
+    size_t batch, n;
+    int index = 0, count;
+
+    /* Take the next batch */
+    PAR_LOCK(ctx);
+    p = ctx->next;
+    if (ctx->done || ctx->error_pos != NULL) {
+      PAR_UNLOCK(ctx);
+      break;
+    }
+    if (ctx->array) {
+      index = ctx->next_index;
+      end = array_next_batch(ctx, &count);
+    } else {
+      end = ctx->next = lines_next_batch(ctx);
+      ctx->done = end >= ctx->end;
+    }
+    batch = ctx->num_batches++;
+    PAR_UNLOCK(ctx);
+
+    /*
+     * In ordered mode, the batch is parsed right away, and its events are
+     * reported when all the previous batches are. If they don't fit in
+     * memory, the batch is parsed again at that point instead.
+     */
+    n = ctx->array ? array_batch(w, p, end, index, ordered)
+                   : lines_batch(w, p, end, ordered);
+
+    PAR_LOCK(ctx);
+    if (ordered) {
+      while (ctx->turn != batch) PAR_WAIT(ctx);
+      PAR_UNLOCK(ctx);
+      if (ctx->stopped) {
+        w->num_events = w->paths_len = 0;
+      } else if (w->oom) {
+        w->num_events = w->paths_len = 0;
+        w->oom = 0;
+        n = ctx->array ? array_batch(w, p, end, index, 0)
+                       : lines_batch(w, p, end, 0);
+      } else if (!par_replay(w)) {
+        ctx->stopped = 1;
+      }
+      PAR_LOCK(ctx);
+      ctx->turn++;
+      PAR_WAKE(ctx);
+    }
+    ctx->num_records += n;
+    PAR_UNLOCK(ctx);
+  }
+
+  return NULL;
+}
+
+/* Run par_worker_main() in `num_threads` threads, the calling one included */
+static int par_run(struct par_ctx *ctx, const char *s) {
+  const struct json_walk_lines_opts *opts = ctx->opts;
+  struct par_worker *workers;
+  int i, num_threads = opts->num_threads < 1 ? 1 : opts->num_threads;
+
+  if (!PAR_THREADS) num_threads = 1;
+  workers = (struct par_worker *) calloc(num_threads, sizeof(*workers));
+  if (workers == NULL) return JSON_STRING_INVALID;
+
+  ctx->next = s;
+#if PAR_THREADS
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->cond, NULL);
+#endif
+
+  for (i = 0; i < num_threads; i++) {
+    workers[i].ctx = ctx;
+    workers[i].callback_data =
+        opts->callback_data == NULL ? NULL : opts->callback_data[i];
+  }
+
+  /*
+   * The calling thread is the first worker. Others take the batches as they
+   * go, so if some of them fail to start, the rest do all the work.
+   */
+#if PAR_THREADS
+  for (i = 1; i < num_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, par_worker_main,
+                       &workers[i]) != 0) {
+      workers[i].ctx = NULL;
+    }
+  }
+#endif
+  par_worker_main(&workers[0]);
+  for (i = 0; i < num_threads; i++) {
+#if PAR_THREADS
+    if (i > 0 && workers[i].ctx != NULL) pthread_join(workers[i].thread, NULL);
+#endif
+    free(workers[i].events);
+    free(workers[i].paths);
+  }
+
+#if PAR_THREADS
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->cond);
+#endif
+  free(workers);
+  return 0;
+}
+
+ptrdiff_t json_walk_lines(const char *s, size_t len,
+                          const struct json_walk_lines_opts *opts) {
+  struct par_ctx ctx;
+  int res;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.start = s;
+  ctx.end = s + len;
+  ctx.opts = opts;
+  ctx.done = len == 0;
+  if ((res = par_run(&ctx, s)) < 0) return res;
+  return (ptrdiff_t) ctx.num_records;
+}
+
+ptrdiff_t json_walk_array(const char *s, size_t len,
+                          const struct json_walk_lines_opts *opts) {
+  const char *p = json_scan_spaces(s, s + len);
+  void *data = opts->callback_data == NULL ? NULL : opts->callback_data[0];
+  struct par_ctx ctx;
+  struct json_token t;
+  int res;
+
+  /* Anything but an array is walked as usual */
+  if (p >= s + len || *p != '[') {
+    if (len > INT_MAX) return JSON_STRING_INVALID;
+    return json_walk(s, (int) len, opts->callback, data);
+  }
+
+  /* The array itself is reported by the calling thread */
+  t.ptr = NULL;
+  t.len = 0;
+  t.type = JSON_TYPE_ARRAY_START;
+  if (opts->callback != NULL) opts->callback(data, NULL, 0, "", &t);
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.start = s;
+  ctx.end = s + len;
+  ctx.opts = opts;
+  ctx.array = 1;
+  if ((res = par_run(&ctx, p + 1)) < 0) return res;
+  if (ctx.error_pos != NULL) return ctx.error;
+
+  t.ptr = p;
+  t.len = (ctx.close + 1 - p) > INT_MAX ? INT_MAX : (int) (ctx.close + 1 - p);
+  t.type = JSON_TYPE_ARRAY_END;
+  if (opts->callback != NULL) opts->callback(data, NULL, 0, "", &t);
+  return ctx.close + 1 - s;
+}
@@ -31,30 +31,31 @@ static void indent(struct json_out *out, int level) {
   while (level-- > 0) out->printer(out, "  ", 2);
 }
 
-static void print_key(struct prettify_data *pd, const char *path,
-                      const char *name, int name_len) {
+/* `name` is NULL for array elements and for the top-level value */
+static void print_key(struct prettify_data *pd, int nested, const char *name,
+                      size_t name_len) {
   if (pd->last_token != JSON_TYPE_INVALID &&
       pd->last_token != JSON_TYPE_ARRAY_START &&
       pd->last_token != JSON_TYPE_OBJECT_START) {
     pd->out->printer(pd->out, ",", 1);
   }
-  if (path[0] != '\0') pd->out->printer(pd->out, "\n", 1);
+  if (nested) pd->out->printer(pd->out, "\n", 1);
   indent(pd->out, pd->level);
-  if (path[0] != '\0' && path[strlen(path) - 1] != ']') {
+  if (name != NULL) {
     pd->out->printer(pd->out, "\"", 1);
-    pd->out->printer(pd->out, name, (int) name_len);
+    pd->out->printer(pd->out, name, name_len);
     pd->out->printer(pd->out, "\"", 1);
     pd->out->printer(pd->out, ": ", 2);
   }
 }
 
-static void prettify_cb(void *userdata, const char *name, size_t name_len,
-                        const char *path, const struct json_token *t) {
-  struct prettify_data *pd = (struct prettify_data *) userdata;
+static void prettify_token(struct prettify_data *pd, int nested,
+                           const char *name, size_t name_len,
+                           const struct json_token64 *t) {
   switch (t->type) {
     case JSON_TYPE_OBJECT_START:
     case JSON_TYPE_ARRAY_START:
-      print_key(pd, path, name, name_len);
+      print_key(pd, nested, name, name_len);
       pd->out->printer(pd->out, t->type == JSON_TYPE_ARRAY_START ? "[" : "{",
                        1);
       pd->level++;
@@ -75,7 +76,7 @@ static void prettify_cb(void *userdata, const char *name, size_t name_len,
     case JSON_TYPE_TRUE:
     case JSON_TYPE_FALSE:
     case JSON_TYPE_STRING:
-      print_key(pd, path, name, name_len);
+      print_key(pd, nested, name, name_len);
       if (t->type == JSON_TYPE_STRING) pd->out->printer(pd->out, "\"", 1);
       pd->out->printer(pd->out, t->ptr, t->len);
       if (t->type == JSON_TYPE_STRING) pd->out->printer(pd->out, "\"", 1);
@@ -86,9 +87,22 @@ static void prettify_cb(void *userdata, const char *name, size_t name_len,
   pd->last_token = t->type;
 }
 
+static int prettify_cb(void *userdata, const struct json_walk_event *ev,
+                       const struct json_token64 *t) {
+  prettify_token((struct prettify_data *) userdata, ev->depth > 0, ev->name,
+                 ev->name_len, t);
+  return 0;
+}
+
 int json_prettify(const char *s, int len, struct json_out *out) {
+  if (len < 0) return JSON_STRING_INVALID;
+  return (int) json_prettify64(s, len, out);
+}
+
+ptrdiff_t json_prettify64(const char *s, size_t len, struct json_out *out) {
   struct prettify_data pd = {out, 0, JSON_TYPE_INVALID};
-  return json_walk(s, len, prettify_cb, &pd);
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  return json_walk_ex64(s, len, &opts, prettify_cb, &pd);
 }
 
 int json_prettify_file(const char *file_name) {
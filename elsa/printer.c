@@ -16,9 +16,46 @@
  */
 
 #include "elsa.h"
+#include <errno.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "util.h"
+
+/* A large output is written together with the buffered one by writev() */
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#include <unistd.h>
+#define PRINTER_WRITEV 1
+#elif defined(_WIN32)
+#include <io.h>
+#define write(fd, buf, len) _write(fd, buf, (unsigned int) (len))
+#endif
+
+#ifndef PRINTER_WRITEV
+/* Same as POSIX, for JSON_OUT_IOV() where there's no <sys/uio.h> */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+/* First size malloc-ed by JSON_OUT_DYNBUF() */
+#ifndef JSON_DYNBUF_MIN_SIZE
+#define JSON_DYNBUF_MIN_SIZE 256
+#endif
+
+/* Shortest string that JSON_OUT_IOV() references rather than copies */
+#ifndef JSON_IOV_MIN_REF
+#define JSON_IOV_MIN_REF 256
+#endif
+
+/* Space taken from the arena at a time for the copies of JSON_OUT_IOV() */
+#ifndef JSON_IOV_COPY_SIZE
+#define JSON_IOV_COPY_SIZE 1024
+#endif
 
 int json_printer_buf(struct json_out *out, const char *buf, size_t len) {
   size_t avail = out->u.buf.size - out->u.buf.len;
@@ -36,3 +73,204 @@ int json_printer_buf(struct json_out *out, const char *buf, size_t len) {
 int json_printer_file(struct json_out *out, const char *buf, size_t len) {
   return fwrite(buf, 1, len, out->u.fp);
 }
+
+int json_printer_dynbuf(struct json_out *out, const char *buf, size_t len) {
+  size_t need = out->u.buf.len + len + 1; /* With the NUL */
+
+  if (need > out->u.buf.size) {
+    /* Double the size, so that printing n bytes copies O(n) in total */
+    size_t size = out->u.buf.size < JSON_DYNBUF_MIN_SIZE / 2
+                      ? JSON_DYNBUF_MIN_SIZE
+                      : out->u.buf.size * 2;
+    char *p;
+    if (size < need) size = need;
+    if (need <= out->u.buf.len ||
+        (p = (char *) realloc(out->u.buf.buf, size)) == NULL) {
+      /* Out of memory: keep what fits, as json_printer_buf() does */
+      return json_printer_buf(out, buf, len);
+    }
+    out->u.buf.buf = p;
+    out->u.buf.size = size;
+  }
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, len);
+  out->u.buf.len += len;
+  out->u.buf.buf[out->u.buf.len] = '\0';
+  return len;
+}
+
+void json_out_dynbuf_reset(struct json_out *out) {
+  out->u.buf.len = 0;
+  if (out->u.buf.buf != NULL) out->u.buf.buf[0] = '\0';
+}
+
+void json_out_dynbuf_free(struct json_out *out) {
+  free(out->u.buf.buf);
+  out->u.buf.buf = NULL;
+  out->u.buf.size = out->u.buf.len = 0;
+}
+
+/* Write `a` and then `b` to `fd`, in full. Return 0, or -1 on error */
+static int printer_write(int fd, const char *a, size_t a_len, const char *b,
+                         size_t b_len) {
+  while (a_len + b_len > 0) {
+    long n;
+#ifdef PRINTER_WRITEV
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) a;
+    iov[0].iov_len = a_len;
+    iov[1].iov_base = (void *) b;
+    iov[1].iov_len = b_len;
+    n = (long) writev(fd, a_len > 0 ? iov : iov + 1, a_len > 0 ? 2 : 1);
+#else
+    n = (long) (a_len > 0 ? write(fd, a, a_len) : write(fd, b, b_len));
+#endif
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    if ((size_t) n < a_len) {
+      a += n;
+      a_len -= n;
+    } else {
+      n -= (long) a_len;
+      a_len = 0;
+      b += n;
+      b_len -= n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Write the buffered output, and then `buf,len`, to the file descriptor or
+ * the stream, emptying the buffer. Return 0, or -1 on error.
+ */
+static int printer_drain(struct json_out *out, const char *buf, size_t len) {
+  size_t buffered = out->u.buf.len;
+  int res;
+
+  out->u.buf.len = 0;
+  if (out->printer == json_printer_fd) {
+    res = out->u.buf.fd < 0 ? -1
+                            : printer_write(out->u.buf.fd, out->u.buf.buf,
+                                            buffered, buf, len);
+    if (res < 0) out->u.buf.fd = -1;
+  } else {
+    FILE *fp = out->u.buf.fp;
+    res = 0;
+    if (buffered > 0 && fwrite(out->u.buf.buf, 1, buffered, fp) != buffered) {
+      res = -1;
+    }
+    if (len > 0 && fwrite(buf, 1, len, fp) != len) res = -1;
+  }
+  return res;
+}
+
+/*
+ * Buffer `buf,len`, writing the buffer when it's full: the output is
+ * written in pieces of exactly the size of the buffer, but for the ones at
+ * least that large, which go right after the buffered output.
+ */
+static int printer_buffered(struct json_out *out, const char *buf,
+                            size_t len) {
+  size_t avail = out->u.buf.size - out->u.buf.len;
+
+  if (len == 0) return 0;
+  if (len <= avail) {
+    memcpy(out->u.buf.buf + out->u.buf.len, buf, len);
+    out->u.buf.len += len;
+  } else if (len < out->u.buf.size) {
+    memcpy(out->u.buf.buf + out->u.buf.len, buf, avail);
+    out->u.buf.len += avail;
+    if (printer_drain(out, NULL, 0) < 0) return 0;
+    memcpy(out->u.buf.buf, buf + avail, len - avail);
+    out->u.buf.len = len - avail;
+  } else if (printer_drain(out, buf, len) < 0) {
+    return 0;
+  }
+  return len;
+}
+
+int json_printer_fd(struct json_out *out, const char *buf, size_t len) {
+  return out->u.buf.fd < 0 ? 0 : printer_buffered(out, buf, len);
+}
+
+int json_printer_file_buf(struct json_out *out, const char *buf, size_t len) {
+  return printer_buffered(out, buf, len);
+}
+
+int json_out_flush(struct json_out *out) {
+  int res = printer_drain(out, NULL, 0);
+  if (out->printer == json_printer_fd) return res;
+  return fflush(out->u.buf.fp) != 0 || ferror(out->u.buf.fp) ? -1 : res;
+}
+
+void json_iov_init(struct json_iov *iov, void *buf, size_t size) {
+  iov->iov = NULL;
+  iov->num_iov = iov->max_iov = 0;
+  iov->copy = iov->init = (char *) buf;
+  iov->copy_avail = iov->init_size = buf == NULL ? 0 : size;
+  json_arena_init(&iov->arena, NULL, 0);
+}
+
+void json_iov_reset(struct json_iov *iov) {
+  iov->num_iov = 0;
+  iov->copy = iov->init;
+  iov->copy_avail = iov->init_size;
+  json_arena_reset(&iov->arena);
+}
+
+void json_iov_free(struct json_iov *iov) {
+  free(iov->iov);
+  json_arena_free(&iov->arena);
+  json_iov_init(iov, iov->init, iov->init_size);
+}
+
+/* Append `p,len` to the list, to the last piece if it ends at `p` */
+static int printer_iov_add(struct json_iov *iov, const char *p, size_t len) {
+  struct iovec *last = iov->num_iov > 0 ? &iov->iov[iov->num_iov - 1] : NULL;
+
+  if (last != NULL && (const char *) last->iov_base + last->iov_len == p) {
+    last->iov_len += len;
+    return 1;
+  }
+  if (iov->num_iov == iov->max_iov) {
+    int n = iov->max_iov == 0 ? 16 : iov->max_iov * 2;
+    struct iovec *a;
+    if (iov->max_iov > INT_MAX / 2 ||
+        (a = (struct iovec *) realloc(iov->iov, n * sizeof(*a))) == NULL) {
+      return 0;
+    }
+    iov->iov = a;
+    iov->max_iov = n;
+  }
+  iov->iov[iov->num_iov].iov_base = (void *) p;
+  iov->iov[iov->num_iov].iov_len = len;
+  iov->num_iov++;
+  return 1;
+}
+
+int json_printer_iov(struct json_out *out, const char *buf, size_t len) {
+  struct json_iov *iov = (struct json_iov *) out->u.data;
+
+  if (len == 0) return 0;
+  if (len > iov->copy_avail) {
+    /* The rest of the current space is left unused */
+    size_t size = len < JSON_IOV_COPY_SIZE ? JSON_IOV_COPY_SIZE : len;
+    char *p = (char *) json_arena_alloc(&iov->arena, size);
+    if (p == NULL) return 0;
+    iov->copy = p;
+    iov->copy_avail = size;
+  }
+  /* Consecutive copies go into a single piece */
+  if (!printer_iov_add(iov, iov->copy, len)) return 0;
+  memcpy(iov->copy, buf, len);
+  iov->copy += len;
+  iov->copy_avail -= len;
+  return len;
+}
+
+int json_out_ref(struct json_out *out, const char *buf, size_t len) {
+  if (out->printer != json_printer_iov || len < JSON_IOV_MIN_REF) {
+    return out->printer(out, buf, len);
+  }
+  return printer_iov_add((struct json_iov *) out->u.data, buf, len) ? len : 0;
+}
@@ -16,6 +16,7 @@
  */
 
 #include "elsa.h"
+#include <locale.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -53,265 +54,746 @@ static int b64enc(struct json_out *out, const unsigned char *p, int n) {
   return len;
 }
 
-int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
-  int len = 0;
-  const char *quote = "\"", *null = "null";
-  va_list ap;
-  va_copy(ap, xap);
+/* Larger precisions are only known to be at least that */
+#define PRINTF_MAX_PREC 100000000
+
+/* Argument of a conversion left to the system printf(), see printf_spec() */
+enum printf_arg {
+  PRINTF_INT,
+  PRINTF_LONG,
+  PRINTF_LLONG,
+  PRINTF_INTMAX,
+  PRINTF_SIZE,
+  PRINTF_PTRDIFF,
+  PRINTF_DOUBLE,
+  PRINTF_LDOUBLE,
+  PRINTF_WINT,
+  PRINTF_STR,
+  PRINTF_WSTR,
+  PRINTF_PTR,
+  PRINTF_COUNT, /* %n */
+  PRINTF_NONE   /* %% */
+};
+
+/* Conversion left to the system printf() */
+struct printf_spec {
+  int n;        /* Length of the conversion in the format */
+  int dyn_args; /* Number of `*` width and precision arguments */
+  int prec;     /* Precision, -1 if none or `*` */
+  char len_mod; /* Length modifier, '1' for hh and '8' for ll */
+  char conv;    /* Conversion specifier */
+  char plain;   /* No flags or width, for printf_fast() and %s */
+  char arg;     /* enum printf_arg */
+};
+
+/* One piece of a json_printf() format */
+struct printf_op {
+  const char *str; /* Literal text, or the NUL-terminated printf() format */
+  int len;         /* Length of the literal text */
+  char type;       /* 0 for text, the conversion, or '%' for the system's */
+  struct printf_spec spec;
+};
 
-  while (*fmt != '\0') {
-    if (strchr(":, \r\n\t[]{}\"", *fmt) != NULL) {
-      len += out->printer(out, fmt, 1);
-      fmt++;
-    } else if (fmt[0] == '%') {
-      char buf[101];
-      size_t skip = 2;
-
-      if (fmt[1] == 'M') {
-        json_printf_callback_t f = va_arg(ap, json_printf_callback_t);
-        len += f(out, &ap);
-      } else if (fmt[1] == 'B') {
-        int val = va_arg(ap, int);
-        const char *str = val ? "true" : "false";
-        len += out->printer(out, str, strlen(str));
-      } else if (fmt[1] == 'H') {
-        const char *hex = "0123456789abcdef";
-        int i, n = va_arg(ap, int);
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        len += out->printer(out, quote, 1);
-        for (i = 0; i < n; i++) {
-          len += out->printer(out, &hex[(p[i] >> 4) & 0xf], 1);
-          len += out->printer(out, &hex[p[i] & 0xf], 1);
-        }
-        len += out->printer(out, quote, 1);
-      } else if (fmt[1] == 'V') {
-        const unsigned char *p = va_arg(ap, const unsigned char *);
-        int n = va_arg(ap, int);
-        len += out->printer(out, quote, 1);
-        len += b64enc(out, p, n);
-        len += out->printer(out, quote, 1);
-      } else if (fmt[1] == 'Q' ||
-                 (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 'Q')) {
-        size_t l = 0;
-        const char *p;
-
-        if (fmt[1] == '.') {
-          l = (size_t) va_arg(ap, int);
-          skip += 2;
-        }
-        p = va_arg(ap, char *);
+/*
+ * Compiled format: the literal text, with the keys already quoted, merged
+ * into as few pieces as possible, and the conversions in between. It is
+ * allocated as a whole, with the pieces and their text following the
+ * header, and is never modified after json_printf_compile().
+ */
+struct json_printf_template {
+  int num_ops;
+  struct printf_op *ops;
+};
 
-        if (p == NULL) {
-          len += out->printer(out, null, 4);
-        } else {
-          if (fmt[1] == 'Q') {
-            l = strlen(p);
-          }
-          len += out->printer(out, quote, 1);
-          len += json_escape(out, p, l);
-          len += out->printer(out, quote, 1);
-        }
-      } else {
-        /*
-         * we delegate printing to the system printf.
-         * The goal here is to delegate all modifiers parsing to the system
-         * printf, as you can see below we still have to parse the format
-         * types.
-         */
-
-        size_t n = 1;
-        char *pbuf = buf;
-        size_t need_len;
-        char fmt2[30];
-        va_list sub_ap;
-
-        int dyn_args = 0;
-        char len_mod = '\0';
-        char prn_spec;
-
-        /* flags (-, +, #, 0, or space) */
-        while (strchr("-+#0 ", fmt[n]) != NULL) {
-          ++n;
-        }
+/*
+ * Parse the conversion at `fmt`, which the system printf() does. The goal
+ * is to delegate all modifiers parsing to the system printf, but we still
+ * have to know the type of the argument.
+ */
+static void printf_spec(const char *fmt, struct printf_spec *s) {
+  size_t n = 1;
+  char len_mod = '\0';
+  char prn_spec;
 
-        /* width (* or number) */
-        if (fmt[n] == '*') {
-          ++dyn_args;
-          ++n;
-        } else {
-          while (is_digit(fmt[n]))
-            ++n;
-        }
+  s->dyn_args = 0;
+  s->prec = -1;
 
-        /* precision (.* or .number) */
-        if (fmt[n] == '.') {
-          ++n;
+  /* flags (-, +, #, 0, or space) */
+  while (fmt[n] != '\0' && strchr("-+#0 ", fmt[n]) != NULL) {
+    ++n;
+  }
 
-          if (fmt[n] == '*') {
-            ++dyn_args;
-            ++n;
-          } else {
-            while (is_digit(fmt[n]))
-              ++n;
-          }
-        }
+  /* width (* or number) */
+  if (fmt[n] == '*') {
+    ++s->dyn_args;
+    ++n;
+  } else {
+    while (is_digit(fmt[n]))
+      ++n;
+  }
+  s->plain = n == 1;
+
+  /* precision (.* or .number) */
+  if (fmt[n] == '.') {
+    ++n;
 
-        /* length modifier (hh, h, l, ll, j, z, t, L) */
-        /* Windows once used I, I32, and I64 as extensions */
-        switch (fmt[n]) {
-          case 'h':
-          case 'l':
-          case 'j':
-          case 'z':
-          case 't':
-          case 'L':
-          case 'I':
-            len_mod = fmt[n];
-            ++n;
+    if (fmt[n] == '*') {
+      ++s->dyn_args;
+      ++n;
+    } else {
+      s->prec = 0;
+      while (is_digit(fmt[n])) {
+        if (s->prec < PRINTF_MAX_PREC) {
+          s->prec = s->prec * 10 + (fmt[n] - '0');
         }
+        ++n;
+      }
+    }
+  }
+
+  /* length modifier (hh, h, l, ll, j, z, t, L) */
+  /* Windows once used I, I32, and I64 as extensions */
+  switch (fmt[n]) {
+    case 'h':
+    case 'l':
+    case 'j':
+    case 'z':
+    case 't':
+    case 'L':
+    case 'I':
+      len_mod = fmt[n];
+      ++n;
+  }
+
+  if (len_mod == 'h' && fmt[n] == 'h') {
+    len_mod = '1'; /* magic value representing 'hh' */
+    ++n;
+  } else if (len_mod == 'l' && fmt[n] == 'l') {
+    len_mod = '8';  /* magic value representing 'll' */
+    ++n;
+  } else if (len_mod == 'I') {
+    len_mod = 'j';                                   /* LCOV_EXCL_LINE */
+    if (fmt[n] == '3' && fmt[n+1] == '2') {          /* LCOV_EXCL_LINE */
+      if (sizeof(int) >= 4) len_mod = '\0';          /* LCOV_EXCL_LINE */
+      else                  len_mod = 'l';           /* LCOV_EXCL_LINE */
+      n += 2;                                        /* LCOV_EXCL_LINE */
+    } else if (fmt[n] == '6' && fmt[n+1] == '4') {   /* LCOV_EXCL_LINE */
+      if (sizeof(int) >= 8)            len_mod = '\0';/* LCOV_EXCL_LINE*/
+      else if (sizeof(long) >= 8)      len_mod = 'l';/* LCOV_EXCL_LINE */
+      else if (sizeof(long long) >= 8) len_mod = '8';/* LCOV_EXCL_LINE */
+      n += 2;                                        /* LCOV_EXCL_LINE */
+    }
+  }
+
+  /* specifier (diouxX, aAeEfFgG, c, s, p, n, %) */
+  /* %C and %S are extensions equivalent to %lc and %ls */
+  prn_spec = fmt[n];
+  if (prn_spec != '\0') n++;
+
+  switch (prn_spec) {
+    /* integer */
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      switch (len_mod) {
+        case 'l': s->arg = PRINTF_LONG; break;
+        case '8': s->arg = PRINTF_LLONG; break;
+        case 'j': s->arg = PRINTF_INTMAX; break;
+        case 'z': s->arg = PRINTF_SIZE; break;
+        case 't': s->arg = PRINTF_PTRDIFF; break;
+        default: s->arg = PRINTF_INT;
+      }
+      break;
+
+    /* floating point */
+    case 'a': case 'A': case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G':
+      s->arg = len_mod == 'L' ? PRINTF_LDOUBLE : PRINTF_DOUBLE;
+      break;
+
+    /* character */
+    case 'c': case 'C':
+      s->arg = prn_spec == 'C' || len_mod == 'l' ? PRINTF_WINT : PRINTF_INT;
+      break;
+
+    /* string */
+    case 's': case 'S':
+      s->arg = prn_spec == 'S' || len_mod == 'l' ? PRINTF_WSTR : PRINTF_STR;
+      break;
+
+    /* pointer */
+    case 'p':
+      s->arg = PRINTF_PTR;
+      break;
+
+    /* pointer-out */
+    case 'n':
+      s->arg = PRINTF_COUNT;
+      break;
+
+    case '%':
+      s->arg = PRINTF_NONE;
+      break;
+
+    default:                                         /* LCOV_EXCL_LINE */
+      /* if the specifier is unknown, treat it as an int and pray */
+      s->arg = PRINTF_INT;                           /* LCOV_EXCL_LINE */
+  }
+
+  s->n = (int) n;
+  s->len_mod = len_mod;
+  s->conv = prn_spec;
+}
+
+/*
+ * Parse the conversion at `fmt` into `op`, except for the format of a
+ * system printf() one. Return its length.
+ */
+static int printf_conv(const char *fmt, struct printf_op *op) {
+  op->len = 0;
+  switch (fmt[1]) {
+    case 'M':
+    case 'B':
+    case 'H':
+    case 'V':
+    case 'Q':
+      op->type = fmt[1];
+      return 2;
+    case '.':
+      if (fmt[2] == '*' && fmt[3] == 'Q') {
+        op->type = 'q';
+        return 4;
+      }
+    /* FALLTHROUGH */
+    default:
+      op->type = '%';
+      printf_spec(fmt, &op->spec);
+      return op->spec.n;
+  }
+}
+
+/* The arguments of a system printf() conversion */
+union printf_val {
+  int i;
+  long l;
+  long long ll;
+  intmax_t im;
+  size_t z;
+  ptrdiff_t t;
+  double d;
+  long double ld;
+  wint_t wc;
+  const char *s;
+  const wchar_t *ws;
+  void *p;
+};
+
+#define PRINTF_CALL(v)                                                      \
+  (s->dyn_args == 0 ? snprintf(buf, size, fmt, v)                           \
+                    : s->dyn_args == 1 ? snprintf(buf, size, fmt, w[0], v)  \
+                                       : snprintf(buf, size, fmt, w[0], w[1], v))
+
+static int printf_format(char *buf, size_t size, const char *fmt,
+                         const struct printf_spec *s, const int *w,
+                         const union printf_val *v) {
+  switch (s->arg) {
+    case PRINTF_LONG: return PRINTF_CALL(v->l);
+    case PRINTF_LLONG: return PRINTF_CALL(v->ll);
+    case PRINTF_INTMAX: return PRINTF_CALL(v->im);
+    case PRINTF_SIZE: return PRINTF_CALL(v->z);
+    case PRINTF_PTRDIFF: return PRINTF_CALL(v->t);
+    case PRINTF_DOUBLE: return PRINTF_CALL(v->d);
+    case PRINTF_LDOUBLE: return PRINTF_CALL(v->ld);
+    case PRINTF_WINT: return PRINTF_CALL(v->wc);
+    case PRINTF_STR: return PRINTF_CALL(v->s);
+    case PRINTF_WSTR: return PRINTF_CALL(v->ws);
+    case PRINTF_PTR: return PRINTF_CALL(v->p);
+    case PRINTF_NONE: return PRINTF_CALL("");
+    default: return PRINTF_CALL(v->i);
+  }
+}
 
-        if (len_mod == 'h' && fmt[n] == 'h') {
-          len_mod = '1'; /* magic value representing 'hh' */
-          ++n;
-        } else if (len_mod == 'l' && fmt[n] == 'l') {
-          len_mod = '8';  /* magic value representing 'll' */
-          ++n;
-        } else if (len_mod == 'I') {
-          len_mod = 'j';                                   /* LCOV_EXCL_LINE */
-          if (fmt[n] == '3' && fmt[n+1] == '2') {          /* LCOV_EXCL_LINE */
-            if (sizeof(int) >= 4) len_mod = '\0';          /* LCOV_EXCL_LINE */
-            else                  len_mod = 'l';           /* LCOV_EXCL_LINE */
-            n += 2;                                        /* LCOV_EXCL_LINE */
-          } else if (fmt[n] == '6' && fmt[n+1] == '4') {   /* LCOV_EXCL_LINE */
-            if (sizeof(int) >= 8)            len_mod = '\0';/* LCOV_EXCL_LINE*/
-            else if (sizeof(long) >= 8)      len_mod = 'l';/* LCOV_EXCL_LINE */
-            else if (sizeof(long long) >= 8) len_mod = '8';/* LCOV_EXCL_LINE */
-            n += 2;                                        /* LCOV_EXCL_LINE */
+/*
+ * %e, %f or %g of a finite `d`, from the number rounded to the digits it
+ * prints. Returns -1 for the system printf(), when that rounding is out of
+ * reach of json_round().
+ */
+static int printf_double(char *buf, char conv, int prec, double d) {
+  char digits[24];
+  uint64_t r, bits;
+  int n, e, i, want, dec, len = 0;
+  double t;
+
+  if (prec < 0) prec = 6;
+  if (conv == 'g' && prec == 0) prec = 1;
+  if (d < 0 || (d == 0 && 1 / d < 0)) {
+    buf[len++] = '-';
+    d = -d;
+  }
+
+  if (conv == 'f') {
+    if (!json_round(d, prec, &r)) return -1;
+    n = json_format_int(digits, 0, r);
+    e = n - 1 - prec;
+  } else {
+    /* Significant digits, and the exponent of the first one */
+    want = conv == 'e' ? prec + 1 : prec;
+    if (want > 15) return -1;
+    if (d == 0) {
+      memset(digits, '0', want);
+      n = want;
+      e = 0;
+    } else {
+      /* From the binary exponent, one too small at times */
+      memcpy(&bits, &d, sizeof(bits));
+      t = ((int) ((bits >> 52) & 0x7FF) - 1023) * 0.30102999566398120;
+      e = (int) t;
+      if (e > t) e--;
+      for (i = 0;; i++) {
+        if (i == 3 || !json_round(d, want - 1 - e, &r)) return -1;
+        n = json_format_int(digits, 0, r);
+        if (n == want) break;
+        e += n - want;
+      }
+    }
+  }
+
+  /* %g is either of the others, with the trailing zeros removed */
+  dec = prec;
+  if (conv == 'g') {
+    if (e < -4 || e >= prec) {
+      conv = 'e';
+      dec = prec - 1;
+    } else {
+      conv = 'f';
+      dec = prec - 1 - e;
+    }
+    while (dec > 0 && digits[(conv == 'e' ? 0 : e) + dec] == '0') dec--;
+  }
+
+  if (conv == 'e') {
+    buf[len++] = digits[0];
+    if (dec > 0) buf[len++] = '.';
+    memcpy(buf + len, digits + 1, dec);
+    len += dec;
+    buf[len++] = 'e';
+    buf[len++] = e < 0 ? '-' : '+';
+    if (e < 0) e = -e;
+    if (e < 10) buf[len++] = '0';
+    return len + json_format_int(buf + len, 0, (uint64_t) e);
+  }
+  /* digits[i] is the digit of 10^(e - i) */
+  if (e < 0) buf[len++] = '0';
+  for (i = 0; i <= e; i++) buf[len++] = digits[i];
+  if (dec > 0) buf[len++] = '.';
+  for (i = e + 1; i <= e + dec; i++) buf[len++] = i < 0 ? '0' : digits[i];
+  return len;
+}
+
+/*
+ * Print the common conversions without the system printf(): %d, %i and %u
+ * of int, long and long long, and %e, %f and %g of double, with no flags
+ * or width. Returns -1 for the rest.
+ */
+static int printf_fast(char *buf, const struct printf_spec *s,
+                       const union printf_val *v) {
+  long long i = 0;
+  unsigned long long u = 0;
+
+  if (!s->plain || s->dyn_args > 0) return -1;
+  switch (s->conv) {
+    case 'd':
+    case 'i':
+    case 'u':
+      if (s->prec >= 0) return -1;
+      switch (s->arg) {
+        case PRINTF_INT:
+          switch (s->len_mod) {
+            case '\0':
+              i = v->i;
+              u = (unsigned int) v->i;
+              break;
+            case 'h':
+              i = (short) v->i;
+              u = (unsigned short) v->i;
+              break;
+            case '1':
+              i = (signed char) v->i;
+              u = (unsigned char) v->i;
+              break;
+            default:
+              return -1;
           }
-        }
+          break;
+        case PRINTF_LONG:
+          i = v->l;
+          u = (unsigned long) v->l;
+          break;
+        case PRINTF_LLONG:
+          i = v->ll;
+          u = (unsigned long long) v->ll;
+          break;
+        default:
+          return -1;
+      }
+      if (s->conv == 'u') return json_format_int(buf, 0, (uint64_t) u);
+      return json_format_int(buf, i < 0,
+                             i < 0 ? 0 - (uint64_t) i : (uint64_t) i);
+    case 'e':
+    case 'f':
+    case 'g':
+      if (s->arg != PRINTF_DOUBLE || v->d - v->d != 0) return -1;
+      return printf_double(buf, s->conv, s->prec, v->d);
+    default:
+      return -1;
+  }
+}
 
-        /* specifier (diouxX, aAeEfFgG, c, s, p, n, %) */
-        /* %C and %S are extensions equivalent to %lc and %ls */
-        prn_spec = fmt[n++];
-
-        strncpy(fmt2, fmt, n > sizeof(fmt2) ? sizeof(fmt2) : n);
-        fmt2[n] = '\0';
-
-        va_copy(sub_ap, ap);
-        need_len = vsnprintf(buf, sizeof(buf), fmt2, sub_ap);
-        /*
-         * TODO(lsm): Fix windows & eCos code path here. Their vsnprintf
-         * implementation returns -1 on overflow rather needed size.
-         */
-        if (need_len >= sizeof(buf)) {
-          /*
-           * resulting string doesn't fit into a stack-allocated buffer `buf`,
-           * so we need to allocate a new buffer from heap and use it
-           */
-          pbuf = (char *) malloc(need_len);
-          va_copy(sub_ap, ap);
-          need_len = vsnprintf(pbuf, need_len + 1, fmt2, sub_ap);
-        }
+/*
+ * The system printf() writes the decimal point of the C locale: put back
+ * the one of JSON in the `len` bytes at `buf`, returns the new length.
+ */
+static int printf_point(char *buf, int len) {
+  const char *point = localeconv()->decimal_point;
+  size_t n = strlen(point);
+  char *p;
+
+  if (n == 0 || (n == 1 && point[0] == '.')) return len;
+  for (p = buf; p + n <= buf + len; p++) {
+    if (memcmp(p, point, n) == 0) {
+      *p = '.';
+      memmove(p + 1, p + n, (size_t) (buf + len - p) - n);
+      return len - (int) (n - 1);
+    }
+  }
+  return len;
+}
 
-        /* absorb dynamically specified width/precision */
-        if (dyn_args == 2) (void) va_arg(ap, int);
-        if (dyn_args >= 1) (void) va_arg(ap, int);
-
-        /* todo: advance va */
-        switch (prn_spec) {
-          /* integer */
-          case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
-            switch (len_mod) {
-              case 'l': (void) va_arg(ap, long); break;
-              case '8': (void) va_arg(ap, long long); break;
-              case 'j': (void) va_arg(ap, intmax_t); break;
-              case 'z': (void) va_arg(ap, size_t); break;
-              case 't': (void) va_arg(ap, ptrdiff_t); break;
-              default: (void) va_arg(ap, int);
-            }
-            break;
-
-          /* floating point */
-          case 'a': case 'A': case 'e': case 'E': case 'f': case 'F':
-          case 'g': case 'G':
-            if (len_mod == 'L')
-              (void) va_arg(ap, long double);
-            else
-              (void) va_arg(ap, double);
-            break;
-
-          /* character */
-          case 'c': case 'C':
-            if (prn_spec == 'C' || len_mod == 'l')
-              (void) va_arg(ap, wint_t);
-            else
-              (void) va_arg(ap, int);
-            break;
-
-          /* string */
-          case 's': case 'S':
-            if (prn_spec == 'S' || len_mod == 'l')
-              (void) va_arg(ap, wchar_t *);
-            else
-              (void) va_arg(ap, char *);
-            break;
-
-          /* pointer */
-          case 'p':
-            (void) va_arg(ap, void *);
-            break;
-
-          /* pointer-out */
-          case 'n':
-            switch (len_mod) {
-              case '1': *(va_arg(ap, signed char *)) = (signed char)len; break;
-              case 'h':       *(va_arg(ap, short *)) = (short)len; break;
-              case 'l':        *(va_arg(ap, long *)) = len; break;
-              case '8':   *(va_arg(ap, long long *)) = len; break;
-              case 'j':    *(va_arg(ap, intmax_t *)) = len; break;
-              case 'z':      *(va_arg(ap, size_t *)) = (size_t)len; break;
-              case 't':   *(va_arg(ap, ptrdiff_t *)) = len; break;
-
-              default:
-                *(va_arg(ap, int *)) = len; break;
-            }
-            break;
-
-          case '%':
-            break;
-
-          default:                                         /* LCOV_EXCL_LINE */
-            /* if the specifier is unknown, treat it as an int and pray */
-            (void) va_arg(ap, int);                        /* LCOV_EXCL_LINE */
-        }
+/*
+ * Print a conversion of the system printf() with the format `fmt`, taking
+ * its arguments from `ap`. `len` is the length printed so far, for %n.
+ */
+static int printf_system(struct json_out *out, const char *fmt,
+                         const struct printf_spec *s, va_list *ap, int len) {
+  union printf_val v;
+  int i, w[2] = {0, 0}, need, res;
+  char buf[101], *pbuf = buf;
+
+  for (i = 0; i < s->dyn_args; i++) w[i] = va_arg(*ap, int);
+
+  switch (s->arg) {
+    case PRINTF_LONG: v.l = va_arg(*ap, long); break;
+    case PRINTF_LLONG: v.ll = va_arg(*ap, long long); break;
+    case PRINTF_INTMAX: v.im = va_arg(*ap, intmax_t); break;
+    case PRINTF_SIZE: v.z = va_arg(*ap, size_t); break;
+    case PRINTF_PTRDIFF: v.t = va_arg(*ap, ptrdiff_t); break;
+    case PRINTF_DOUBLE: v.d = va_arg(*ap, double); break;
+    case PRINTF_LDOUBLE: v.ld = va_arg(*ap, long double); break;
+    case PRINTF_WINT: v.wc = va_arg(*ap, wint_t); break;
+    case PRINTF_STR: v.s = va_arg(*ap, const char *); break;
+    case PRINTF_WSTR: v.ws = va_arg(*ap, const wchar_t *); break;
+    case PRINTF_PTR: v.p = va_arg(*ap, void *); break;
+    case PRINTF_NONE: break;
+    case PRINTF_COUNT:
+      /* The length is the one json_printf() printed, not snprintf() */
+      switch (s->len_mod) {
+        case '1': *(va_arg(*ap, signed char *)) = (signed char)len; break;
+        case 'h':       *(va_arg(*ap, short *)) = (short)len; break;
+        case 'l':        *(va_arg(*ap, long *)) = len; break;
+        case '8':   *(va_arg(*ap, long long *)) = len; break;
+        case 'j':    *(va_arg(*ap, intmax_t *)) = len; break;
+        case 'z':      *(va_arg(*ap, size_t *)) = (size_t)len; break;
+        case 't':   *(va_arg(*ap, ptrdiff_t *)) = len; break;
+
+        default:
+          *(va_arg(*ap, int *)) = len; break;
+      }
+      return 0;
+    default:
+      v.i = va_arg(*ap, int);
+  }
 
-        len += out->printer(out, pbuf, need_len);
-        skip = n;
+  if (s->plain && s->conv == 's' && s->arg == PRINTF_STR && v.s != NULL) {
+    /* The caller's string as it is, which JSON_OUT_IOV() needn't copy */
+    int prec = s->dyn_args > 0 ? w[0] : s->prec;
+    if (prec < 0) return json_out_ref(out, v.s, strlen(v.s));
+    if (prec < PRINTF_MAX_PREC) {
+      size_t n = (size_t) prec;
+      const char *nul = (const char *) memchr(v.s, '\0', n);
+      return json_out_ref(out, v.s, nul != NULL ? (size_t) (nul - v.s) : n);
+    }
+  }
 
-        /* If buffer was allocated from heap, free it */
-        if (pbuf != buf) {
-          free(pbuf);
-          pbuf = NULL;
-        }
+  need = printf_fast(buf, s, &v);
+  if (need >= 0) return out->printer(out, buf, need);
+
+  need = printf_format(buf, sizeof(buf), fmt, s, w, &v);
+  /*
+   * TODO(lsm): Fix windows & eCos code path here. Their vsnprintf
+   * implementation returns -1 on overflow rather needed size.
+   */
+  if (need < 0) return 0;
+  if (need >= (int) sizeof(buf)) {
+    /*
+     * resulting string doesn't fit into a stack-allocated buffer `buf`,
+     * so we need to allocate a new buffer from heap and use it
+     */
+    if ((pbuf = (char *) malloc(need + 1)) != NULL) {
+      printf_format(pbuf, need + 1, fmt, s, w, &v);
+    } else {
+      pbuf = buf;
+      need = sizeof(buf) - 1;
+    }
+  }
+  if (s->arg == PRINTF_DOUBLE || s->arg == PRINTF_LDOUBLE) {
+    need = printf_point(pbuf, need);
+  }
+  res = out->printer(out, pbuf, need);
+
+  /* If buffer was allocated from heap, free it */
+  if (pbuf != buf) free(pbuf);
+  return res;
+}
+
+static int printf_quoted(struct json_out *out, const char *p, size_t l) {
+  int len = 0;
+  if (p == NULL) return out->printer(out, "null", 4);
+  len += out->printer(out, "\"", 1);
+  len += json_escape(out, p, l);
+  len += out->printer(out, "\"", 1);
+  return len;
+}
+
+/* Print the piece `op`, taking its arguments from `ap` */
+static int printf_op(struct json_out *out, const struct printf_op *op,
+                     va_list *ap, int len) {
+  const char *quote = "\"";
+
+  switch (op->type) {
+    case 0:
+      return out->printer(out, op->str, op->len);
+    case 'M': {
+      json_printf_callback_t f = va_arg(*ap, json_printf_callback_t);
+      return f(out, ap);
+    }
+    case 'B': {
+      int val = va_arg(*ap, int);
+      return val ? out->printer(out, "true", 4) : out->printer(out, "false", 5);
+    }
+    case 'H': {
+      const char *hex = "0123456789abcdef";
+      int i, n = va_arg(*ap, int);
+      const unsigned char *p = va_arg(*ap, const unsigned char *);
+      len = out->printer(out, quote, 1);
+      for (i = 0; i < n; i++) {
+        len += out->printer(out, &hex[(p[i] >> 4) & 0xf], 1);
+        len += out->printer(out, &hex[p[i] & 0xf], 1);
+      }
+      return len + out->printer(out, quote, 1);
+    }
+    case 'V': {
+      const unsigned char *p = va_arg(*ap, const unsigned char *);
+      int n = va_arg(*ap, int);
+      len = out->printer(out, quote, 1);
+      len += b64enc(out, p, n);
+      return len + out->printer(out, quote, 1);
+    }
+    case 'Q': {
+      const char *p = va_arg(*ap, char *);
+      return printf_quoted(out, p, p == NULL ? 0 : strlen(p));
+    }
+    case 'q': {
+      size_t l = (size_t) va_arg(*ap, int);
+      return printf_quoted(out, va_arg(*ap, char *), l);
+    }
+    default:
+      return printf_system(out, op->str, &op->spec, ap, len);
+  }
+}
+
+/* Literal text gathered by json_vprintf(), to print with a single call */
+struct printf_run {
+  char buf[128];
+  size_t len;
+};
+
+static int printf_flush(struct json_out *out, struct printf_run *run) {
+  int len = run->len > 0 ? out->printer(out, run->buf, run->len) : 0;
+  run->len = 0;
+  return len;
+}
+
+static int printf_put(struct json_out *out, struct printf_run *run,
+                      const char *p, size_t n) {
+  int len = 0;
+  if (run->len + n > sizeof(run->buf)) {
+    len += printf_flush(out, run);
+    if (n > sizeof(run->buf)) return len + out->printer(out, p, n);
+  }
+  memcpy(run->buf + run->len, p, n);
+  run->len += n;
+  return len;
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  struct printf_run run;
+  int len = 0;
+  va_list ap;
+  va_copy(ap, xap);
+
+  run.len = 0;
+  while (*fmt != '\0') {
+    if (fmt[0] == '%' && fmt[1] == '%') {
+      len += printf_put(out, &run, fmt, 1);
+      fmt += 2;
+    } else if (fmt[0] == '%') {
+      struct printf_op op;
+      char fmt2[30];
+      int n = printf_conv(fmt, &op);
+
+      if (op.type == '%') {
+        /* The system printf() needs the conversion on its own */
+        snprintf(fmt2, sizeof(fmt2), "%.*s", n, fmt);
+        op.str = fmt2;
       }
-      fmt += skip;
+      /* Print the text so far first, %n and %M rely on it */
+      len += printf_flush(out, &run);
+      len += printf_op(out, &op, &ap, len);
+      fmt += n;
     } else if (*fmt == '_' || is_alpha(*fmt)) {
-      len += out->printer(out, quote, 1);
-      while (*fmt == '_' || is_alpha(*fmt) || is_digit(*fmt)) {
-        len += out->printer(out, fmt, 1);
+      const char *key = fmt;
+      while (*fmt == '_' || is_alpha(*fmt) || is_digit(*fmt)) fmt++;
+      len += printf_put(out, &run, "\"", 1);
+      len += printf_put(out, &run, key, fmt - key);
+      len += printf_put(out, &run, "\"", 1);
+    } else {
+      /* Up to the next conversion or key, in one go */
+      const char *p = fmt++;
+      while (*fmt != '\0' && *fmt != '%' && *fmt != '_' && !is_alpha(*fmt)) {
         fmt++;
       }
-      len += out->printer(out, quote, 1);
+      len += printf_put(out, &run, p, fmt - p);
+    }
+  }
+  len += printf_flush(out, &run);
+  va_end(ap);
+
+  return len;
+}
+
+/* Where printf_parse() puts the template */
+struct printf_out {
+  struct printf_op *ops;
+  char *text;
+};
+
+/*
+ * Add `n` bytes of literal text, to the previous piece if it is text too.
+ * With `out` NULL, only count the pieces and the bytes.
+ */
+static void printf_text(const struct printf_out *out, int *num_ops,
+                        size_t *text_len, int *in_text, const char *p,
+                        size_t n) {
+  if (!*in_text) {
+    if (out != NULL) {
+      out->ops[*num_ops].type = 0;
+      out->ops[*num_ops].str = out->text + *text_len;
+      out->ops[*num_ops].len = 0;
+    }
+    (*num_ops)++;
+    *in_text = 1;
+  }
+  if (out != NULL) {
+    memcpy(out->text + *text_len, p, n);
+    out->ops[*num_ops - 1].len += (int) n;
+  }
+  *text_len += n;
+}
+
+/*
+ * Split the format into pieces the same way json_vprintf() goes through
+ * it, counting them and the text they need, and if `out` is not NULL,
+ * filling them.
+ */
+static void printf_parse(const char *fmt, const struct printf_out *out,
+                         int *num_ops, size_t *text_len) {
+  int in_text = 0;
+
+  *num_ops = 0;
+  *text_len = 0;
+  while (*fmt != '\0') {
+    if (fmt[0] == '%' && fmt[1] == '%') {
+      printf_text(out, num_ops, text_len, &in_text, fmt, 1);
+      fmt += 2;
+    } else if (fmt[0] == '%') {
+      struct printf_op tmp, *op = out != NULL ? &out->ops[*num_ops] : &tmp;
+      int n = printf_conv(fmt, op);
+      if (op->type == '%') {
+        /* Keep the conversion, NUL-terminated, for the system printf() */
+        if (out != NULL) {
+          op->str = out->text + *text_len;
+          memcpy(out->text + *text_len, fmt, n);
+          out->text[*text_len + n] = '\0';
+        }
+        *text_len += n + 1;
+      }
+      (*num_ops)++;
+      in_text = 0;
+      fmt += n;
+    } else if (*fmt == '_' || is_alpha(*fmt)) {
+      const char *key = fmt;
+      while (*fmt == '_' || is_alpha(*fmt) || is_digit(*fmt)) fmt++;
+      printf_text(out, num_ops, text_len, &in_text, "\"", 1);
+      printf_text(out, num_ops, text_len, &in_text, key, fmt - key);
+      printf_text(out, num_ops, text_len, &in_text, "\"", 1);
     } else {
-      len += out->printer(out, fmt, 1);
+      printf_text(out, num_ops, text_len, &in_text, fmt, 1);
       fmt++;
     }
   }
-  va_end(ap);
+}
 
+struct json_printf_template *json_printf_compile(const char *fmt) {
+  struct json_printf_template *tpl;
+  struct printf_out out;
+  size_t text_len;
+  int num_ops;
+
+  printf_parse(fmt, NULL, &num_ops, &text_len);
+  tpl = (struct json_printf_template *) malloc(
+      sizeof(*tpl) + num_ops * sizeof(struct printf_op) + text_len);
+  if (tpl == NULL) return NULL;
+  tpl->num_ops = num_ops;
+  out.ops = tpl->ops = (struct printf_op *) (tpl + 1);
+  out.text = (char *) (tpl->ops + num_ops);
+  printf_parse(fmt, &out, &num_ops, &text_len);
+  return tpl;
+}
+
+int json_vprintf_exec(struct json_out *out,
+                      const struct json_printf_template *tpl, va_list xap) {
+  int i, len = 0;
+  va_list ap;
+  va_copy(ap, xap);
+  for (i = 0; i < tpl->num_ops; i++) {
+    len += printf_op(out, &tpl->ops[i], &ap, len);
+  }
+  va_end(ap);
   return len;
 }
 
+int json_printf_exec(struct json_out *out,
+                     const struct json_printf_template *tpl, ...) {
+  int n;
+  va_list ap;
+  va_start(ap, tpl);
+  n = json_vprintf_exec(out, tpl, ap);
+  va_end(ap);
+  return n;
+}
+
+void json_printf_template_free(struct json_printf_template *tpl) {
+  free(tpl);
+}
+
 int json_printf(struct json_out *out, const char *fmt, ...) {
   int n;
   va_list ap;
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Block scanners used by the lexer to jump over whitespace and over the
+ * plain part of string literals many bytes at a time, and by the skipper
+ * to jump over whole values. SSE2 is the baseline on x86; AVX2 and AVX-512
+ * versions are picked at runtime when the compiler supports function
+ * multiversioning (GCC and clang). Everything else gets the portable
+ * byte-at-a-time version. Define JSON_NO_SIMD to force it.
+ */
+
+#include "elsa.h"
+#include <stddef.h>
+#include <string.h>
+#include "util.h"
+
+#if !defined(JSON_NO_SIMD) &&                                   \
+    (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(SCAN_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn_t)(const char *p, const char *end);
+
+static int scan_is_plain(unsigned char ch) {
+  return ch >= 0x20 && ch < 0x80 && ch != '"' && ch != '\\';
+}
+
+static const char *scan_spaces_generic(const char *p, const char *end) {
+  while (p < end && is_space(*p)) p++;
+  return p;
+}
+
+static const char *scan_plain_generic(const char *p, const char *end) {
+  while (p < end && scan_is_plain(*(const unsigned char *) p)) p++;
+  return p;
+}
+
+#ifdef SCAN_SSE2
+static int scan_ctz(unsigned int mask) {
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int n = 0;
+  while ((mask & 1) == 0) mask >>= 1, n++;
+  return n;
+#endif
+}
+
+static const char *scan_spaces_sse2(const char *p, const char *end) {
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    unsigned int mask = ~(unsigned int) _mm_movemask_epi8(ws) & 0xffff;
+    if (mask != 0) return p + scan_ctz(mask);
+  }
+  return scan_spaces_generic(p, end);
+}
+
+static const char *scan_plain_sse2(const char *p, const char *end) {
+  const __m128i quote = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+  const __m128i ctl = _mm_set1_epi8(0x20);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    /* Signed compare: catches both control chars and non-ASCII bytes */
+    __m128i special = _mm_or_si128(
+        _mm_cmplt_epi8(v, ctl),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)));
+    unsigned int mask = (unsigned int) _mm_movemask_epi8(special);
+    if (mask != 0) return p + scan_ctz(mask);
+  }
+  return scan_plain_generic(p, end);
+}
+#endif /* SCAN_SSE2 */
+
+#ifdef SCAN_X86_DISPATCH
+__attribute__((target("avx2"))) static const char *scan_spaces_avx2(
+    const char *p, const char *end) {
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+    unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(ws);
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  return scan_spaces_sse2(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *scan_plain_avx2(
+    const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+  const __m256i ctl = _mm256_set1_epi8(0x20);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i special = _mm256_or_si256(
+        _mm256_cmpgt_epi8(ctl, v),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                        _mm256_cmpeq_epi8(v, bs)));
+    unsigned int mask = (unsigned int) _mm256_movemask_epi8(special);
+    if (mask != 0) return p + __builtin_ctz(mask);
+  }
+  return scan_plain_sse2(p, end);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static const char *
+scan_spaces_avx512(const char *p, const char *end) {
+  const __m512i sp = _mm512_set1_epi8(' '), tab = _mm512_set1_epi8('\t');
+  const __m512i cr = _mm512_set1_epi8('\r'), lf = _mm512_set1_epi8('\n');
+  for (; end - p >= 64; p += 64) {
+    __m512i v = _mm512_loadu_si512((const void *) p);
+    unsigned long long mask =
+        ~(_mm512_cmpeq_epi8_mask(v, sp) | _mm512_cmpeq_epi8_mask(v, tab) |
+          _mm512_cmpeq_epi8_mask(v, cr) | _mm512_cmpeq_epi8_mask(v, lf));
+    if (mask != 0) return p + __builtin_ctzll(mask);
+  }
+  return scan_spaces_avx2(p, end);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static const char *
+scan_plain_avx512(const char *p, const char *end) {
+  const __m512i quote = _mm512_set1_epi8('"'), bs = _mm512_set1_epi8('\\');
+  const __m512i ctl = _mm512_set1_epi8(0x20);
+  for (; end - p >= 64; p += 64) {
+    __m512i v = _mm512_loadu_si512((const void *) p);
+    unsigned long long mask = _mm512_cmplt_epi8_mask(v, ctl) |
+                              _mm512_cmpeq_epi8_mask(v, quote) |
+                              _mm512_cmpeq_epi8_mask(v, bs);
+    if (mask != 0) return p + __builtin_ctzll(mask);
+  }
+  return scan_plain_avx2(p, end);
+}
+#endif /* SCAN_X86_DISPATCH */
+
+#ifdef SCAN_X86_DISPATCH
+/*
+ * The implementation for this CPU is picked once, by a constructor, before
+ * any thread can be walking. Scans run from other constructors, before it,
+ * pick it themselves. The pointers are atomic, so that neither is a race.
+ */
+static const char *scan_spaces_init(const char *p, const char *end);
+static const char *scan_plain_init(const char *p, const char *end);
+
+static scan_fn_t scan_spaces_ptr = scan_spaces_init;
+static scan_fn_t scan_plain_ptr = scan_plain_init;
+
+#define SCAN_LOAD(ptr) __atomic_load_n(&(ptr), __ATOMIC_RELAXED)
+#define SCAN_STORE(ptr, fn) __atomic_store_n(&(ptr), (fn), __ATOMIC_RELAXED)
+#define scan_spaces_fn SCAN_LOAD(scan_spaces_ptr)
+#define scan_plain_fn SCAN_LOAD(scan_plain_ptr)
+
+__attribute__((constructor)) static void scan_select(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    SCAN_STORE(scan_spaces_ptr, scan_spaces_avx512);
+    SCAN_STORE(scan_plain_ptr, scan_plain_avx512);
+  } else if (__builtin_cpu_supports("avx2")) {
+    SCAN_STORE(scan_spaces_ptr, scan_spaces_avx2);
+    SCAN_STORE(scan_plain_ptr, scan_plain_avx2);
+  } else {
+    SCAN_STORE(scan_spaces_ptr, scan_spaces_sse2);
+    SCAN_STORE(scan_plain_ptr, scan_plain_sse2);
+  }
+}
+
+static const char *scan_spaces_init(const char *p, const char *end) {
+  scan_select();
+  return scan_spaces_fn(p, end);
+}
+
+static const char *scan_plain_init(const char *p, const char *end) {
+  scan_select();
+  return scan_plain_fn(p, end);
+}
+#elif defined(SCAN_SSE2)
+#define scan_spaces_fn scan_spaces_sse2
+#define scan_plain_fn scan_plain_sse2
+#else
+#define scan_spaces_fn scan_spaces_generic
+#define scan_plain_fn scan_plain_generic
+#endif
+
+const char *json_scan_spaces(const char *p, const char *end) {
+  /* Most tokens are not preceded by whitespace at all */
+  if (p >= end || !is_space(*p)) return p;
+  return scan_spaces_fn(p, end);
+}
+
+const char *json_scan_plain(const char *p, const char *end) {
+  return scan_plain_fn(p, end);
+}
+
+/* Skip the rest of a string literal, `p` points after the opening quote */
+static const char *scan_skip_string(const char *p, const char *end) {
+  while ((p = scan_plain_fn(p, end)) < end) {
+    if (*p == '"') return p + 1;
+    p += *p == '\\' ? 2 : 1;
+  }
+  return NULL;
+}
+
+/*
+ * Container skipper. Input is looked at in 64-byte blocks, each turned into
+ * bitmasks of quotes, backslashes and brackets, bit N standing for byte N.
+ * Escaped quotes are found with carry propagation over backslash runs, and
+ * the bytes inside strings by a prefix XOR of the quotes. That leaves only
+ * the brackets outside strings, which are mostly just counted.
+ */
+struct scan_masks {
+  unsigned long long quote, backslash, open, close;
+};
+
+static void scan_masks(const char *p, struct scan_masks *m) {
+#ifdef SCAN_SSE2
+  const __m128i quote = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+  const __m128i bit = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+  int i;
+  memset(m, 0, sizeof(*m));
+  for (i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+    /* '[' ']' '{' '}' differ from each other only in bits 0x20 and 0x02 */
+    __m128i lower = _mm_or_si128(v, bit);
+#define SCAN_MASK(x) ((unsigned long long) _mm_movemask_epi8(x) << i)
+    m->quote |= SCAN_MASK(_mm_cmpeq_epi8(v, quote));
+    m->backslash |= SCAN_MASK(_mm_cmpeq_epi8(v, bs));
+    m->open |= SCAN_MASK(_mm_cmpeq_epi8(lower, open));
+    m->close |= SCAN_MASK(_mm_cmpeq_epi8(lower, close));
+#undef SCAN_MASK
+  }
+#else
+  int i;
+  memset(m, 0, sizeof(*m));
+  for (i = 0; i < 64; i++) {
+    unsigned long long bit = 1ULL << i;
+    switch (p[i]) {
+      case '"': m->quote |= bit; break;
+      case '\\': m->backslash |= bit; break;
+      case '{': case '[': m->open |= bit; break;
+      case '}': case ']': m->close |= bit; break;
+    }
+  }
+#endif
+}
+
+static int scan_popcount(unsigned long long x) {
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x != 0; x &= x - 1) n++;
+  return n;
+#endif
+}
+
+static int scan_ctzll(unsigned long long x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+
+/* Bits of the bytes escaped by a backslash */
+static unsigned long long scan_escaped(unsigned long long backslash,
+                                       unsigned long long *carry) {
+  const unsigned long long even = 0x5555555555555555ULL;
+  unsigned long long follows, odd_starts, even_runs, escaped;
+  backslash &= ~*carry;
+  follows = backslash << 1 | *carry;
+  odd_starts = backslash & ~even & ~follows;
+  even_runs = odd_starts + backslash;
+  *carry = even_runs < odd_starts; /* Run goes on into the next block */
+  escaped = (even ^ (even_runs << 1)) & follows;
+  return escaped;
+}
+
+/* Bits of the bytes inside strings, counting the opening quote */
+static unsigned long long scan_prefix_xor(unsigned long long x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static const char *scan_skip_container(const char *p, const char *end) {
+  unsigned long long in_string = 0, carry = 0;
+  long depth = 0;
+  char tail[64];
+
+  for (; p < end; p += end - p < 64 ? end - p : 64) {
+    struct scan_masks m;
+    unsigned long long quote, string, open, close;
+    const char *block = p;
+
+    if (end - p < 64) {
+      /* Pad the last block with spaces, which are not special */
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, p, end - p);
+      block = tail;
+    }
+    scan_masks(block, &m);
+
+    quote = m.quote & ~scan_escaped(m.backslash, &carry);
+    string = scan_prefix_xor(quote) ^ in_string;
+    in_string = (unsigned long long) 0 - (string >> 63);
+    open = m.open & ~string;
+    close = m.close & ~string;
+
+    if (scan_popcount(close) < depth) {
+      /* Can't get back to the top level in this block */
+      depth += scan_popcount(open) - scan_popcount(close);
+      continue;
+    }
+    for (open |= close; open != 0; open &= open - 1) {
+      int i = scan_ctzll(open);
+      if (((close >> i) & 1) == 0) {
+        depth++;
+      } else if (--depth == 0) {
+        return p + i + 1;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+const char *json_scan_skip(const char *p, const char *end) {
+  if (p >= end) return NULL;
+  if (*p == '"') return scan_skip_string(p + 1, end);
+  if (*p == '{' || *p == '[') return scan_skip_container(p, end);
+
+  /* Scalar goes on up to a delimiter, or the end of input */
+  while (p < end && !is_space(*p) && strchr(",:\"[]{}", *p) == NULL) {
+    p++;
+  }
+  return p;
+}
+
+int json_skip_value(const char *s, int len) {
+  const char *end = s + len, *p;
+  if (s == NULL || len < 0) return JSON_STRING_INVALID;
+  p = json_scan_spaces(s, end);
+  if (p >= end) return JSON_STRING_INCOMPLETE;
+  if (strchr("\"{[-0123456789tfn", *p) == NULL || *p == '\0') {
+    return JSON_STRING_INVALID;
+  }
+  p = json_scan_skip(p, end);
+  return p == NULL ? JSON_STRING_INCOMPLETE : (int) (p - s);
+}
+
+const char *json_scan_value(const char *p, const char *end,
+                            struct json_token64 *t) {
+  const char *v = json_scan_spaces(p, end), *e;
+  if (v >= end || (e = json_scan_skip(v, end)) == NULL || e == v) return NULL;
+  t->ptr = v;
+  t->len = e - v;
+  switch (*v) {
+    case '"':
+      t->ptr++;
+      t->len -= 2;
+      t->type = JSON_TYPE_STRING;
+      break;
+    case '{':
+      t->type = JSON_TYPE_OBJECT_END;
+      break;
+    case '[':
+      t->type = JSON_TYPE_ARRAY_END;
+      break;
+    case 't':
+      t->type = JSON_TYPE_TRUE;
+      break;
+    case 'f':
+      t->type = JSON_TYPE_FALSE;
+      break;
+    case 'n':
+      t->type = JSON_TYPE_NULL;
+      break;
+    default:
+      t->type = JSON_TYPE_NUMBER;
+      break;
+  }
+  return e;
+}
+
+const char *json_scan_valid_value(const char *p, const char *end,
+                                  struct json_token64 *t) {
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  const char *e = json_scan_value(p, end, t), *v;
+  if (e == NULL) return NULL;
+  v = t->type == JSON_TYPE_STRING ? t->ptr - 1 : t->ptr;
+  /* A malformed value makes json_walk() fail, or stop short of its end */
+  return json_walk_ex64(v, e - v, &opts, NULL, NULL) == e - v
+             ? e
+             : NULL;
+}
+
+const char *json_scan_key(const char *p, const char *end,
+                          struct json_token64 *key) {
+  const char *k = json_scan_spaces(p, end), *e = k;
+  if (k >= end) return NULL;
+  if (*k == '"') {
+    if ((e = json_scan_skip(k, end)) == NULL) return NULL;
+    key->ptr = k + 1;
+    key->len = e - k - 2;
+  } else {
+    while (e < end && (*e == '_' || is_alpha(*e) || is_digit(*e))) e++;
+    if (e == k || !is_alpha(*k)) return NULL;
+    key->ptr = k;
+    key->len = e - k;
+  }
+  key->type = JSON_TYPE_STRING;
+  e = json_scan_spaces(e, end);
+  return e < end && *e == ':' ? e + 1 : NULL;
+}
+
+/* Skip whitespace and a comma after a member, commas are optional */
+static const char *scan_next_member(const char *p, const char *end) {
+  p = json_scan_spaces(p, end);
+  if (p < end && *p == ',') p = json_scan_spaces(p + 1, end);
+  return p;
+}
+
+const char *json_scan_path(const char *p, const char *end, const char *path) {
+  struct json_token64 key, val;
+  p = json_scan_spaces(p, end);
+
+  while (*path != '\0' && p < end) {
+    const char *found = NULL;
+    if (path[0] == '.' && *p == '{') {
+      size_t n = strcspn(path + 1, ".[");
+      /* With duplicate keys, the last one wins, like in json_scanf() */
+      for (p = scan_next_member(p + 1, end); p < end && *p != '}';
+           p = scan_next_member(p, end)) {
+        /* A truncated object still yields the members seen so far */
+        if ((p = json_scan_key(p, end, &key)) == NULL) break;
+        if (key.len == n && memcmp(key.ptr, path + 1, n) == 0) {
+          found = json_scan_spaces(p, end);
+        }
+        if ((p = json_scan_value(p, end, &val)) == NULL) break;
+      }
+      path += n + 1;
+    } else if (path[0] == '[' && *p == '[' && is_digit(path[1])) {
+      int i = 0;
+      for (path++; is_digit(*path); path++) i = i * 10 + (*path - '0');
+      if (*path++ != ']') return NULL;
+      for (p = scan_next_member(p + 1, end); p < end && *p != ']';
+           p = scan_next_member(p, end)) {
+        if (i-- == 0) {
+          found = p;
+          break;
+        }
+        if ((p = json_scan_value(p, end, &val)) == NULL) return NULL;
+      }
+    }
+    if ((p = found) == NULL) return NULL;
+  }
+
+  return *path == '\0' && p < end ? p : NULL;
+}
@@ -17,8 +17,10 @@
 
 #include "elsa.h"
 #include <stdarg.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,68 +67,201 @@ static unsigned char hexdec(const char *s) {
   return (HEXTOI(a) << 4) | HEXTOI(b);
 }
 
-struct scan_array_info {
-  int found;
-  char path[JSON_MAX_PATH_LEN];
-  struct json_token *token;
-};
-
-static void json_scanf_array_elem_cb(void *callback_data, const char *name,
-                                     size_t name_len, const char *path,
-                                     const struct json_token *token) {
-  struct scan_array_info *info = (struct scan_array_info *) callback_data;
-
-  (void) name;
-  (void) name_len;
-
-  if (strcmp(path, info->path) == 0) {
-    *info->token = *token;
-    info->found = 1;
-  }
-}
-
 int json_scanf_array_elem(const char *s, int len, const char *path, int idx,
                           struct json_token *token) {
-  struct scan_array_info info;
-  info.token = token;
-  info.found = 0;
+  const char *end = s + len, *p;
+  char elem_path[JSON_MAX_PATH_LEN];
+  struct json_token64 t;
   memset(token, 0, sizeof(*token));
-  snprintf(info.path, sizeof(info.path), "%s[%d]", path, idx);
-  json_walk(s, len, json_scanf_array_elem_cb, &info);
-  return info.found ? token->len : -1;
+  snprintf(elem_path, sizeof(elem_path), "%s[%d]", path, idx);
+  /* Jump straight to the element, skipping everything before it */
+  p = json_scan_path(s, end, elem_path);
+  if (p == NULL || json_scan_valid_value(p, end, &t) == NULL) return -1;
+  token->ptr = t.ptr;
+  token->len = (int) t.len;
+  token->type = t.type;
+  return token->len;
+}
+
+int json_index_scanf_array_elem(const struct json_index *idx,
+                                const char *path, int index,
+                                struct json_token *token) {
+  int i = json_index_find(idx, 0, path);
+  memset(token, 0, sizeof(*token));
+  if (i < 0 || idx->tokens[i].type != JSON_TYPE_ARRAY_END) return -1;
+  /* Skip to the first element, then follow the sibling links */
+  if (++i >= idx->num_tokens || idx->tokens[i].parent != i - 1) return -1;
+  for (; i >= 0 && index > 0; index--) i = idx->tokens[i].next;
+  if (i < 0 || index < 0) return -1;
+  index_token(idx, i, token);
+  return token->len;
 }
 
 struct json_scanf_info {
   int num_conversions;
-  char *path;
+  const char *path;
   const char *fmt;
   void *target;
   void *user_data;
   int type;
+  char num;     /* Number conversion done without sscanf(), see scanf_num() */
+  char num_len; /* Its length modifier, 'H' for hh and 'L' for ll */
+  struct json_arena *arena; /* Where strings go, or NULL to malloc() them */
+  int size;                 /* Size of the %.*Q buffer */
 };
 
-static void json_scanf_cb(void *callback_data, const char *name,
-                          size_t name_len, const char *path,
-                          const struct json_token *token) {
-  struct json_scanf_info *info = (struct json_scanf_info *) callback_data;
-  char buf[32]; /* Must be enough to hold numbers */
+static char *scanf_alloc(struct json_scanf_info *info, size_t size) {
+  if (info->arena != NULL) return (char *) json_arena_alloc(info->arena, size);
+  return (char *) malloc(size);
+}
+
+/*
+ * Convert a number without sscanf(), which is slow, depends on the locale
+ * and gets a copy of the token that might be cut short. Integers that don't
+ * fit are not converted. Return 0 to leave the token to sscanf() after all.
+ */
+static int scanf_num(struct json_scanf_info *info,
+                     const struct json_token *token) {
+  const char *p = token->ptr, *end = p + token->len, *q;
+  uint64_t v, max;
+  int neg;
 
-  (void) name;
-  (void) name_len;
+  while (p < end && is_space(*p)) p++;
 
-  if (strcmp(path, info->path) != 0) {
-    /* It's not the path we're looking for, so, just ignore this callback */
-    return;
+  if (info->num == 'f') {
+    if (info->num_len == 'l') {
+      double d;
+      if (json_parse_double(p, end, &d) == NULL) return 1;
+      *(double *) info->target = d;
+    } else {
+      float f;
+      if (json_parse_float(p, end, &f) == NULL) return 1;
+      *(float *) info->target = f;
+    }
+    info->num_conversions++;
+    return 1;
   }
 
-  if (token->ptr == NULL) {
-    /*
-     * We're not interested here in the events for which we have no value;
-     * namely, JSON_TYPE_OBJECT_START and JSON_TYPE_ARRAY_START
-     */
-    return;
+  /* %i reads octal and hex, which JSON doesn't have */
+  q = p < end && (*p == '-' || *p == '+') ? p + 1 : p;
+  if (info->num == 'i' && end - q > 1 && q[0] == '0' &&
+      (is_digit(q[1]) || q[1] == 'x' || q[1] == 'X')) {
+    return 0;
   }
 
+  if (json_parse_int(p, end, &neg, &v) == NULL) return 1;
+  if (info->num == 'u') {
+    switch (info->num_len) {
+      case 'H':
+        max = UCHAR_MAX;
+        break;
+      case 'h':
+        max = USHRT_MAX;
+        break;
+      case 'l':
+        max = ULONG_MAX;
+        break;
+      case 'L':
+        max = ULLONG_MAX;
+        break;
+      default:
+        max = UINT_MAX;
+        break;
+    }
+    if (v > max || (neg && v != 0)) return 1;
+    switch (info->num_len) {
+      case 'H':
+        *(unsigned char *) info->target = (unsigned char) v;
+        break;
+      case 'h':
+        *(unsigned short *) info->target = (unsigned short) v;
+        break;
+      case 'l':
+        *(unsigned long *) info->target = (unsigned long) v;
+        break;
+      case 'L':
+        *(unsigned long long *) info->target = (unsigned long long) v;
+        break;
+      default:
+        *(unsigned int *) info->target = (unsigned int) v;
+        break;
+    }
+  } else {
+    long long n;
+    switch (info->num_len) {
+      case 'H':
+        max = SCHAR_MAX;
+        break;
+      case 'h':
+        max = SHRT_MAX;
+        break;
+      case 'l':
+        max = LONG_MAX;
+        break;
+      case 'L':
+        max = LLONG_MAX;
+        break;
+      default:
+        max = INT_MAX;
+        break;
+    }
+    /* The negative range is one larger */
+    if (v > max + neg) return 1;
+    n = neg && v != 0 ? -(long long) (v - 1) - 1 : (long long) v;
+    switch (info->num_len) {
+      case 'H':
+        *(signed char *) info->target = (signed char) n;
+        break;
+      case 'h':
+        *(short *) info->target = (short) n;
+        break;
+      case 'l':
+        *(long *) info->target = (long) n;
+        break;
+      case 'L':
+        *(long long *) info->target = n;
+        break;
+      default:
+        *(int *) info->target = (int) n;
+        break;
+    }
+  }
+  info->num_conversions++;
+  return 1;
+}
+
+/*
+ * Tell if the token has escapes to decode. The walker knows that for strings,
+ * `escaped` is what it says; anything else has to be looked at.
+ */
+static int scanf_escaped(const struct json_token *token, int escaped) {
+  if (token->type == JSON_TYPE_STRING) return escaped;
+  return token->len > 0 && memchr(token->ptr, '\\', token->len) != NULL;
+}
+
+/* Decode the token into a new string, return its length or -1 */
+static int scanf_unescape(struct json_scanf_info *info,
+                          const struct json_token *token, int escaped,
+                          char **dst) {
+  int len = token->len;
+  if (escaped) {
+    len = json_unescape(token->ptr, token->len, NULL, 0);
+    if (len < 0) return -1;
+  }
+  if ((*dst = scanf_alloc(info, len + 1)) == NULL) return -1;
+  if (escaped) {
+    json_unescape(token->ptr, token->len, *dst, len);
+  } else {
+    memcpy(*dst, token->ptr, len);
+  }
+  (*dst)[len] = '\0';
+  return len;
+}
+
+static void json_scanf_convert(struct json_scanf_info *info,
+                               const struct json_token *token, int escaped) {
+  char buf[32]; /* Must be enough to hold numbers */
+
   switch (info->type) {
     case 'B':
       info->num_conversions++;
@@ -145,14 +280,49 @@ static void json_scanf_cb(void *callback_data, const char *name,
       char **dst = (char **) info->target;
       if (token->type == JSON_TYPE_NULL) {
         *dst = NULL;
-      } else {
-        int unescaped_len = json_unescape(token->ptr, token->len, NULL, 0);
-        if (unescaped_len >= 0 &&
-            (*dst = (char *) malloc(unescaped_len + 1)) != NULL) {
-          info->num_conversions++;
-          json_unescape(token->ptr, token->len, *dst, unescaped_len);
-          (*dst)[unescaped_len] = '\0';
+      } else if (scanf_unescape(info, token, scanf_escaped(token, escaped),
+                                dst) >= 0) {
+        info->num_conversions++;
+      }
+      break;
+    }
+    case 'q': {
+      /* Decoded straight into the caller's buffer, cut to fit */
+      char *dst = (char *) info->target;
+      int n = token->len, max = info->size - 1;
+      if (dst == NULL || max < 0) break;
+      if (token->type == JSON_TYPE_NULL) {
+        n = 0;
+      } else if (scanf_escaped(token, escaped)) {
+        if ((n = json_unescape(token->ptr, token->len, dst, max)) < 0) {
+          dst[0] = '\0';
+          break;
         }
+      } else {
+        memcpy(dst, token->ptr, n < max ? n : max);
+      }
+      dst[n < max ? n : max] = '\0';
+      /* A string that doesn't fit is not counted */
+      if (n <= max && token->type != JSON_TYPE_NULL) info->num_conversions++;
+      break;
+    }
+    case 'S': {
+      const char **dst = (const char **) info->target;
+      int *len = (int *) info->user_data;
+      char *decoded;
+      int n;
+      if (token->type == JSON_TYPE_NULL) {
+        *dst = NULL;
+        *len = 0;
+      } else if (!scanf_escaped(token, escaped)) {
+        /* Nothing to decode: point into the string being scanned */
+        *dst = token->ptr;
+        *len = token->len;
+        info->num_conversions++;
+      } else if ((n = scanf_unescape(info, token, 1, &decoded)) >= 0) {
+        *dst = decoded;
+        *len = n;
+        info->num_conversions++;
       }
       break;
     }
@@ -160,7 +330,7 @@ static void json_scanf_cb(void *callback_data, const char *name,
       char **dst = (char **) info->user_data;
       int i, len = token->len / 2;
       *(int *) info->target = len;
-      if ((*dst = (char *) malloc(len + 1)) != NULL) {
+      if ((*dst = scanf_alloc(info, len + 1)) != NULL) {
         for (i = 0; i < len; i++) {
           (*dst)[i] = hexdec(token->ptr + 2 * i);
         }
@@ -172,7 +342,7 @@ static void json_scanf_cb(void *callback_data, const char *name,
     case 'V': {
       char **dst = (char **) info->target;
       int len = token->len * 4 / 3 + 2;
-      if ((*dst = (char *) malloc(len + 1)) != NULL) {
+      if ((*dst = scanf_alloc(info, len + 1)) != NULL) {
         int n = b64dec(token->ptr, token->len, *dst);
         (*dst)[n] = '\0';
         *(int *) info->user_data = n;
@@ -185,6 +355,7 @@ static void json_scanf_cb(void *callback_data, const char *name,
       *(struct json_token *) info->target = *token;
       break;
     default:
+      if (info->num != 0 && scanf_num(info, token)) break;
       /* Before scanf, copy into tmp buffer in order to 0-terminate it */
       if (token->len < (int) sizeof(buf)) {
         memcpy(buf, token->ptr, token->len);
@@ -195,54 +366,466 @@ static void json_scanf_cb(void *callback_data, const char *name,
   }
 }
 
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
-  char path[JSON_MAX_PATH_LEN] = "", fmtbuf[20];
+/* One `%` conversion of a json_scanf() format */
+struct scanf_conv {
+  const char *path; /* Same as json_walk() gives, e.g. ".a.b" */
+  char type;     /* Conversion character, e.g. 'Q', or 'q' for %.*Q */
+  char num_args; /* Number of arguments it consumes: 1 or 2 */
+  char num;      /* See struct json_scanf_info */
+  char num_len;
+  char fmt[20];  /* sscanf() format, for the standard conversions */
+};
+
+/*
+ * Path that some conversions are at or inside of, in the hash table of the
+ * plan. Sorted by path, the conversions at it and then the ones inside it
+ * follow each other, see scanf_path_cmp().
+ */
+struct scanf_key {
+  uint32_t hash;
+  int len;        /* Length of the path, -1 for an empty slot */
+  int first;      /* First conversion in json_scanf_plan.order */
+  int num_at;     /* Number of conversions at the path */
+  int num_inside; /* Number of conversions inside it, after those at it */
+};
+
+/*
+ * Compiled format. It is allocated as a whole, with the conversions, their
+ * order, the hash table and the paths following the header, and is never
+ * modified after json_scanf_compile(), so threads can share it.
+ */
+struct json_scanf_plan {
+  int num_convs;
+  struct scanf_conv *convs;
+  const struct scanf_conv **order; /* Conversions sorted by path */
+  struct scanf_key *keys;          /* Every path and its containers */
+  uint32_t mask;                   /* Size of `keys` - 1, a power of 2 */
+};
+
+/* FNV-1a, over the path the way the walk callback hashes it */
+#define SCANF_HASH_INIT 2166136261U
+#define SCANF_HASH_STEP(h, ch) (((h) ^ (unsigned char) (ch)) * 16777619U)
+
+/*
+ * Slot of the path `path,len` in the hash table of the plan: the key with
+ * that path, or the empty slot where it would go.
+ */
+static struct scanf_key *scanf_key_slot(const struct json_scanf_plan *plan,
+                                        const char *path, int len,
+                                        uint32_t hash) {
+  uint32_t i = hash & plan->mask;
+  struct scanf_key *k;
+
+  for (k = &plan->keys[i]; k->len >= 0; k = &plan->keys[i]) {
+    if (k->hash == hash && k->len == len &&
+        memcmp(plan->order[k->first]->path, path, len) == 0) {
+      break;
+    }
+    i = (i + 1) & plan->mask;
+  }
+  return k;
+}
+
+/* Rank of a path byte: '.' and '[' come before any other byte */
+static int scanf_path_rank(unsigned char ch) {
+  return ch == '\0' ? 0 : ch == '.' ? 1 : ch == '[' ? 2 : ch + 3;
+}
+
+/*
+ * Order of the conversions by path, where a container sorts right before
+ * what's inside it
+ */
+static int scanf_path_cmp(const void *a, const void *b) {
+  const struct scanf_conv *x = *(const struct scanf_conv *const *) a;
+  const struct scanf_conv *y = *(const struct scanf_conv *const *) b;
+  const char *p = x->path, *q = y->path;
+
+  for (; *p != '\0' && *p == *q; p++, q++) {
+  }
+  return scanf_path_rank(*p) - scanf_path_rank(*q);
+}
+
+/*
+ * Tell if scanf_num() can do the sscanf() conversion `fmt`: integer ones with
+ * an optional hh, h, l or ll, and floating point ones with an optional l.
+ * Return the conversion character, with 'f' for all the floating point ones,
+ * or 0.
+ */
+static char scanf_num_type(const char *fmt, char *len) {
+  const char *p = fmt + 1;
+
+  *len = 0;
+  if (p[0] == 'h' || p[0] == 'l') {
+    *len = p[1] == p[0] ? (p[0] == 'h' ? 'H' : 'L') : p[0];
+    p += p[1] == p[0] ? 2 : 1;
+  }
+  if (p[0] == '\0' || p[1] != '\0') return 0;
+  switch (p[0]) {
+    case 'd':
+    case 'i':
+    case 'u':
+      return p[0];
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+      return *len == 0 || *len == 'l' ? 'f' : 0;
+    default:
+      return 0;
+  }
+}
+
+/* Space taken by a plan, counted by scanf_parse() */
+struct scanf_sizes {
+  int num_convs;
+  int num_keys; /* At most: a path and each of its containers */
+  size_t paths_len;
+};
+
+/* Where scanf_parse() puts the plan */
+struct scanf_out {
+  struct scanf_conv *convs;
+  char *paths;
+};
+
+/*
+ * Parse the format, counting what the plan needs in `n`, and, if `out` is
+ * not NULL, filling the plan. Paths are built the same way the format has
+ * always been interpreted: `{` opens an object, a key replaces the last
+ * path component, `}` closes the object.
+ */
+static void scanf_parse(const char *fmt, const struct scanf_out *out,
+                        struct scanf_sizes *n) {
+  char path[JSON_MAX_PATH_LEN] = "";
+  char *p;
   int i = 0;
-  char *p = NULL;
-  struct json_scanf_info info = {0, path, fmtbuf, NULL, NULL, 0};
 
+  memset(n, 0, sizeof(*n));
   while (fmt[i] != '\0') {
     if (fmt[i] == '{') {
-      strcat(path, ".");
+      if (strlen(path) + 1 < sizeof(path)) strcat(path, ".");
       i++;
     } else if (fmt[i] == '}') {
       if ((p = strrchr(path, '.')) != NULL) *p = '\0';
       i++;
     } else if (fmt[i] == '%') {
-      info.target = va_arg(ap, void *);
-      info.type = fmt[i + 1];
+      struct scanf_conv tmp, *c = &tmp;
+      size_t path_len = strlen(path);
+      if (out != NULL) c = &out->convs[n->num_convs];
+      c->type = fmt[i + 1];
+      c->num_args = 1;
+      c->fmt[0] = '\0';
+      c->num = c->num_len = 0;
       switch (fmt[i + 1]) {
         case 'M':
         case 'V':
         case 'H':
-          info.user_data = va_arg(ap, void *);
+        case 'S':
+          c->num_args = 2;
         /* FALLTHROUGH */
         case 'B':
         case 'Q':
         case 'T':
           i += 2;
           break;
+        case '.':
+          if (fmt[i + 2] == '*' && fmt[i + 3] == 'Q') {
+            /* %.*Q, taking the size of the buffer, then the buffer */
+            c->type = 'q';
+            c->num_args = 2;
+            i += 4;
+            break;
+          }
+        /* FALLTHROUGH */
         default: {
           const char *delims = ", \t\r\n]}";
           int conv_len = strcspn(fmt + i + 1, delims) + 1;
-          snprintf(fmtbuf, sizeof(fmtbuf), "%.*s", conv_len, fmt + i);
+          c->type = 0; /* Left to sscanf() */
+          snprintf(c->fmt, sizeof(c->fmt), "%.*s", conv_len, fmt + i);
+          c->num = scanf_num_type(c->fmt, &c->num_len);
           i += conv_len;
           i += strspn(fmt + i, delims);
           break;
         }
       }
-      json_walk(s, len, json_scanf_cb, &info);
+      if (out != NULL) {
+        c->path = out->paths + n->paths_len;
+        memcpy(out->paths + n->paths_len, path, path_len + 1);
+      }
+      for (n->num_keys++, p = path; (p = strpbrk(p, ".[")) != NULL; p++) {
+        n->num_keys++;
+      }
+      n->paths_len += path_len + 1;
+      n->num_convs++;
     } else if (is_alpha(fmt[i]) || get_utf8_char_len(fmt[i]) > 1) {
       const char *delims = ": \r\n\t";
       int key_len = strcspn(&fmt[i], delims);
       if ((p = strrchr(path, '.')) != NULL) p[1] = '\0';
-      sprintf(path + strlen(path), "%.*s", key_len, &fmt[i]);
+      snprintf(path + strlen(path), sizeof(path) - strlen(path), "%.*s",
+               key_len, &fmt[i]);
       i += key_len + strspn(fmt + i + key_len, delims);
     } else {
       i++;
     }
   }
-  return info.num_conversions;
+}
+
+/*
+ * Compile `fmt` into `size` bytes at `mem`, if that's enough.
+ * Return the number of bytes the plan needs.
+ */
+static size_t scanf_compile(const char *fmt, void *mem, size_t size) {
+  struct json_scanf_plan *plan = (struct json_scanf_plan *) mem;
+  struct scanf_sizes n;
+  struct scanf_out out;
+  size_t need, num_slots = 1;
+  int i, j;
+
+  scanf_parse(fmt, NULL, &n);
+  /* Always at least one empty slot, to end the probing */
+  while (num_slots <= (size_t) n.num_keys) num_slots *= 2;
+  need = sizeof(*plan) + n.num_convs * sizeof(struct scanf_conv) +
+         n.num_convs * sizeof(struct scanf_conv *) +
+         num_slots * sizeof(struct scanf_key) + n.paths_len;
+  if (need > size) return need;
+
+  plan->num_convs = n.num_convs;
+  out.convs = plan->convs = (struct scanf_conv *) (plan + 1);
+  plan->order = (const struct scanf_conv **) (out.convs + n.num_convs);
+  plan->keys = (struct scanf_key *) (plan->order + n.num_convs);
+  plan->mask = (uint32_t) num_slots - 1;
+  out.paths = (char *) (plan->keys + num_slots);
+  scanf_parse(fmt, &out, &n);
+
+  for (i = 0; i < plan->num_convs; i++) plan->order[i] = &plan->convs[i];
+  qsort(plan->order, plan->num_convs, sizeof(*plan->order), scanf_path_cmp);
+
+  /* Add each path and its containers, the first time they turn up */
+  for (i = 0; i < (int) num_slots; i++) plan->keys[i].len = -1;
+  for (i = 0; i < plan->num_convs; i++) {
+    const char *path = plan->order[i]->path;
+    uint32_t hash = SCANF_HASH_INIT;
+    for (j = 0;; hash = SCANF_HASH_STEP(hash, path[j]), j++) {
+      if (path[j] == '\0' || path[j] == '.' || path[j] == '[') {
+        struct scanf_key *k = scanf_key_slot(plan, path, j, hash);
+        if (k->len < 0) {
+          k->hash = hash;
+          k->len = j;
+          k->first = i;
+          k->num_at = k->num_inside = 0;
+        }
+        if (path[j] == '\0') {
+          k->num_at++;
+          break;
+        }
+        k->num_inside++;
+      }
+    }
+  }
+  return need;
+}
+
+struct scanf_walk {
+  const struct json_scanf_plan *plan;
+  struct json_scanf_info *targets; /* In the order of the conversions */
+};
+
+/*
+ * Every event is looked up in the hash table of the plan, with the hash of
+ * its path, so the cost doesn't grow with the number of conversions.
+ */
+static int scanf_walk_cb(void *callback_data, const struct json_walk_event *ev,
+                         const struct json_token64 *token) {
+  struct scanf_walk *w = (struct scanf_walk *) callback_data;
+  const struct json_scanf_plan *plan = w->plan;
+  const char *path = ev->path;
+  const struct scanf_key *k;
+  uint32_t hash = SCANF_HASH_INIT;
+  int i, end, len;
+
+  for (len = 0; path[len] != '\0'; len++) {
+    hash = SCANF_HASH_STEP(hash, path[len]);
+  }
+  if (len > 0 && path[len - 1] == '.') return 0;
+  k = scanf_key_slot(plan, path, len, hash);
+
+  if (token->ptr == NULL) {
+    /*
+     * JSON_TYPE_OBJECT_START or JSON_TYPE_ARRAY_START has no value. Jump over
+     * the container unless some target is inside it: its end is still
+     * reported, with the whole container, for %T and %M.
+     */
+    return k->len >= 0 && k->num_inside > 0 ? 0 : JSON_WALK_SKIP;
+  }
+  if (k->len < 0) return 0;
+
+  for (i = k->first, end = i + k->num_at; i < end; i++) {
+    struct json_token tok;
+    /* Values of 2 GiB or more, in json_scanf64(), are not converted */
+    if (token->len > INT_MAX) continue;
+    tok.ptr = token->ptr;
+    tok.len = (int) token->len;
+    tok.type = token->type;
+    json_scanf_convert(&w->targets[plan->order[i] - plan->convs], &tok,
+                       ev->escaped);
+  }
+
+  return 0;
+}
+
+/*
+ * Run the plan on either the string `s,len`, or, if `idx` is not NULL, the
+ * indexed string. The index resolves each path without parsing the string
+ * again. Otherwise, the string is walked once for all the conversions. It is
+ * walked to the end even once they are all filled, since a duplicate key
+ * further on would override them. Strings go to `arena`, if not NULL.
+ */
+static int scanf_exec(const struct json_scanf_plan *plan, const char *s,
+                      size_t len, const struct json_index *idx,
+                      struct json_arena *arena, va_list ap) {
+  struct json_scanf_info buf[16], *targets = buf;
+  struct scanf_walk w;
+  size_t size = plan->num_convs * sizeof(*targets);
+  int i, res = 0;
+
+  if (plan->num_convs > (int) (sizeof(buf) / sizeof(buf[0]))) {
+    /* With an arena, even a large format doesn't need malloc() */
+    targets = (struct json_scanf_info *) (arena != NULL
+                                           ? json_arena_alloc(arena, size)
+                                           : malloc(size));
+    if (targets == NULL) return -1;
+  }
+
+  for (i = 0; i < plan->num_convs; i++) {
+    const struct scanf_conv *c = &plan->convs[i];
+    struct json_scanf_info *info = &targets[i];
+    info->num_conversions = 0;
+    info->path = c->path;
+    info->fmt = c->fmt;
+    info->type = c->type;
+    if (c->type == 'q') {
+      info->size = va_arg(ap, int);
+      info->target = va_arg(ap, void *);
+      info->user_data = NULL;
+    } else {
+      info->target = va_arg(ap, void *);
+      info->user_data = c->num_args > 1 ? va_arg(ap, void *) : NULL;
+    }
+    info->num = c->num;
+    info->num_len = c->num_len;
+    info->arena = arena;
+  }
+
+  if (idx != NULL) {
+    for (i = 0; i < plan->num_convs; i++) {
+      int n = json_index_find(idx, 0, targets[i].path);
+      if (n >= 0) {
+        struct json_token t;
+        index_token(idx, n, &t);
+        json_scanf_convert(&targets[i], &t,
+                           memchr(t.ptr, '\\', t.len) != NULL);
+      }
+    }
+  } else if (plan->num_convs > 0) {
+    w.plan = plan;
+    w.targets = targets;
+    json_walk_ex64(s, len, NULL, scanf_walk_cb, &w);
+  }
+
+  for (i = 0; i < plan->num_convs; i++) {
+    res += targets[i].num_conversions;
+  }
+  if (targets != buf && arena == NULL) free(targets);
+  return res;
+}
+
+/* Compile the format on the stack, if it's small enough, and run it */
+static int json_vscanf_impl(const char *s, size_t len,
+                            const struct json_index *idx,
+                            struct json_arena *arena, const char *fmt,
+                            va_list ap) {
+  union {
+    struct json_scanf_plan plan;
+    char buf[2048];
+  } u;
+  struct json_scanf_plan *plan = &u.plan;
+  size_t need = scanf_compile(fmt, &u, sizeof(u));
+  int res;
+
+  if (need > sizeof(u)) {
+    if ((plan = (struct json_scanf_plan *) malloc(need)) == NULL) return -1;
+    scanf_compile(fmt, plan, need);
+  }
+  res = scanf_exec(plan, s, len, idx, arena, ap);
+  if (plan != &u.plan) free(plan);
+  return res;
+}
+
+/* Length given to the int API: a negative one scans nothing */
+static size_t scanf_len(int len) {
+  return len < 0 ? 0 : (size_t) len;
+}
+
+struct json_scanf_plan *json_scanf_compile(const char *fmt) {
+  size_t need = scanf_compile(fmt, NULL, 0);
+  struct json_scanf_plan *plan = (struct json_scanf_plan *) malloc(need);
+  if (plan != NULL) scanf_compile(fmt, plan, need);
+  return plan;
+}
+
+int json_vscanf_exec(const struct json_scanf_plan *plan, const char *s,
+                     int len, va_list ap) {
+  return scanf_exec(plan, s, scanf_len(len), NULL, NULL, ap);
+}
+
+int json_scanf_exec(const struct json_scanf_plan *plan, const char *s,
+                    int len, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, len);
+  result = json_vscanf_exec(plan, s, len, ap);
+  va_end(ap);
+  return result;
+}
+
+int json_vscanf_exec_arena(const struct json_scanf_plan *plan,
+                           const char *s, int len, struct json_arena *arena,
+                           va_list ap) {
+  return scanf_exec(plan, s, scanf_len(len), NULL, arena, ap);
+}
+
+int json_scanf_exec_arena(const struct json_scanf_plan *plan, const char *s,
+                          int len, struct json_arena *arena, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, arena);
+  result = json_vscanf_exec_arena(plan, s, len, arena, ap);
+  va_end(ap);
+  return result;
+}
+
+void json_scanf_plan_free(struct json_scanf_plan *plan) {
+  free(plan);
+}
+
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+  return json_vscanf_impl(s, scanf_len(len), NULL, NULL, fmt, ap);
+}
+
+int json_vscanf_arena(const char *s, int len, struct json_arena *arena,
+                      const char *fmt, va_list ap) {
+  return json_vscanf_impl(s, scanf_len(len), NULL, arena, fmt, ap);
+}
+
+int json_vscanf64(const char *s, size_t len, const char *fmt, va_list ap) {
+  return json_vscanf_impl(s, len, NULL, NULL, fmt, ap);
+}
+
+int json_index_vscanf(const struct json_index *idx, const char *fmt,
+                      va_list ap) {
+  return json_vscanf_impl(idx->s, idx->len, idx, NULL, fmt, ap);
 }
 
 int json_scanf(const char *str, int len, const char *fmt, ...) {
@@ -253,3 +836,31 @@ int json_scanf(const char *str, int len, const char *fmt, ...) {
   va_end(ap);
   return result;
 }
+
+int json_scanf64(const char *str, size_t len, const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_vscanf64(str, len, fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+int json_scanf_arena(const char *str, int len, struct json_arena *arena,
+                     const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_vscanf_arena(str, len, arena, fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+int json_index_scanf(const struct json_index *idx, const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_index_vscanf(idx, fmt, ap);
+  va_end(ap);
+  return result;
+}
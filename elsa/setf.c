@@ -18,6 +18,7 @@
 #include "elsa.h"
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include "util.h"
 
@@ -25,24 +26,96 @@ struct json_setf_data {
   const char *json_path;
   const char *base; /* Pointer to the source JSON string */
   int matched;      /* Matched part of json_path */
-  int pos;          /* Offset of the mutated value begin */
-  int end;          /* Offset of the mutated value end */
-  int prev;         /* Offset of the previous token end */
+  ptrdiff_t pos;    /* Offset of the mutated value begin */
+  ptrdiff_t end;    /* Offset of the mutated value end */
+  ptrdiff_t prev;   /* Offset of the previous token end */
+  int string;       /* Non-0 if the value at json_path is a string */
+  int bad_path;     /* Changing json_path would not give valid JSON */
 };
 
+static int is_path_sep(int ch) {
+  return ch == '\0' || ch == '.' || ch == '[';
+}
+
+/*
+ * Length of the common part of paths `s1` and `s2`: either whole keys and
+ * indices, or up to the separator after which they differ, so that ".ab"
+ * and ".a" have only the "." in common.
+ */
 static int get_matched_prefix_len(const char *s1, const char *s2) {
   int i = 0;
   while (s1[i] && s2[i] && s1[i] == s2[i]) i++;
+  if (is_path_sep(s1[i]) && is_path_sep(s2[i])) return i;
+  while (i > 0 && s1[i - 1] != '.' && s1[i - 1] != '[') i--;
   return i;
 }
 
-static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
-                          const char *path, const struct json_token *t) {
+/*
+ * Non-0 if the missing keys of `json_path`, starting at `off`, can be added:
+ * each needs a name, and the first array index ends them.
+ */
+static int json_setf_can_add(const char *json_path, int off) {
+  int n;
+  if (off > 0 && json_path[off - 1] == '[') return 1;
+  for (;;) {
+    if ((n = strcspn(json_path + off, ".[")) == 0) return 0;
+    off += n;
+    if (json_path[off] != '.') return 1;
+    off++;
+  }
+}
+
+static int json_vsetf_cb(void *userdata, const struct json_walk_event *ev,
+                         const struct json_token64 *t) {
   struct json_setf_data *data = (struct json_setf_data *) userdata;
-  int off, len = get_matched_prefix_len(path, data->json_path);
-  if (t->ptr == NULL) return;
+  const char *path = ev->path;
+  ptrdiff_t off, end;
+  int plen = strlen(path);
+  int len = get_matched_prefix_len(path, data->json_path);
+  if (len == plen && t->type != JSON_TYPE_OBJECT_END &&
+      t->type != JSON_TYPE_ARRAY_END &&
+      (data->json_path[len] == '.' || data->json_path[len] == '[')) {
+    /*
+     * A value on the way to json_path must be an object or array to go on
+     * into. With duplicate keys, any one that is not makes the path bad.
+     */
+    if (t->type != (data->json_path[len] == '.' ? JSON_TYPE_OBJECT_START
+                                                : JSON_TYPE_ARRAY_START)) {
+      data->bad_path = 1;
+    }
+  }
+  if (t->ptr == NULL) {
+    /*
+     * Nothing inside a container off the path can be mutated: jump over it,
+     * its end is then reported like any other value. Unless a deeper match
+     * was seen, and the mutation position is not found yet: then the first
+     * nested container end sets it, as the code below does.
+     */
+    if (len < plen && (data->pos != 0 || len >= data->matched)) {
+      return JSON_WALK_SKIP;
+    }
+    /*
+     * The container at json_path is replaced as a whole: its contents must
+     * not move the previous value end, which deletion starts from.
+     */
+    if (len == plen && data->json_path[len] == '\0') return JSON_WALK_SKIP;
+    return 0;
+  }
   off = t->ptr - data->base;
-  if (len > data->matched) data->matched = len;
+  end = off + t->len;
+  if (t->type == JSON_TYPE_STRING) {
+    /*
+     * String token is the text between the quotes. They are deleted with
+     * it, but a new value goes between them, see json_setf_emit().
+     */
+    off--;
+    end++;
+  }
+  if (len > data->matched) {
+    /* Only a duplicate key can match deeper once the position is set */
+    if (data->pos != 0) data->bad_path = 1;
+    data->matched = len;
+  }
 
   /*
    * If there is no exact path match, set the mutation position to tbe end
@@ -53,11 +126,20 @@ static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
     data->pos = data->end = data->prev;
   }
 
+  /* Or right inside it, if it is empty and nothing deeper matched */
+  if (len == plen && len == data->matched && data->pos == 0 &&
+      (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) &&
+      (data->json_path[len] == '.' || data->json_path[len] == '[')) {
+    data->pos = data->end = data->prev = off + 1;
+    data->matched++; /* Missing keys start after the separator */
+  }
+
   /* Exact path match. Set mutation position to the value of this token */
   if (strcmp(path, data->json_path) == 0 && t->type != JSON_TYPE_OBJECT_START &&
       t->type != JSON_TYPE_ARRAY_START) {
     data->pos = off;
-    data->end = off + t->len;
+    data->end = end;
+    data->string = t->type == JSON_TYPE_STRING;
   }
 
   /*
@@ -69,43 +151,151 @@ static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
    * whether the object/array start is closer then previously stored prev.
    */
   if (data->pos == 0) {
-    data->prev = off + t->len; /* pos is not yet set */
-  } else if ((t->ptr[0] == '[' || t->ptr[0] == '{') && off + 1 < data->pos &&
-             off + 1 > data->prev) {
+    data->prev = end; /* pos is not yet set */
+  } else if ((data->base[off] == '[' || data->base[off] == '{') &&
+             off + 1 <= data->pos && off + 1 > data->prev) {
     data->prev = off + 1;
   }
-  (void) name;
-  (void) name_len;
+  return 0;
 }
 
-int json_vsetf(const char *s, int len, struct json_out *out,
-               const char *json_path, const char *json_fmt, va_list ap) {
-  struct json_setf_data data;
-  memset(&data, 0, sizeof(data));
-  data.json_path = json_path;
-  data.base = s;
-  data.end = len;
-  json_walk(s, len, json_vsetf_cb, &data);
+/* Same as append_to_path() of the walker: the path is cut at the buffer size */
+static size_t setf_path_append(char *path, size_t n, const char *str,
+                               size_t size) {
+  size_t left = JSON_MAX_PATH_LEN - n - 1;
+  if (size > left) size = left;
+  memcpy(path + n, str, size);
+  path[n + size] = '\0';
+  return n + size;
+}
+
+/* Append the path of the member `i` of an indexed container */
+static size_t setf_path_member(const struct json_index *idx, int i, int index,
+                               char *path, size_t n) {
+  const struct json_index_token *t = &idx->tokens[i];
+  char buf[20];
+  if (t->key_ofs >= 0) {
+    return setf_path_append(path, n, idx->s + t->key_ofs, t->key_len);
+  }
+  return setf_path_append(path, n, buf, snprintf(buf, sizeof(buf), "[%d]",
+                                                 index));
+}
+
+/*
+ * Feed json_vsetf_cb() the same tokens, with the same paths, as
+ * json_walk_ex64() reports for the indexed string, so that the edit is the
+ * same as json_setf() makes. Containers the callback skips are not entered,
+ * so only the way to `json_path` is visited.
+ * Return non-0 if the index is nested too deep to be replayed.
+ */
+static int json_index_setf_replay(const struct json_index *idx,
+                                  struct json_setf_data *data) {
+  struct {
+    int token;         /* Open container */
+    size_t path_len;   /* Path length before the container */
+    size_t member_len; /* Path length before its members */
+    int index;         /* Current member number */
+  } stack[JSON_MAX_DEPTH];
+  char path[JSON_MAX_PATH_LEN] = "";
+  struct json_walk_event ev;
+  struct json_token64 tok;
+  size_t n = 0;
+  int i = 0, depth = 0;
+
+  /* json_vsetf_cb() only looks at the path */
+  memset(&ev, 0, sizeof(ev));
+  ev.index = -1;
+  ev.path = path;
+
+  for (;;) {
+    const struct json_index_token *t = &idx->tokens[i];
+    tok.type = t->type;
+    tok.ptr = idx->s + t->ofs;
+    tok.len = t->len;
+    if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+      struct json_token64 start = {NULL, 0, JSON_TYPE_OBJECT_START};
+      if (t->type == JSON_TYPE_ARRAY_END) start.type = JSON_TYPE_ARRAY_START;
+      if (json_vsetf_cb(data, &ev, &start) != JSON_WALK_SKIP &&
+          i + 1 < idx->num_tokens && idx->tokens[i + 1].parent == i) {
+        /* Enter the container, its first member follows it */
+        if (depth >= JSON_MAX_DEPTH) return -1;
+        stack[depth].token = i;
+        stack[depth].path_len = n;
+        if (t->type == JSON_TYPE_OBJECT_END) {
+          n = setf_path_append(path, n, ".", 1);
+        }
+        stack[depth].member_len = n;
+        stack[depth].index = 0;
+        depth++;
+        n = setf_path_member(idx, ++i, 0, path, n);
+        continue;
+      }
+    }
+    json_vsetf_cb(data, &ev, &tok);
+
+    /* Close the containers whose last member this is */
+    while (depth > 0 && idx->tokens[i].next < 0) {
+      depth--;
+      i = stack[depth].token;
+      n = stack[depth].path_len;
+      path[n] = '\0';
+      tok.type = idx->tokens[i].type;
+      tok.ptr = idx->s + idx->tokens[i].ofs;
+      tok.len = idx->tokens[i].len;
+      json_vsetf_cb(data, &ev, &tok);
+    }
+    if (depth == 0) return 0;
+
+    /* Go on to the next member */
+    i = idx->tokens[i].next;
+    n = stack[depth - 1].member_len;
+    path[n] = '\0';
+    n = setf_path_member(idx, i, ++stack[depth - 1].index, path, n);
+  }
+}
+
+static int json_setf_emit(const char *s, size_t len, struct json_out *out,
+                          const char *json_path, struct json_setf_data data,
+                          const char *json_fmt, va_list ap) {
+  if (data.bad_path || strlen(json_path) >= JSON_MAX_PATH_LEN ||
+      (json_fmt == NULL && json_path[0] == '\0') ||
+      (json_fmt != NULL && data.pos == data.end &&
+       !json_setf_can_add(json_path, data.matched))) {
+    /*
+     * Leave the string as is, rather than break it: the path goes through
+     * a scalar or a duplicate key, is too long to tell from the others,
+     * deletes the whole string, or adds an empty key.
+     */
+    json_out_ref(out, s, len);
+    return JSON_STRING_INVALID;
+  }
   if (json_fmt == NULL) {
     /* Deletion codepath */
-    json_printf(out, "%.*s", data.prev, s);
+    json_out_ref(out, s, data.prev);
     /* Trim comma after the value that begins at object/array start */
-    if (s[data.prev - 1] == '{' || s[data.prev - 1] == '[') {
-      int i = data.end;
-      while (i < len && is_space(s[i])) i++;
-      if (s[i] == ',') data.end = i + 1; /* Point after comma */
+    if (data.prev > 0 && (s[data.prev - 1] == '{' || s[data.prev - 1] == '[')) {
+      ptrdiff_t i = data.end;
+      while (i < (ptrdiff_t) len && is_space(s[i])) i++;
+      if (i < (ptrdiff_t) len && s[i] == ',') data.end = i + 1; /* Comma */
     }
-    json_printf(out, "%.*s", len - data.end, s + data.end);
+    json_out_ref(out, s + data.end, len - data.end);
   } else {
     /* Modification codepath */
-    int n, off = data.matched, depth = 0;
+    int n, off = data.matched, depth = 0, res = data.end > data.pos ? 1 : 0;
+
+    /* A string is replaced between its quotes, e.g. with "%s" */
+    if (data.string) {
+      data.pos++;
+      data.end--;
+    }
 
     /* Print the unchanged beginning */
-    json_printf(out, "%.*s", data.pos, s);
+    json_out_ref(out, s, data.pos);
 
     /* Add missing keys */
     while ((n = strcspn(&json_path[off], ".[")) > 0) {
-      if (s[data.prev - 1] != '{' && s[data.prev - 1] != '[' && depth == 0) {
+      if (data.prev > 0 && s[data.prev - 1] != '{' && s[data.prev - 1] != '[' &&
+          depth == 0) {
         json_printf(out, ",");
       }
       if (off > 0 && json_path[off - 1] != '.') break;
@@ -128,11 +318,44 @@ int json_vsetf(const char *s, int len, struct json_out *out,
     }
 
     /* Print the rest of the unchanged string */
-    json_printf(out, "%.*s", len - data.end, s + data.end);
+    json_out_ref(out, s + data.end, len - data.end);
+    return res;
   }
   return data.end > data.pos ? 1 : 0;
 }
 
+int json_vsetf64(const char *s, size_t len, struct json_out *out,
+                 const char *json_path, const char *json_fmt, va_list ap) {
+  struct json_setf_data data;
+  memset(&data, 0, sizeof(data));
+  data.json_path = json_path;
+  data.base = s;
+  data.end = len;
+  json_walk_ex64(s, len, NULL, json_vsetf_cb, &data);
+  return json_setf_emit(s, len, out, json_path, data, json_fmt, ap);
+}
+
+int json_vsetf(const char *s, int len, struct json_out *out,
+               const char *json_path, const char *json_fmt, va_list ap) {
+  return json_vsetf64(s, len < 0 ? 0 : (size_t) len, out, json_path, json_fmt,
+                      ap);
+}
+
+int json_index_vsetf(const struct json_index *idx, struct json_out *out,
+                     const char *json_path, const char *json_fmt,
+                     va_list ap) {
+  struct json_setf_data data;
+  memset(&data, 0, sizeof(data));
+  data.json_path = json_path;
+  data.base = idx->s;
+  data.end = idx->len;
+  if (idx->num_tokens == 0 || json_index_setf_replay(idx, &data) != 0) {
+    /* Nothing to replay: let json_setf() walk whatever the string holds */
+    return json_vsetf(idx->s, idx->len, out, json_path, json_fmt, ap);
+  }
+  return json_setf_emit(idx->s, idx->len, out, json_path, data, json_fmt, ap);
+}
+
 int json_setf(const char *s, int len, struct json_out *out,
               const char *json_path, const char *json_fmt, ...) {
   int result;
@@ -142,3 +365,23 @@ int json_setf(const char *s, int len, struct json_out *out,
   va_end(ap);
   return result;
 }
+
+int json_setf64(const char *s, size_t len, struct json_out *out,
+                const char *json_path, const char *json_fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, json_fmt);
+  result = json_vsetf64(s, len, out, json_path, json_fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+int json_index_setf(const struct json_index *idx, struct json_out *out,
+                    const char *json_path, const char *json_fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, json_fmt);
+  result = json_index_vsetf(idx, out, json_path, json_fmt, ap);
+  va_end(ap);
+  return result;
+}
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2013 Cesanta Software Limited
+ * Copyright (c) 2020 Julian Smythe <sausage@tehsausage.com>
+ * All rights reserved
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "elsa.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+/* Open container being decoded, see struct_cb() */
+struct struct_frame {
+  const struct json_field *fields; /* Object: its fields; NULL for an array */
+  const struct json_field *array;  /* Array: its field */
+  char *base;                      /* Struct holding the fields or the array */
+  int count;                       /* Array: number of elements so far */
+  int cap;                         /* Array: room allocated, in elements */
+};
+
+struct struct_ctx {
+  const struct json_field *fields;
+  char *base;
+  int num_stored;
+  const struct json_field *pending; /* Container skipped to store its end */
+  char *pending_dst;
+  int depth; /* Number of open containers, all described by `stack` */
+  struct struct_frame stack[JSON_MAX_DEPTH];
+};
+
+/* Size of one value of the field */
+static size_t struct_size(const struct json_field *f) {
+  switch (f->type) {
+    case JSON_FIELD_BOOL:
+      return sizeof(bool);
+    case JSON_FIELD_INT:
+      return sizeof(int);
+    case JSON_FIELD_UINT:
+      return sizeof(unsigned int);
+    case JSON_FIELD_LLONG:
+      return sizeof(long long);
+    case JSON_FIELD_ULLONG:
+      return sizeof(unsigned long long);
+    case JSON_FIELD_DOUBLE:
+      return sizeof(double);
+    case JSON_FIELD_FLOAT:
+      return sizeof(float);
+    case JSON_FIELD_STRING:
+      return sizeof(char *);
+    case JSON_FIELD_TOKEN:
+      return sizeof(struct json_token);
+    default:
+      return f->size;
+  }
+}
+
+static const struct json_field *struct_find(const struct json_field *f,
+                                            const char *name, size_t len) {
+  for (; f->key != NULL; f++) {
+    if (f->key[0] == name[0] && strncmp(f->key, name, len) == 0 &&
+        f->key[len] == '\0') {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+/* Store a scalar value, return non-0 if it has the right type and fits */
+static int struct_store(const struct json_field *f, char *dst,
+                        const struct json_token *t, int escaped) {
+  const char *end = t->ptr + t->len;
+  uint64_t v;
+  double d;
+  int neg;
+
+  switch (f->type) {
+    case JSON_FIELD_BOOL:
+      if (t->type != JSON_TYPE_TRUE && t->type != JSON_TYPE_FALSE) return 0;
+      *(bool *) dst = t->type == JSON_TYPE_TRUE;
+      return 1;
+    case JSON_FIELD_INT:
+    case JSON_FIELD_UINT:
+    case JSON_FIELD_LLONG:
+    case JSON_FIELD_ULLONG:
+      if (t->type != JSON_TYPE_NUMBER ||
+          json_parse_int(t->ptr, end, &neg, &v) != end) {
+        return 0;
+      }
+      if (f->type == JSON_FIELD_INT) {
+        if (v > (uint64_t) INT_MAX + neg) return 0;
+        *(int *) dst = neg ? (int) -(long long) v : (int) v;
+      } else if (f->type == JSON_FIELD_LLONG) {
+        if (v > (uint64_t) LLONG_MAX + neg) return 0;
+        *(long long *) dst = neg && v != 0 ? -(long long) (v - 1) - 1
+                                           : (long long) v;
+      } else if (neg && v != 0) {
+        return 0;
+      } else if (f->type == JSON_FIELD_UINT) {
+        if (v > UINT_MAX) return 0;
+        *(unsigned int *) dst = (unsigned int) v;
+      } else {
+        *(unsigned long long *) dst = v;
+      }
+      return 1;
+    case JSON_FIELD_DOUBLE:
+      if (t->type != JSON_TYPE_NUMBER ||
+          json_parse_double(t->ptr, end, &d) != end) {
+        return 0;
+      }
+      *(double *) dst = d;
+      return 1;
+    case JSON_FIELD_FLOAT:
+      if (t->type != JSON_TYPE_NUMBER ||
+          json_parse_float(t->ptr, end, (float *) dst) != end) {
+        return 0;
+      }
+      return 1;
+    case JSON_FIELD_STRING: {
+      char *s = NULL;
+      int n = t->len;
+      if (t->type == JSON_TYPE_NULL) {
+        *(char **) dst = NULL;
+        return 1;
+      }
+      if (t->type != JSON_TYPE_STRING) return 0;
+      if (escaped && (n = json_unescape(t->ptr, t->len, NULL, 0)) < 0) {
+        return 0;
+      }
+      if ((s = (char *) malloc(n + 1)) == NULL) return 0;
+      if (escaped) {
+        json_unescape(t->ptr, t->len, s, n);
+      } else {
+        memcpy(s, t->ptr, n);
+      }
+      s[n] = '\0';
+      *(char **) dst = s;
+      return 1;
+    }
+    case JSON_FIELD_CHARS: {
+      int n;
+      if (t->type != JSON_TYPE_STRING || f->size == 0) return 0;
+      if ((n = json_unescape(t->ptr, t->len, dst, (int) f->size - 1)) < 0) {
+        return 0;
+      }
+      dst[n < (int) f->size - 1 ? n : (int) f->size - 1] = '\0';
+      return 1;
+    }
+    case JSON_FIELD_TOKEN:
+      *(struct json_token *) dst = *t;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Room for the next element of the array, or NULL if there's no more. An
+ * array that is allocated grows as needed.
+ */
+static char *struct_elem(struct struct_frame *fr) {
+  const struct json_field *f = fr->array;
+  size_t size = struct_size(f);
+  char **arr = (char **) (fr->base + f->offset);
+
+  if (!(f->flags & JSON_FIELD_ALLOC)) {
+    return fr->count < f->max ? fr->base + f->offset + fr->count * size : NULL;
+  }
+  if (f->max > 0 && fr->count >= f->max) return NULL;
+  if (fr->count >= fr->cap) {
+    int cap = fr->cap == 0 ? 4 : fr->cap * 2;
+    char *p = (char *) realloc(*arr, cap * size);
+    if (p == NULL) return NULL;
+    memset(p + fr->cap * size, 0, (cap - fr->cap) * size);
+    *arr = p;
+    fr->cap = cap;
+  }
+  return *arr + fr->count * size;
+}
+
+static int struct_cb(void *data, const struct json_walk_event *ev,
+                     const struct json_token *t) {
+  struct struct_ctx *c = (struct struct_ctx *) data;
+  struct struct_frame *fr;
+  const struct json_field *f;
+  char *dst;
+  int start = t->ptr == NULL;
+
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+    if (c->depth > ev->depth) {
+      /* End of a container that was decoded */
+      fr = &c->stack[--c->depth];
+      if (fr->array != NULL) {
+        *(int *) (fr->base + fr->array->count_offset) = fr->count;
+      }
+    } else if (c->pending != NULL) {
+      /* End of a container that was skipped, with the whole of it */
+      c->num_stored += struct_store(c->pending, c->pending_dst, t, 0);
+      c->pending = NULL;
+    }
+    return 0;
+  }
+
+  if (ev->depth == 0) {
+    if (t->type != JSON_TYPE_OBJECT_START) return start ? JSON_WALK_SKIP : 0;
+    fr = &c->stack[c->depth++];
+    fr->fields = c->fields;
+    fr->array = NULL;
+    fr->base = c->base;
+    return 0;
+  }
+
+  fr = &c->stack[ev->depth - 1];
+  if (fr->fields != NULL) {
+    f = ev->name == NULL ? NULL
+                         : struct_find(fr->fields, ev->name, ev->name_len);
+    if (f == NULL) return start ? JSON_WALK_SKIP : 0;
+    if (f->flags & (JSON_FIELD_ARRAY | JSON_FIELD_ALLOC)) {
+      if (t->type != JSON_TYPE_ARRAY_START) return start ? JSON_WALK_SKIP : 0;
+      dst = fr->base;
+      fr = &c->stack[c->depth++];
+      fr->fields = NULL;
+      fr->array = f;
+      fr->base = dst;
+      fr->count = fr->cap = 0;
+      if (f->flags & JSON_FIELD_ALLOC) *(char **) (dst + f->offset) = NULL;
+      return 0;
+    }
+    dst = fr->base + f->offset;
+  } else {
+    /* Array element, in the next slot */
+    f = fr->array;
+    if ((dst = struct_elem(fr)) == NULL) return start ? JSON_WALK_SKIP : 0;
+    fr->count++;
+  }
+
+  if (f->type == JSON_FIELD_OBJECT && t->type == JSON_TYPE_OBJECT_START) {
+    fr = &c->stack[c->depth++];
+    fr->fields = f->fields;
+    fr->array = NULL;
+    fr->base = dst;
+    return 0;
+  }
+  if (start) {
+    /* Nothing to decode inside, but a token takes the whole container */
+    if (f->type == JSON_FIELD_TOKEN) {
+      c->pending = f;
+      c->pending_dst = dst;
+    }
+    return JSON_WALK_SKIP;
+  }
+  c->num_stored += struct_store(f, dst, t, ev->escaped);
+  return 0;
+}
+
+int json_scan_struct(const char *str, int str_len,
+                     const struct json_field *fields, void *base) {
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  struct struct_ctx c;
+  int res;
+
+  c.fields = fields;
+  c.base = (char *) base;
+  c.num_stored = 0;
+  c.pending = NULL;
+  c.depth = 0;
+  res = json_walk_ex(str, str_len, &opts, struct_cb, &c);
+  return res < 0 ? res : c.num_stored;
+}
+
+/* Print a number so that it reads back the same, in as few digits as can */
+static int struct_print_double(struct json_out *out, double d, int single) {
+  char buf[32];
+
+  if (d - d != 0) return out->printer(out, "null", 4);
+  return out->printer(out, buf, json_format_double(buf, d, single));
+}
+
+static int struct_print_value(struct json_out *out,
+                              const struct json_field *f, const char *src) {
+  switch (f->type) {
+    case JSON_FIELD_BOOL:
+      return json_printf(out, "%B", (int) *(const bool *) src);
+    case JSON_FIELD_INT:
+      return json_printf(out, "%d", *(const int *) src);
+    case JSON_FIELD_UINT:
+      return json_printf(out, "%u", *(const unsigned int *) src);
+    case JSON_FIELD_LLONG:
+      return json_printf(out, "%lld", *(const long long *) src);
+    case JSON_FIELD_ULLONG:
+      return json_printf(out, "%llu", *(const unsigned long long *) src);
+    case JSON_FIELD_DOUBLE:
+      return struct_print_double(out, *(const double *) src, 0);
+    case JSON_FIELD_FLOAT:
+      return struct_print_double(out, *(const float *) src, 1);
+    case JSON_FIELD_STRING:
+      return json_printf(out, "%Q", *(const char *const *) src);
+    case JSON_FIELD_CHARS: {
+      const char *nul = (const char *) memchr(src, '\0', f->size);
+      int n = (int) (nul != NULL ? (size_t) (nul - src) : f->size);
+      return json_printf(out, "%.*Q", n, src);
+    }
+    case JSON_FIELD_TOKEN: {
+      const struct json_token *t = (const struct json_token *) src;
+      if (t->ptr == NULL) return out->printer(out, "null", 4);
+      if (t->type == JSON_TYPE_STRING) {
+        return json_printf(out, "%.*Q", t->len, t->ptr);
+      }
+      return out->printer(out, t->ptr, t->len);
+    }
+    case JSON_FIELD_OBJECT:
+      return json_print_struct(out, f->fields, src);
+    default:
+      return out->printer(out, "null", 4);
+  }
+}
+
+int json_print_struct(struct json_out *out, const struct json_field *fields,
+                      const void *base) {
+  const char *b = (const char *) base;
+  const struct json_field *f;
+  int len = 0;
+
+  len += out->printer(out, "{", 1);
+  for (f = fields; f->key != NULL; f++) {
+    if (f != fields) len += out->printer(out, ",", 1);
+    len += json_printf(out, "%Q:", f->key);
+    if (f->flags & (JSON_FIELD_ARRAY | JSON_FIELD_ALLOC)) {
+      const char *arr = f->flags & JSON_FIELD_ALLOC
+                            ? *(const char *const *) (b + f->offset)
+                            : b + f->offset;
+      size_t size = struct_size(f);
+      int i, n = *(const int *) (b + f->count_offset);
+      if (!(f->flags & JSON_FIELD_ALLOC) && n > f->max) n = f->max;
+      if (arr == NULL) n = 0;
+      len += out->printer(out, "[", 1);
+      for (i = 0; i < n; i++) {
+        if (i > 0) len += out->printer(out, ",", 1);
+        len += struct_print_value(out, f, arr + i * size);
+      }
+      len += out->printer(out, "]", 1);
+    } else {
+      len += struct_print_value(out, f, b + f->offset);
+    }
+  }
+  len += out->printer(out, "}", 1);
+  return len;
+}
+
+static void struct_free_value(const struct json_field *f, char *p) {
+  if (f->type == JSON_FIELD_STRING) {
+    free(*(char **) p);
+    *(char **) p = NULL;
+  } else if (f->type == JSON_FIELD_OBJECT) {
+    json_free_struct(f->fields, p);
+  }
+}
+
+void json_free_struct(const struct json_field *fields, void *base) {
+  char *b = (char *) base;
+  const struct json_field *f;
+
+  for (f = fields; f->key != NULL; f++) {
+    if (f->flags & (JSON_FIELD_ARRAY | JSON_FIELD_ALLOC)) {
+      char *arr = f->flags & JSON_FIELD_ALLOC ? *(char **) (b + f->offset)
+                                              : b + f->offset;
+      int i, n = *(int *) (b + f->count_offset);
+      if (!(f->flags & JSON_FIELD_ALLOC) && n > f->max) n = f->max;
+      for (i = 0; arr != NULL && i < n; i++) {
+        struct_free_value(f, arr + i * struct_size(f));
+      }
+      if (f->flags & JSON_FIELD_ALLOC) {
+        free(arr);
+        *(char **) (b + f->offset) = NULL;
+      }
+      *(int *) (b + f->count_offset) = 0;
+    } else {
+      struct_free_value(f, b + f->offset);
+    }
+  }
+}
+
+/* Array being decoded by json_scanf_array() */
+struct struct_array {
+  struct json_field field;
+  char *dst;
+  size_t size;
+  int cap;
+  int count;
+  int num_stored;
+};
+
+static int struct_array_cb(void *data, const struct json_walk_event *ev,
+                           const struct json_token *t) {
+  struct struct_array *a = (struct struct_array *) data;
+
+  if (ev->depth == 0) return 0;
+  /* A nested container takes a slot, at its end, but is never stored */
+  if (t->ptr == NULL) return JSON_WALK_SKIP;
+  if (a->count < a->cap) {
+    a->num_stored += struct_store(&a->field, a->dst + a->count * a->size, t,
+                                  ev->escaped);
+  }
+  a->count++;
+  return 0;
+}
+
+int json_scanf_array(const char *s, int len, const char *path,
+                     enum json_field_type type, void *dst, int cap,
+                     int *count) {
+  const char *end = s + len, *p = json_scan_path(s, end, path);
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  struct struct_array a;
+  int res;
+
+  if (count != NULL) *count = 0;
+  if (type == JSON_FIELD_CHARS || type == JSON_FIELD_OBJECT || p == NULL ||
+      p >= end || *p != '[') {
+    return -1;
+  }
+  memset(&a, 0, sizeof(a));
+  a.field.type = type;
+  a.dst = (char *) dst;
+  a.size = struct_size(&a.field);
+  a.cap = dst == NULL || cap < 0 ? 0 : cap;
+  res = json_walk_ex(p, (size_t)(end - p), &opts, struct_array_cb, &a);
+  if (count != NULL) *count = a.count;
+  return res < 0 ? res : a.num_stored;
+}
@@ -18,8 +18,83 @@
 #ifndef ELSA_UTIL_H_
 #define ELSA_UTIL_H_
 
+#include <stdint.h>
 #include "elsa.h"
 
+/*
+ * Block scanners, see scan.c.
+ * json_scan_spaces() returns the first non-whitespace byte in `p,end`.
+ * json_scan_plain() returns the first byte in `p,end` that a string literal
+ * lexer must look at: a quote, a backslash, a control or a non-ASCII byte.
+ * Both return `end` if there is no such byte.
+ * json_scan_skip() returns the end of the value at `p`, counting brackets
+ * and quotes without validating anything, or NULL if the value goes on
+ * past `end`.
+ *
+ * Built on it, for jumping around a string without parsing all of it:
+ * json_scan_value() fills `t` with the value after whitespace at `p`, the
+ * same way json_walk() would, and returns its end. json_scan_valid_value()
+ * also checks that json_walk() would accept it. json_scan_key() does the
+ * same as json_scan_value() for an object key and returns the position
+ * after the colon.
+ * json_scan_path() returns the first byte of the value at `path`.
+ * All return NULL if there's no such value, or it is incomplete.
+ */
+const char *json_scan_spaces(const char *p, const char *end);
+const char *json_scan_plain(const char *p, const char *end);
+const char *json_scan_skip(const char *p, const char *end);
+const char *json_scan_value(const char *p, const char *end,
+                            struct json_token64 *t);
+const char *json_scan_valid_value(const char *p, const char *end,
+                                  struct json_token64 *t);
+const char *json_scan_key(const char *p, const char *end,
+                          struct json_token64 *key);
+const char *json_scan_path(const char *p, const char *end, const char *path);
+
+/*
+ * Walk the value at `json_string` as the element `index` of a top-level
+ * array, with the same names, paths and depth limit json_walk() would give
+ * it there.
+ */
+ptrdiff_t json_walk_element(const char *json_string, size_t json_string_length,
+                            int index, json_walk_callback_t callback,
+                            void *callback_data);
+
+/*
+ * Number parsers, see number.c. They parse the number at `p`, stopping at
+ * the first byte that can't be part of it, and return the position of that
+ * byte, or NULL if there are no digits or the number doesn't fit.
+ * json_parse_int() gives the sign and the absolute value separately.
+ */
+const char *json_parse_int(const char *p, const char *end, int *neg,
+                           uint64_t *v);
+const char *json_parse_double(const char *p, const char *end, double *v);
+const char *json_parse_float(const char *p, const char *end, float *v);
+
+/*
+ * Number formatters, see number.c.
+ * json_format_int() writes the integer with the sign `neg` and the absolute
+ * value `v`. json_format_double() writes the shortest number that reads back
+ * as `v`, or as the float `(float) v` if `single` is non-0, which must be
+ * finite. Both write at most 32 bytes, with no NUL, and return the length.
+ * json_shortest() gives the digits of that number, for `v` finite and
+ * positive: `v` reads back from them times 10^`*k`. It writes at most 17
+ * digits and returns their number.
+ * json_round() gives `v` times 10^`m` rounded to the nearest integer, for
+ * `v` finite and positive, and returns 1, or 0 if it can't tell for sure.
+ */
+int json_format_int(char *buf, int neg, uint64_t v);
+int json_format_double(char *buf, double v, int single);
+int json_shortest(double v, int single, char *buf, int *k);
+int json_round(double v, int m, uint64_t *r);
+
+/*
+ * Print `buf,len`, which the caller of the printing function passed in, so
+ * it lives as long as the output needs: JSON_OUT_IOV() references it rather
+ * than copying it, if it's long enough. See printer.c.
+ */
+int json_out_ref(struct json_out *out, const char *buf, size_t len);
+
 static int is_space(int ch) {
   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
@@ -81,4 +156,13 @@ static int get_utf8_char_len(unsigned char ch) {
   }
 }
 
+/* Fill `t` with the token number `i` of the index `idx` */
+static void index_token(const struct json_index *idx, int i,
+                        struct json_token *t) {
+  const struct json_index_token *it = &idx->tokens[i];
+  t->ptr = idx->s + it->ofs;
+  t->len = it->len;
+  t->type = it->type;
+}
+
 #endif /* ELSA_UTIL_H_ */
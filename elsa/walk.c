@@ -16,11 +16,30 @@
  */
 
 #include "elsa.h"
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "util.h"
 
+/* Where we are inside an open container, see walk_step() */
+enum walk_state {
+  WALK_MEMBER, /* Expecting a member, or the end of the container */
+  WALK_COLON,  /* Object key is parsed, expecting the colon */
+  WALK_VALUE,  /* Colon is parsed, expecting the value */
+  WALK_NEXT    /* Member is parsed, expecting a comma or the end */
+};
+
+struct walk_frame {
+  const char *ptr;     /* Opening brace or bracket */
+  int path_len;        /* Path length before the container */
+  int member_path_len; /* Path length before the current member */
+  int index;           /* Number of array elements seen so far */
+  char type;           /* '{' or '[' */
+  char state;          /* enum walk_state */
+};
+
 struct walk_ctx {
   const char *end;
   const char *cur;
@@ -33,6 +52,33 @@ struct walk_ctx {
   size_t path_len;
   void *callback_data;
   json_walk_callback_t callback;
+  json_walk64_callback_t callback64;
+
+  /* For json_walk_ex() */
+  json_walk_ex_callback_t ex_callback;
+  json_walk_ex64_callback_t ex_callback64;
+  int flags;
+  int cur_index; /* Index of the current array element, or -1 */
+  int in_key;    /* Non-0 while parsing an object key */
+  int escaped;   /* Non-0 if the current string has escapes */
+
+  /* For json_walk_filtered() */
+  const char *filter;
+  size_t filter_len;
+
+  /* Open containers, innermost last: in `stack`, or on the heap if deeper */
+  struct walk_frame stack[JSON_MAX_DEPTH];
+  struct walk_frame *frames;
+  int num_frames; /* Number of entries in `frames` */
+  int max_depth;
+  int depth;
+  int done;    /* Non-0 once the top-level value is complete */
+  int partial; /* Non-0 if more input may follow `end`, see json_parser */
+
+  /* For json_parser, which only keeps the input it still needs */
+  int streaming;      /* Non-0 if the consumed input may be gone */
+  const char *resume; /* Where the string cut by the last chunk goes on */
+  int resume_escaped; /* `escaped` of that string so far */
 };
 
 struct fstate {
@@ -44,25 +90,96 @@ struct fstate {
   struct fstate fstate = {(ptr), (ctx)->path_len}; \
   append_to_path((ctx), (str), (len));
 
-#define CALL_BACK(ctx, tok, value, len)                                       \
-  do {                                                                        \
-    if ((ctx)->callback &&                                                    \
-        ((ctx)->path_len == 0 || (ctx)->path[(ctx)->path_len - 1] != '.')) {  \
-      struct json_token t = {(value), (len), (tok)};                          \
-                                                                              \
-      /* Call the callback with the given value and current name */           \
-      (ctx)->callback((ctx)->callback_data, (ctx)->cur_name,                  \
-                      (ctx)->cur_name_len, (ctx)->path, &t);                  \
-                                                                              \
-      /* Reset the name */                                                    \
-      (ctx)->cur_name = NULL;                                                 \
-      (ctx)->cur_name_len = 0;                                                \
-    }                                                                         \
-  } while (0)
+/* How the current path relates to the filter of json_walk_filtered() */
+enum filter_match {
+  FILTER_OUT,   /* Neither the filter path nor anything under it */
+  FILTER_ABOVE, /* A container on the way to the filter path */
+  FILTER_IN     /* The filter path or something under it */
+};
+
+static enum filter_match filter_path(const struct walk_ctx *ctx) {
+  size_t n = ctx->filter_len;
+  int ch;
+  if (ctx->filter == NULL) return FILTER_IN;
+  if (ctx->path_len >= n) {
+    ch = ctx->path[n];
+    return memcmp(ctx->path, ctx->filter, n) == 0 &&
+                   (ch == '\0' || ch == '.' || ch == '[')
+               ? FILTER_IN
+               : FILTER_OUT;
+  }
+  ch = ctx->filter[ctx->path_len];
+  return memcmp(ctx->path, ctx->filter, ctx->path_len) == 0 &&
+                 (ch == '.' || ch == '[')
+             ? FILTER_ABOVE
+             : FILTER_OUT;
+}
+
+/*
+ * Report a token. Return a negative value to stop the walk, or
+ * JSON_WALK_SKIP if the extended callback asked to skip the container.
+ */
+static int call_back(struct walk_ctx *ctx, enum json_token_type tok,
+                     const char *value, size_t len) {
+  struct json_token t;
+  int res = 0;
+
+  t.ptr = value;
+  t.len = (int) len;
+  t.type = tok;
+
+  if (ctx->ex_callback != NULL || ctx->ex_callback64 != NULL) {
+    /* Keys are parsed as strings, but not reported */
+    if (ctx->in_key) return 0;
+    {
+      struct json_walk_event ev;
+      ev.name = ctx->cur_name;
+      ev.name_len = ctx->cur_name_len;
+      ev.index = ctx->cur_index;
+      ev.depth = ctx->depth;
+      ev.path = ctx->flags & JSON_WALK_NO_PATH ? NULL : ctx->path;
+      ev.escaped = tok == JSON_TYPE_STRING && ctx->escaped;
+      if (ctx->ex_callback64 != NULL) {
+        struct json_token64 t64;
+        t64.ptr = value;
+        t64.len = len;
+        t64.type = tok;
+        res = ctx->ex_callback64(ctx->callback_data, &ev, &t64);
+      } else {
+        res = ctx->ex_callback(ctx->callback_data, &ev, &t);
+      }
+    }
+  } else if ((ctx->callback != NULL || ctx->callback64 != NULL) &&
+             (ctx->path_len == 0 || ctx->path[ctx->path_len - 1] != '.') &&
+             filter_path(ctx) == FILTER_IN) {
+    /* Call the callback with the given value and current name */
+    if (ctx->callback64 != NULL) {
+      struct json_token64 t64;
+      t64.ptr = value;
+      t64.len = len;
+      t64.type = tok;
+      ctx->callback64(ctx->callback_data, ctx->cur_name, ctx->cur_name_len,
+                      ctx->path, &t64);
+    } else {
+      ctx->callback(ctx->callback_data, ctx->cur_name, ctx->cur_name_len,
+                    ctx->path, &t);
+    }
+  } else {
+    return 0;
+  }
+
+  /* Reset the name */
+  ctx->cur_name = NULL;
+  ctx->cur_name_len = 0;
+  ctx->cur_index = -1;
+
+  return res;
+}
 
 static int append_to_path(struct walk_ctx *ctx, const char *str, int size) {
   int n = ctx->path_len;
   int left = sizeof(ctx->path) - n - 1;
+  if (ctx->flags & JSON_WALK_NO_PATH) return n;
   if (size > left) size = left;
   memcpy(ctx->path + n, str, size);
   ctx->path[n + size] = '\0';
@@ -75,9 +192,6 @@ static void truncate_path(struct walk_ctx *ctx, size_t len) {
   ctx->path[len] = '\0';
 }
 
-static int parse_object(struct walk_ctx *ctx);
-static int parse_value(struct walk_ctx *ctx);
-
 #define EXPECT(cond, err_code)      \
   do {                              \
     if (!(cond)) return (err_code); \
@@ -89,14 +203,19 @@ static int parse_value(struct walk_ctx *ctx);
     if (_n < 0) return _n; \
   } while (0)
 
+#define CALL_BACK(ctx, tok, value, len) \
+  TRY(call_back((ctx), (tok), (value), (len)))
+
 #define END_OF_STRING (-1)
 
+/* Bytes left, capped: it's only used to look a few bytes ahead */
 static int left(const struct walk_ctx *ctx) {
-  return ctx->end - ctx->cur;
+  ptrdiff_t n = ctx->end - ctx->cur;
+  return n > INT_MAX ? INT_MAX : (int) n;
 }
 
 static void skip_whitespaces(struct walk_ctx *ctx) {
-  while (ctx->cur < ctx->end && is_space(*ctx->cur)) ctx->cur++;
+  ctx->cur = json_scan_spaces(ctx->cur, ctx->end);
 }
 
 static int cur(struct walk_ctx *ctx) {
@@ -122,6 +241,7 @@ static int parse_identifier(struct walk_ctx *ctx) {
            (*ctx->cur == '_' || is_alpha(*ctx->cur) || is_digit(*ctx->cur))) {
       ctx->cur++;
     }
+    EXPECT(!ctx->partial || ctx->cur < ctx->end, JSON_STRING_INCOMPLETE);
     truncate_path(ctx, fstate.path_len);
     CALL_BACK(ctx, JSON_TYPE_STRING, fstate.ptr, ctx->cur - fstate.ptr);
   }
@@ -132,25 +252,44 @@ static int parse_identifier(struct walk_ctx *ctx) {
 static int parse_string(struct walk_ctx *ctx) {
   int n, ch = 0, len = 0;
   TRY(test_and_skip(ctx, '"'));
+  ctx->escaped = 0;
   {
     SET_STATE(ctx, ctx->cur, "", 0);
+    if (ctx->resume != NULL) {
+      /* The previous chunks of the string are already checked */
+      ctx->cur = ctx->resume;
+      ctx->escaped = ctx->resume_escaped;
+      ctx->resume = NULL;
+    }
     for (; ctx->cur < ctx->end; ctx->cur += len) {
+      /* Jump over the plain ASCII run, then look at what stopped it */
+      ctx->cur = json_scan_plain(ctx->cur, ctx->end);
+      if (ctx->cur >= ctx->end) break;
       ch = *(unsigned char *) ctx->cur;
       len = get_utf8_char_len((unsigned char) ch);
       EXPECT(ch >= 32 && len > 0, JSON_STRING_INVALID); /* No control chars */
-      EXPECT(len <= left(ctx), JSON_STRING_INCOMPLETE);
+      if (len > left(ctx)) break;
       if (ch == '\\') {
-        EXPECT((n = get_escape_len(ctx->cur + 1, left(ctx))) > 0, n);
+        if (left(ctx) < 2) break;
+        n = get_escape_len(ctx->cur + 1, left(ctx));
+        if (n == JSON_STRING_INCOMPLETE) break;
+        EXPECT(n > 0, n);
         len += n;
+        ctx->escaped = 1;
       } else if (ch == '"') {
         truncate_path(ctx, fstate.path_len);
         CALL_BACK(ctx, JSON_TYPE_STRING, fstate.ptr, ctx->cur - fstate.ptr);
         ctx->cur++;
-        break;
+        return 0;
       };
     }
+    if (ctx->partial) {
+      /* Go on from the incomplete character, when the next chunk comes */
+      ctx->resume = ctx->cur;
+      ctx->resume_escaped = ctx->escaped;
+    }
   }
-  return ch == '"' ? 0 : JSON_STRING_INCOMPLETE;
+  return JSON_STRING_INCOMPLETE;
 }
 
 /* number = [ '-' ] digit+ [ '.' digit+ ] [ ['e'|'E'] ['+'|'-'] digit+ ] */
@@ -175,39 +314,13 @@ static int parse_number(struct walk_ctx *ctx) {
     EXPECT(is_digit(ctx->cur[0]), JSON_STRING_INVALID);
     while (ctx->cur < ctx->end && is_digit(ctx->cur[0])) ctx->cur++;
   }
+  /* Number may go on in the next chunk */
+  EXPECT(!ctx->partial || ctx->cur < ctx->end, JSON_STRING_INCOMPLETE);
   truncate_path(ctx, fstate.path_len);
   CALL_BACK(ctx, JSON_TYPE_NUMBER, fstate.ptr, ctx->cur - fstate.ptr);
   return 0;
 }
 
-/* array = '[' [ value { ',' value } ] ']' */
-static int parse_array(struct walk_ctx *ctx) {
-  int i = 0, current_path_len;
-  char buf[20];
-  CALL_BACK(ctx, JSON_TYPE_ARRAY_START, NULL, 0);
-  TRY(test_and_skip(ctx, '['));
-  {
-    {
-      SET_STATE(ctx, ctx->cur - 1, "", 0);
-      while (cur(ctx) != ']') {
-        snprintf(buf, sizeof(buf), "[%d]", i);
-        i++;
-        current_path_len = append_to_path(ctx, buf, strlen(buf));
-        ctx->cur_name =
-            ctx->path + strlen(ctx->path) - strlen(buf) + 1 /*opening brace*/;
-        ctx->cur_name_len = strlen(buf) - 2 /*braces*/;
-        TRY(parse_value(ctx));
-        truncate_path(ctx, current_path_len);
-        if (cur(ctx) == ',') ctx->cur++;
-      }
-      TRY(test_and_skip(ctx, ']'));
-      truncate_path(ctx, fstate.path_len);
-      CALL_BACK(ctx, JSON_TYPE_ARRAY_END, fstate.ptr, ctx->cur - fstate.ptr);
-    }
-  }
-  return 0;
-}
-
 static int expect(struct walk_ctx *ctx, const char *s, int len,
                   enum json_token_type tok_type) {
   int i, n = left(ctx);
@@ -224,6 +337,68 @@ static int expect(struct walk_ctx *ctx, const char *s, int len,
   return 0;
 }
 
+/*
+ * Jump over an object or array without parsing it, reporting just its end
+ * if `report` is non-0.
+ */
+static int skip_container(struct walk_ctx *ctx, enum json_token_type tok,
+                          int report) {
+  const char *start = ctx->cur, *end = json_scan_skip(ctx->cur, ctx->end);
+  EXPECT(end != NULL, JSON_STRING_INCOMPLETE);
+  ctx->cur = end;
+  if (report) {
+    CALL_BACK(ctx,
+              tok == JSON_TYPE_OBJECT_START ? JSON_TYPE_OBJECT_END
+                                            : JSON_TYPE_ARRAY_END,
+              start, end - start);
+  }
+  return 0;
+}
+
+/*
+ * Make room for one more open container: move the stack to the heap once
+ * it outgrows the one in the context, doubling it each time.
+ */
+static int grow_frames(struct walk_ctx *ctx) {
+  int n = ctx->num_frames > ctx->max_depth / 2 ? ctx->max_depth
+                                               : ctx->num_frames * 2;
+  struct walk_frame *frames;
+  if (ctx->frames == ctx->stack) {
+    frames = (struct walk_frame *) malloc(n * sizeof(*frames));
+    if (frames != NULL) memcpy(frames, ctx->stack, sizeof(ctx->stack));
+  } else {
+    frames = (struct walk_frame *) realloc(ctx->frames, n * sizeof(*frames));
+  }
+  EXPECT(frames != NULL, JSON_STRING_NO_MEMORY);
+  ctx->frames = frames;
+  ctx->num_frames = n;
+  return 0;
+}
+
+/*
+ * Report the start of an object or array and push it to the stack. Its
+ * members are then parsed by walk_step(), so nesting costs no recursion.
+ * The stack may move: frame pointers taken before the call are stale.
+ */
+static int open_container(struct walk_ctx *ctx, enum json_token_type tok) {
+  struct walk_frame *f;
+  int res;
+  if (filter_path(ctx) == FILTER_OUT) return skip_container(ctx, tok, 0);
+  EXPECT(ctx->depth < ctx->max_depth, JSON_STRING_TOO_DEEP);
+  if (ctx->depth == ctx->num_frames) TRY(grow_frames(ctx));
+  if ((res = call_back(ctx, tok, NULL, 0)) < 0) return res;
+  if (res == JSON_WALK_SKIP) return skip_container(ctx, tok, 1);
+  f = &ctx->frames[ctx->depth++];
+  f->ptr = ctx->cur++;
+  f->path_len = ctx->path_len;
+  f->member_path_len = ctx->path_len;
+  f->index = 0;
+  f->type = *f->ptr;
+  f->state = WALK_MEMBER;
+  if (f->type == '{') append_to_path(ctx, ".", 1);
+  return 0;
+}
+
 /* value = 'null' | 'true' | 'false' | number | string | array | object */
 static int parse_value(struct walk_ctx *ctx) {
   int ch = cur(ctx);
@@ -233,10 +408,10 @@ static int parse_value(struct walk_ctx *ctx) {
       TRY(parse_string(ctx));
       break;
     case '{':
-      TRY(parse_object(ctx));
+      TRY(open_container(ctx, JSON_TYPE_OBJECT_START));
       break;
     case '[':
-      TRY(parse_array(ctx));
+      TRY(open_container(ctx, JSON_TYPE_ARRAY_START));
       break;
     case 'n':
       TRY(expect(ctx, "null", 4, JSON_TYPE_NULL));
@@ -280,58 +455,334 @@ static int parse_key(struct walk_ctx *ctx) {
   return 0;
 }
 
-/* pair = key ':' value */
-static int parse_pair(struct walk_ctx *ctx) {
-  int current_path_len;
-  const char *tok;
+/* pair = key ':' value, this parses the key */
+static int parse_pair(struct walk_ctx *ctx, struct walk_frame *f) {
+  const char *tok, *name;
+  size_t name_len;
+  int res;
   skip_whitespaces(ctx);
   tok = ctx->cur;
-  TRY(parse_key(ctx));
-  {
-    ctx->cur_name = *tok == '"' ? tok + 1 : tok;
-    ctx->cur_name_len = *tok == '"' ? ctx->cur - tok - 2 : ctx->cur - tok;
-    current_path_len = append_to_path(ctx, ctx->cur_name, ctx->cur_name_len);
-  }
-  TRY(test_and_skip(ctx, ':'));
-  TRY(parse_value(ctx));
-  truncate_path(ctx, current_path_len);
+  ctx->in_key = 1;
+  res = parse_key(ctx);
+  ctx->in_key = 0;
+  TRY(res);
+  name = *tok == '"' ? tok + 1 : tok;
+  name_len = *tok == '"' ? ctx->cur - tok - 2 : ctx->cur - tok;
+  ctx->cur_name = name;
+  ctx->cur_name_len = name_len;
+  ctx->cur_index = -1;
+  f->member_path_len = append_to_path(ctx, name, name_len);
+  f->state = WALK_COLON;
   return 0;
 }
 
-/* object = '{' pair { ',' pair } '}' */
-static int parse_object(struct walk_ctx *ctx) {
-  CALL_BACK(ctx, JSON_TYPE_OBJECT_START, NULL, 0);
-  TRY(test_and_skip(ctx, '{'));
-  {
-    SET_STATE(ctx, ctx->cur - 1, ".", 1);
-    while (cur(ctx) != '}') {
-      TRY(parse_pair(ctx));
-      if (cur(ctx) == ',') ctx->cur++;
+/* Array element is a value, named by its index */
+static int parse_element(struct walk_ctx *ctx, struct walk_frame *f) {
+  int member_path_len = ctx->path_len, top = ctx->depth - 1, res;
+  if (!(ctx->flags & JSON_WALK_NO_PATH)) {
+    char buf[20];
+    int n = snprintf(buf, sizeof(buf), "[%d]", f->index);
+    member_path_len = append_to_path(ctx, buf, n);
+    if (ctx->ex_callback == NULL && ctx->ex_callback64 == NULL) {
+      /* json_walk() gives the index as a name */
+      ctx->cur_name = ctx->path + ctx->path_len - n + 1 /*opening brace*/;
+      ctx->cur_name_len = n - 2 /*braces*/;
     }
-    TRY(test_and_skip(ctx, '}'));
-    truncate_path(ctx, fstate.path_len);
-    CALL_BACK(ctx, JSON_TYPE_OBJECT_END, fstate.ptr, ctx->cur - fstate.ptr);
   }
+  ctx->cur_index = f->index;
+  if ((res = parse_value(ctx)) < 0) {
+    truncate_path(ctx, member_path_len);
+    ctx->cur_name = NULL;
+    ctx->cur_name_len = 0;
+    ctx->cur_index = -1;
+    return res;
+  }
+  f = &ctx->frames[top];
+  f->member_path_len = member_path_len;
+  f->index++;
+  f->state = WALK_NEXT;
+  return 0;
+}
+
+/*
+ * object = '{' pair { ',' pair } '}'
+ * array = '[' [ value { ',' value } ] ']'
+ *
+ * Make one step inside the innermost open container, or parse the
+ * top-level value if there's none. A step either succeeds as a whole, or
+ * fails leaving the state as it was, except for `cur` and `resume`.
+ */
+static int walk_step(struct walk_ctx *ctx) {
+  struct walk_frame *f;
+  int ch, top = ctx->depth - 1;
+
+  if (ctx->depth == 0) {
+    TRY(parse_value(ctx));
+    ctx->done = ctx->depth == 0;
+    return 0;
+  }
+
+  f = &ctx->frames[top];
+  ch = cur(ctx);
+  switch (f->state) {
+    case WALK_NEXT:
+      /* Comma between the members is optional */
+      EXPECT(ch != END_OF_STRING, JSON_STRING_INCOMPLETE);
+      truncate_path(ctx, f->member_path_len);
+      if (ch == ',') ctx->cur++;
+      f->state = WALK_MEMBER;
+      break;
+    case WALK_COLON:
+      TRY(test_and_skip(ctx, ':'));
+      f->state = WALK_VALUE;
+      break;
+    case WALK_VALUE:
+      TRY(parse_value(ctx));
+      ctx->frames[top].state = WALK_NEXT;
+      break;
+    default:
+      if (ch == (f->type == '{' ? '}' : ']')) {
+        /* The streaming parser may no longer have the opening brace */
+        const char *start = ctx->streaming ? ctx->cur : f->ptr;
+        ctx->cur++;
+        ctx->depth--;
+        ctx->done = ctx->depth == 0;
+        truncate_path(ctx, f->path_len);
+        CALL_BACK(ctx,
+                  f->type == '{' ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END,
+                  start, ctx->cur - start);
+      } else if (f->type == '{') {
+        TRY(parse_pair(ctx, f));
+      } else {
+        TRY(parse_element(ctx, f));
+      }
+      break;
+  }
+
   return 0;
 }
 
 static int doit(struct walk_ctx *ctx) {
   if (ctx->cur == 0 || ctx->end < ctx->cur) return JSON_STRING_INVALID;
   if (ctx->end == ctx->cur) return JSON_STRING_INCOMPLETE;
-  return parse_value(ctx);
+  while (!ctx->done) TRY(walk_step(ctx));
+  return 0;
+}
+
+static void walk_init(struct walk_ctx *ctx, const char *json_string,
+                      size_t json_string_length, void *callback_data) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->end = json_string + json_string_length;
+  ctx->cur = json_string;
+  ctx->callback_data = callback_data;
+  ctx->cur_index = -1;
+  ctx->frames = ctx->stack;
+  ctx->num_frames = ctx->max_depth = JSON_MAX_DEPTH;
+}
+
+static ptrdiff_t walk(struct walk_ctx *ctx, const char *json_string) {
+  int res = doit(ctx);
+  if (ctx->frames != ctx->stack) free(ctx->frames);
+  return res < 0 ? res : ctx->cur - json_string;
+}
+
+/* Apply the options of json_walk_ex() */
+static void walk_set_opts(struct walk_ctx *ctx,
+                          const struct json_walk_ex_opts *opts) {
+  if (opts == NULL) return;
+  ctx->flags = opts->flags;
+  if (opts->max_depth > 0) ctx->max_depth = opts->max_depth;
 }
 
 int json_walk(const char *json_string, int json_string_length,
               json_walk_callback_t callback, void *callback_data) {
   struct walk_ctx ctx;
+  if (json_string_length < 0) return JSON_STRING_INVALID;
+  walk_init(&ctx, json_string, json_string_length, callback_data);
+  ctx.callback = callback;
+  return (int) walk(&ctx, json_string);
+}
+
+ptrdiff_t json_walk64(const char *json_string, size_t json_string_length,
+                      json_walk64_callback_t callback, void *callback_data) {
+  struct walk_ctx ctx;
+  walk_init(&ctx, json_string, json_string_length, callback_data);
+  ctx.callback64 = callback;
+  return walk(&ctx, json_string);
+}
 
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.end = json_string + json_string_length;
-  ctx.cur = json_string;
-  ctx.callback_data = callback_data;
+int json_walk_filtered(const char *json_string, int json_string_length,
+                       const char *path_prefix, json_walk_callback_t callback,
+                       void *callback_data) {
+  struct walk_ctx ctx;
+  if (json_string_length < 0) return JSON_STRING_INVALID;
+  walk_init(&ctx, json_string, json_string_length, callback_data);
   ctx.callback = callback;
+  ctx.filter = path_prefix;
+  ctx.filter_len = strlen(path_prefix);
+  return (int) walk(&ctx, json_string);
+}
+
+int json_walk_ex(const char *json_string, int json_string_length,
+                 const struct json_walk_ex_opts *opts,
+                 json_walk_ex_callback_t callback, void *callback_data) {
+  struct walk_ctx ctx;
+  if (json_string_length < 0) return JSON_STRING_INVALID;
+  walk_init(&ctx, json_string, json_string_length, callback_data);
+  walk_set_opts(&ctx, opts);
+  ctx.ex_callback = callback;
+  return (int) walk(&ctx, json_string);
+}
 
-  TRY(doit(&ctx));
+ptrdiff_t json_walk_ex64(const char *json_string, size_t json_string_length,
+                         const struct json_walk_ex_opts *opts,
+                         json_walk_ex64_callback_t callback,
+                         void *callback_data) {
+  struct walk_ctx ctx;
+  walk_init(&ctx, json_string, json_string_length, callback_data);
+  walk_set_opts(&ctx, opts);
+  ctx.ex_callback64 = callback;
+  return walk(&ctx, json_string);
+}
 
-  return ctx.cur - json_string;
+struct json_parser {
+  struct walk_ctx ctx;
+  char *buf;     /* Input from the step in progress on */
+  size_t len;    /* Number of bytes in `buf` */
+  size_t size;   /* Allocated size of `buf` */
+  size_t offset; /* Offset of `buf` in the input */
+  int error;     /* Sticky error code */
+};
+
+struct json_parser *json_parser_create(json_walk_callback_t callback,
+                                       void *callback_data) {
+  struct json_parser *p = (struct json_parser *) calloc(1, sizeof(*p));
+  if (p == NULL) return NULL;
+  p->ctx.callback_data = callback_data;
+  p->ctx.callback = callback;
+  p->ctx.cur_index = -1;
+  p->ctx.frames = p->ctx.stack;
+  p->ctx.num_frames = p->ctx.max_depth = JSON_MAX_DEPTH;
+  p->ctx.partial = 1;
+  p->ctx.streaming = 1;
+  return p;
+}
+
+/* Point what points into the kept part of the old buffer into the new one */
+static const char *parser_rebase(const struct json_parser *p,
+                                 const char *ptr, size_t drop, char *buf) {
+  if (ptr == NULL || ptr < p->buf + drop || ptr > p->buf + p->len) return ptr;
+  return buf + (ptr - p->buf - drop);
+}
+
+/*
+ * Add a chunk of input. When it doesn't fit, drop the input that's parsed,
+ * keeping the step in progress and the name of the value it belongs to.
+ * The buffer is grown so that what's kept takes at most half of it, so each
+ * byte is moved a constant number of times on average.
+ */
+static int parser_append(struct json_parser *p, const char *data,
+                         size_t len) {
+  struct walk_ctx *ctx = &p->ctx;
+  if (p->len + len > p->size) {
+    size_t drop = ctx->cur == NULL ? 0 : ctx->cur - p->buf, kept;
+    char *buf = p->buf;
+    if (ctx->cur_name != NULL && ctx->cur_name >= p->buf &&
+        ctx->cur_name < p->buf + drop) {
+      drop = ctx->cur_name - p->buf;
+    }
+    kept = p->len - drop;
+    if (kept + len > p->size / 2) {
+      size_t size = p->size == 0 ? 1024 : p->size;
+      while (size < 2 * (kept + len)) size *= 2;
+      if ((buf = (char *) malloc(size)) == NULL) return -1;
+      p->size = size;
+    }
+    if (kept > 0) memmove(buf, p->buf + drop, kept);
+    ctx->cur = parser_rebase(p, ctx->cur, drop, buf);
+    ctx->cur_name = parser_rebase(p, ctx->cur_name, drop, buf);
+    ctx->resume = parser_rebase(p, ctx->resume, drop, buf);
+    if (buf != p->buf) free(p->buf);
+    p->buf = buf;
+    p->len = kept;
+    p->offset += drop;
+  }
+  memcpy(p->buf + p->len, data, len);
+  p->len += len;
+  if (ctx->cur == NULL) ctx->cur = p->buf;
+  ctx->end = p->buf + p->len;
+  return 0;
+}
+
+/* Parse as far as the received input allows */
+static ptrdiff_t parser_run(struct json_parser *p) {
+  struct walk_ctx *ctx = &p->ctx;
+  while (!ctx->done && p->error == 0) {
+    const char *step;
+    int res;
+    /* Whitespace between the tokens is never looked at again */
+    skip_whitespaces(ctx);
+    step = ctx->cur;
+    res = walk_step(ctx);
+    if (res == JSON_STRING_INCOMPLETE) {
+      /* Retry the step when more input comes, strings go on from `resume` */
+      ctx->cur = step;
+      return ctx->partial ? 0 : res;
+    } else if (res < 0) {
+      p->error = res;
+    }
+  }
+  return p->error != 0 ? p->error
+                       : (ptrdiff_t) (p->offset + (ctx->cur - p->buf));
+}
+
+/* A value that ends past 2 GiB of the stream is reported as INT_MAX long */
+static int parser_int_result(ptrdiff_t res) {
+  return res > INT_MAX ? INT_MAX : (int) res;
+}
+
+ptrdiff_t json_parser_feed64(struct json_parser *p, const char *data,
+                             size_t len) {
+  if (p->error != 0 || p->ctx.done) return parser_run(p);
+  if (len > 0 && data == NULL) return JSON_STRING_INVALID;
+  if (len > 0 && parser_append(p, data, len) < 0) return JSON_STRING_INVALID;
+  return parser_run(p);
+}
+
+int json_parser_feed(struct json_parser *p, const char *data, int len) {
+  if (len < 0 && p->error == 0 && !p->ctx.done) return JSON_STRING_INVALID;
+  return parser_int_result(
+      json_parser_feed64(p, data, len < 0 ? 0 : (size_t) len));
+}
+
+ptrdiff_t json_parser_finish64(struct json_parser *p) {
+  if (p->ctx.cur == NULL) return JSON_STRING_INCOMPLETE;
+  p->ctx.partial = 0;
+  return parser_run(p);
+}
+
+int json_parser_finish(struct json_parser *p) {
+  return parser_int_result(json_parser_finish64(p));
+}
+
+void json_parser_free(struct json_parser *p) {
+  if (p == NULL) return;
+  free(p->buf);
+  free(p);
+}
+
+ptrdiff_t json_walk_element(const char *json_string, size_t json_string_length,
+                            int index, json_walk_callback_t callback,
+                            void *callback_data) {
+  struct walk_ctx ctx;
+  char buf[20];
+  int n = snprintf(buf, sizeof(buf), "[%d]", index);
+  walk_init(&ctx, json_string, json_string_length, callback_data);
+  ctx.callback = callback;
+  ctx.max_depth--; /* The array counts towards the limit too */
+  append_to_path(&ctx, buf, n);
+  ctx.cur_name = ctx.path + 1 /*opening brace*/;
+  ctx.cur_name_len = n - 2 /*braces*/;
+  ctx.cur_index = index;
+  return walk(&ctx, json_string);
 }
@@ -26,13 +26,29 @@ extern "C" {
 #include <stddef.h>
 #include <stdio.h>
 
+/* From <sys/uio.h>, for JSON_OUT_IOV() */
+struct iovec;
+
 #ifndef JSON_MAX_PATH_LEN
 #define JSON_MAX_PATH_LEN 256
 #endif
 
+/*
+ * Default maximum nesting depth of objects and arrays, and the number of
+ * open containers the parser keeps inside its context rather than
+ * recursing, so its stack usage doesn't depend on the input.
+ * `json_walk_ex()` takes a different limit at run time, and keeps the
+ * containers over this number on the heap.
+ */
+#ifndef JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH 128
+#endif
+
 /* Error codes */
 #define JSON_STRING_INVALID -1
 #define JSON_STRING_INCOMPLETE -2
+#define JSON_STRING_TOO_DEEP -3 /* Nesting is deeper than the limit */
+#define JSON_STRING_NO_MEMORY -4 /* Out of memory for the nesting stack */
 
 /* JSON token type */
 enum json_token_type {
@@ -63,6 +79,13 @@ struct json_token {
 #define JSON_INVALID_TOKEN \
   { 0, 0, JSON_TYPE_INVALID }
 
+/* Same as `struct json_token`, for the input larger than 2 GiB */
+struct json_token64 {
+  const char *ptr;           /* Points to the beginning of the value */
+  size_t len;                /* Value length */
+  enum json_token_type type; /* Type of the token, possible values are above */
+};
+
 /*
  * Callback-based SAX-like API.
  *
@@ -101,6 +124,195 @@ typedef void (*json_walk_callback_t)(void *callback_data, const char *name,
 int json_walk(const char *json_string, int json_string_length,
               json_walk_callback_t callback, void *callback_data);
 
+typedef void (*json_walk64_callback_t)(void *callback_data, const char *name,
+                                       size_t name_len, const char *path,
+                                       const struct json_token64 *token);
+
+/*
+ * Same as `json_walk()`, but for the input of any size, e.g. a large mmap-ed
+ * file. json_walk() is a wrapper around the same parser.
+ * Return number of processed bytes, or a negative error code.
+ */
+ptrdiff_t json_walk64(const char *json_string, size_t json_string_length,
+                      json_walk64_callback_t callback, void *callback_data);
+
+/*
+ * Same as `json_walk()`, but report only the values at `path_prefix` and
+ * under it, e.g. ".meta" gives ".meta", ".meta.id", ".meta.tags[0]", but not
+ * ".metadata". Containers that can't have such values inside are jumped over
+ * by counting brackets and quotes, without parsing or validating them.
+ */
+int json_walk_filtered(const char *json_string, int json_string_length,
+                       const char *path_prefix, json_walk_callback_t callback,
+                       void *callback_data);
+
+/*
+ * Describes where a token reported by `json_walk_ex()` is, without the need
+ * to parse the path string.
+ */
+struct json_walk_event {
+  const char *name; /* Object key (as is, not unescaped), NULL otherwise */
+  size_t name_len;  /* Length of the key */
+  int index;        /* Index of an array element, -1 otherwise */
+  int depth;        /* Number of containers the token is nested in */
+  const char *path; /* Same as in json_walk(), NULL with JSON_WALK_NO_PATH */
+  int escaped;      /* Non-0 if a JSON_TYPE_STRING has escapes to decode */
+};
+
+/*
+ * Callback for `json_walk_ex()`, receives the same tokens in the same order
+ * as `json_walk_callback_t`. Return 0 to continue; a negative value stops
+ * the walk, and json_walk_ex() returns it. Returning JSON_WALK_SKIP for
+ * JSON_TYPE_OBJECT_START or JSON_TYPE_ARRAY_START jumps over the contents
+ * of the container, without parsing or validating them: the next token is
+ * its JSON_TYPE_OBJECT_END or JSON_TYPE_ARRAY_END.
+ */
+typedef int (*json_walk_ex_callback_t)(void *callback_data,
+                                       const struct json_walk_event *event,
+                                       const struct json_token *token);
+
+/* Return value of json_walk_ex_callback_t: skip the container */
+#define JSON_WALK_SKIP 1
+
+/* Flags for json_walk_ex() */
+#define JSON_WALK_NO_PATH 1 /* Don't build path strings, event->path is NULL */
+
+struct json_walk_ex_opts {
+  int flags;     /* JSON_WALK_* */
+  int max_depth; /* Maximum nesting depth, 0 for JSON_MAX_DEPTH */
+};
+
+/*
+ * Same as `json_walk()`, but with options, and the extended callback, which
+ * gets the key, array index and depth as separate fields. With
+ * JSON_WALK_NO_PATH, the parser doesn't spend any time building paths.
+ * `opts` may be NULL for the defaults.
+ */
+int json_walk_ex(const char *json_string, int json_string_length,
+                 const struct json_walk_ex_opts *opts,
+                 json_walk_ex_callback_t callback, void *callback_data);
+
+typedef int (*json_walk_ex64_callback_t)(void *callback_data,
+                                         const struct json_walk_event *event,
+                                         const struct json_token64 *token);
+
+/* Same as `json_walk_ex()`, for the input of any size. */
+ptrdiff_t json_walk_ex64(const char *json_string, size_t json_string_length,
+                         const struct json_walk_ex_opts *opts,
+                         json_walk_ex64_callback_t callback,
+                         void *callback_data);
+
+/* Called by `json_walk_lines()` for each record, after its tokens */
+typedef void (*json_walk_lines_result_t)(void *callback_data,
+                                         const char *record, int record_len,
+                                         int result);
+
+/* Flags for json_walk_lines() */
+#define JSON_WALK_LINES_ORDERED 1 /* Report the records in input order */
+
+struct json_walk_lines_opts {
+  int num_threads; /* Number of threads to use, including the calling one */
+  int flags;       /* JSON_WALK_LINES_* */
+  json_walk_callback_t callback;   /* Same as in json_walk(), may be NULL */
+  json_walk_lines_result_t result; /* json_walk() return value, may be NULL */
+  void **callback_data; /* Per-thread callback data, `num_threads` entries */
+};
+
+/*
+ * Walk newline-delimited JSON (NDJSON, JSON Lines): call `json_walk()` for
+ * each non-blank line of `s`, in `opts->num_threads` threads at once.
+ *
+ * Each thread passes its own entry of `opts->callback_data` to the
+ * callbacks. Without JSON_WALK_LINES_ORDERED, records are reported as soon
+ * as they are parsed, by several threads at a time. With it, the callbacks
+ * are never called concurrently, and the records are reported in the same
+ * order as in `s`; the parsing is still done in parallel.
+ *
+ * Return the number of records, or a negative error code if out of memory.
+ */
+ptrdiff_t json_walk_lines(const char *s, size_t len,
+                          const struct json_walk_lines_opts *opts);
+
+/*
+ * Same as `json_walk()`, but if `s` is an array, parse its elements in
+ * `opts->num_threads` threads at once. The elements are found by counting
+ * quotes and brackets, many bytes at a time, and each one is then parsed
+ * with the same names and paths ("[0].id", ...) as json_walk() gives.
+ *
+ * Threads use the options the same way as in `json_walk_lines()`:
+ * `opts->result` is called for each element, and only with
+ * JSON_WALK_LINES_ORDERED the callbacks are called in the same order as
+ * by json_walk(). The array's JSON_TYPE_ARRAY_START and JSON_TYPE_ARRAY_END
+ * are reported by the calling thread, with the first entry of
+ * `opts->callback_data`, before and after all the elements.
+ *
+ * Return the same as json_walk64().
+ */
+ptrdiff_t json_walk_array(const char *s, size_t len,
+                          const struct json_walk_lines_opts *opts);
+
+/*
+ * Find the end of the JSON value at the beginning of `s`, after optional
+ * whitespace, without parsing it: strings are jumped over by looking for
+ * the closing quote, and containers by counting brackets outside strings,
+ * many bytes at a time. Nothing is validated, so use it on the input that
+ * is known to be correct, e.g. already parsed once.
+ * Return the offset just past the value, JSON_STRING_INCOMPLETE if the
+ * value doesn't end within `len` bytes, or JSON_STRING_INVALID if `s` does
+ * not start with a value.
+ */
+int json_skip_value(const char *s, int len);
+
+/*
+ * Incremental parser, for the input that arrives in chunks, e.g. from the
+ * network. It reports the same events as `json_walk()` as soon as the
+ * tokens are complete, and never re-parses the input it has already seen.
+ *
+ * The parser only keeps a copy of the token in progress, so
+ * JSON_TYPE_OBJECT_END and JSON_TYPE_ARRAY_END tokens are just the closing
+ * brace or bracket, not the whole container. The pointers given to the
+ * callback are valid only during the call.
+ *
+ * Usage:
+ *   struct json_parser *p = json_parser_create(callback, callback_data);
+ *   while (json_parser_feed(p, chunk, chunk_len) == 0) { ... next chunk ... }
+ *   json_parser_finish(p); // When there's no more input
+ *   json_parser_free(p);
+ */
+struct json_parser;
+
+/* Create a parser. Return NULL if out of memory. */
+struct json_parser *json_parser_create(json_walk_callback_t callback,
+                                       void *callback_data);
+
+/*
+ * Parse the next chunk of input.
+ * Return 0 if more input is needed, a negative error code, or the number of
+ * bytes taken by the complete JSON value, like json_walk() does. After that,
+ * further input is ignored. A value of 2 GiB or more gives INT_MAX, see
+ * json_parser_feed64().
+ */
+int json_parser_feed(struct json_parser *p, const char *data, int len);
+
+/*
+ * Tell the parser there's no more input: required to complete a top-level
+ * number, which may otherwise go on in the next chunk.
+ * Return the same as json_parser_feed(), except that incomplete input gives
+ * JSON_STRING_INCOMPLETE.
+ */
+int json_parser_finish(struct json_parser *p);
+
+/*
+ * Same as `json_parser_feed()`, `json_parser_finish()`, for a stream of any
+ * size: the length of the value is not capped.
+ */
+ptrdiff_t json_parser_feed64(struct json_parser *p, const char *data,
+                             size_t len);
+ptrdiff_t json_parser_finish64(struct json_parser *p);
+
+/* Free the parser. */
+void json_parser_free(struct json_parser *p);
+
 /*
  * JSON generation API.
  * struct json_out abstracts output, allowing alternative printing plugins.
@@ -112,6 +324,8 @@ struct json_out {
       char *buf;
       size_t size;
       size_t len;
+      int fd;   /* JSON_OUT_FD(), -1 after a write error */
+      FILE *fp; /* JSON_OUT_FILE_BUF() */
     } buf;
     void *data;
     FILE *fp;
@@ -120,20 +334,69 @@ struct json_out {
 
 extern int json_printer_buf(struct json_out *, const char *, size_t);
 extern int json_printer_file(struct json_out *, const char *, size_t);
+extern int json_printer_dynbuf(struct json_out *, const char *, size_t);
+extern int json_printer_fd(struct json_out *, const char *, size_t);
+extern int json_printer_file_buf(struct json_out *, const char *, size_t);
+
+#define JSON_OUT_BUF(buf, len)  \
+  {                             \
+    json_printer_buf, {         \
+      { buf, len, 0, -1, NULL } \
+    }                           \
+  }
+#define JSON_OUT_FILE(fp)             \
+  {                                   \
+    json_printer_file, {              \
+      { (char *) fp, 0, 0, -1, NULL } \
+    }                                 \
+  }
 
-#define JSON_OUT_BUF(buf, len) \
+/*
+ * Output into a malloc-ed buffer that grows as needed, doubling its size:
+ * `u.buf.buf` is the NUL-terminated output, `u.buf.len` its length. If
+ * out of memory, the output is cut short, as with JSON_OUT_BUF().
+ * json_out_dynbuf_reset() empties it, keeping the buffer for the next
+ * output, and json_out_dynbuf_free() frees the buffer.
+ */
+#define JSON_OUT_DYNBUF()      \
   {                            \
-    json_printer_buf, {        \
-      { buf, len, 0 }          \
+    json_printer_dynbuf, {     \
+      { NULL, 0, 0, -1, NULL } \
     }                          \
   }
-#define JSON_OUT_FILE(fp)   \
-  {                         \
-    json_printer_file, {    \
-      { (char *) fp, 0, 0 } \
-    }                       \
+void json_out_dynbuf_reset(struct json_out *out);
+void json_out_dynbuf_free(struct json_out *out);
+
+/*
+ * Output to the file descriptor `fd`, or to the stream `fp`, through the
+ * caller's buffer `buf` of `size` bytes: the output is written with a
+ * single write(), or fwrite(), each time the buffer is full, and output
+ * at least as large as the buffer is written along with it, with a single
+ * writev(), without being copied. The rest stays in the buffer until
+ * json_out_flush(), which must be called at the end of the output.
+ * After a write error, `u.buf.fd` is -1 and the rest of the output of
+ * JSON_OUT_FD() is dropped.
+ */
+#define JSON_OUT_FD(fd, buf, size) \
+  {                                \
+    json_printer_fd, {             \
+      { buf, size, 0, fd, NULL }   \
+    }                              \
+  }
+#define JSON_OUT_FILE_BUF(fp, buf, size) \
+  {                                      \
+    json_printer_file_buf, {             \
+      { buf, size, 0, -1, fp }           \
+    }                                    \
   }
 
+/*
+ * Write out what JSON_OUT_FD() or JSON_OUT_FILE_BUF() has buffered, and
+ * fflush() the stream of the latter. Return 0, or -1 if any write of the
+ * output failed.
+ */
+int json_out_flush(struct json_out *out);
+
 typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
 
 /*
@@ -147,6 +410,10 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
  *  - `%M` invokes a json_printf_callback_t function. That callback function
  *  can consume more parameters.
  *
+ * `%d`, `%i`, `%u`, `%e`, `%f` and `%g` without flags or width are printed
+ * by elsa itself, the same as printf() would. Floating point numbers always
+ * have a `.` as the decimal point, whatever the C locale.
+ *
  * Return number of bytes printed. If the return value is bigger then the
  * supplied buffer, that is an indicator of overflow. In the overflow case,
  * overflown bytes are not printed.
@@ -154,6 +421,30 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
 int json_printf(struct json_out *, const char *fmt, ...);
 int json_vprintf(struct json_out *, const char *fmt, va_list ap);
 
+/* A json_printf() format parsed once, see json_printf_compile() */
+struct json_printf_template;
+
+/*
+ * Parse the `json_printf()` format `fmt` once, to be printed many times with
+ * json_printf_exec(): the keys are quoted and the literal text between the
+ * conversions is merged, to be printed with a single printer call.
+ * Return NULL if out of memory. Free the template with
+ * json_printf_template_free().
+ */
+struct json_printf_template *json_printf_compile(const char *fmt);
+
+/*
+ * Same as `json_printf()`, `json_vprintf()` with the format the template was
+ * compiled from, taking the same arguments.
+ */
+int json_printf_exec(struct json_out *out,
+                     const struct json_printf_template *tpl, ...);
+int json_vprintf_exec(struct json_out *out,
+                      const struct json_printf_template *tpl, va_list ap);
+
+/* Free the template returned by json_printf_compile(). */
+void json_printf_template_free(struct json_printf_template *tpl);
+
 /*
  * Same as json_printf, but prints to a file.
  * File is created if does not exist. File is truncated if already exists.
@@ -190,6 +481,22 @@ int json_printf_array(struct json_out *, va_list *ap);
  *    - %M: consumes custom scanning function pointer and
  *       `void *user_data` parameter - see json_scanner_t definition.
  *    - %T: consumes `struct json_token *`, fills it out with matched token.
+ *    - %S: consumes `const char **`, `int *`. Same as %Q, but a string with
+ *       no escapes is not copied: the result points into `str`, and is not
+ *       NUL-terminated. Otherwise, it is decoded and malloced, and the
+ *       caller must free() it (it doesn't point into `str` then).
+ *    - %.*Q: consumes `int`, `char *`: the size of a buffer, then the
+ *       buffer. Same as %Q, but the string is decoded into the buffer and
+ *       NUL-terminated, without malloc. A string that doesn't fit is cut
+ *       to the size - 1 bytes and is not counted as converted.
+ *
+ * Number conversions %d, %i, %u (with hh, h, l, ll) and %f, %e, %g (with
+ * l) don't use sscanf() and don't depend on the locale. Numbers that don't
+ * fit into the target are not converted.
+ *
+ * The string is walked once for all the conversions, and only until none of
+ * them can match anymore. Containers that no conversion looks into are
+ * skipped without being validated.
  *
  * Return number of elements successfully scanned & converted.
  * Negative number means scan error.
@@ -197,6 +504,127 @@ int json_printf_array(struct json_out *, va_list *ap);
 int json_scanf(const char *str, int str_len, const char *fmt, ...);
 int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap);
 
+/*
+ * Same as `json_scanf()`, `json_vscanf()`, for the input of any size. The
+ * values converted must still be smaller than 2 GiB each, larger ones are
+ * not converted.
+ */
+int json_scanf64(const char *str, size_t str_len, const char *fmt, ...);
+int json_vscanf64(const char *str, size_t str_len, const char *fmt,
+                  va_list ap);
+
+/*
+ * Compiled `json_scanf()` format. It is read-only once compiled, so it can
+ * be used by several threads at once.
+ */
+struct json_scanf_plan;
+
+/*
+ * Parse the `json_scanf()` format `fmt` once, to be executed many times with
+ * json_scanf_exec(): paths and conversions are resolved in advance.
+ * Return NULL if out of memory. Free the plan with json_scanf_plan_free().
+ */
+struct json_scanf_plan *json_scanf_compile(const char *fmt);
+
+/*
+ * Same as `json_scanf()`, `json_vscanf()` with the format the plan was
+ * compiled from, taking the same arguments.
+ */
+int json_scanf_exec(const struct json_scanf_plan *plan, const char *str,
+                    int str_len, ...);
+int json_vscanf_exec(const struct json_scanf_plan *plan, const char *str,
+                     int str_len, va_list ap);
+
+/* Free the plan returned by json_scanf_compile(). */
+void json_scanf_plan_free(struct json_scanf_plan *plan);
+
+/*
+ * Bump allocator for the strings of json_scanf_arena(). Allocations are
+ * carved out of the caller's buffer, then out of malloc-ed blocks, chained
+ * as needed, each at least twice the size of the previous one. Nothing is
+ * freed individually. Treat the fields as private.
+ */
+struct json_arena {
+  char *buf;      /* Block being allocated from */
+  size_t size;    /* Its size */
+  size_t used;    /* Bytes allocated from it */
+  void *blocks;   /* Malloc-ed blocks, the newest first */
+  char *init;     /* Caller's buffer, may be NULL */
+  size_t init_size;
+};
+
+/* Initialise the arena to allocate from `buf,size` first. */
+void json_arena_init(struct json_arena *arena, void *buf, size_t size);
+
+/* Allocate `size` bytes, aligned for any scalar. NULL if out of memory. */
+void *json_arena_alloc(struct json_arena *arena, size_t size);
+
+/*
+ * Drop all the allocations. The newest block is kept, so an arena reset
+ * between messages of similar size stops calling malloc() after the first.
+ */
+void json_arena_reset(struct json_arena *arena);
+
+/* Drop all the allocations, and free all the blocks. */
+void json_arena_free(struct json_arena *arena);
+
+/*
+ * Same as `json_scanf()`, `json_vscanf()`, `json_scanf_exec()` and
+ * `json_vscanf_exec()`, but the strings of %Q, %S, %V and %H are allocated
+ * from `arena`, not malloc-ed: don't free() them, they are valid until the
+ * arena is reset or freed.
+ */
+int json_scanf_arena(const char *str, int str_len, struct json_arena *arena,
+                     const char *fmt, ...);
+int json_vscanf_arena(const char *str, int str_len, struct json_arena *arena,
+                      const char *fmt, va_list ap);
+int json_scanf_exec_arena(const struct json_scanf_plan *plan, const char *str,
+                          int str_len, struct json_arena *arena, ...);
+int json_vscanf_exec_arena(const struct json_scanf_plan *plan,
+                           const char *str, int str_len,
+                           struct json_arena *arena, va_list ap);
+
+/*
+ * Output of JSON_OUT_IOV(): a list of pieces, to be sent as it is with
+ * writev() or sendmsg(), in batches of at most IOV_MAX entries. Strings
+ * printed with %s, %.*s, %Q or %.*Q, or json_escape(), are referenced
+ * rather than copied where they need no escaping for at least
+ * JSON_IOV_MIN_REF bytes: they must stay valid until the list is sent. The
+ * rest is copied into the caller's buffer, then into malloc-ed blocks.
+ * Pieces adjacent in memory are merged, so consecutive copies make a single
+ * piece. If out of memory, the output is cut short. Treat the fields but
+ * `iov` and `num_iov` as private. Include <sys/uio.h> to read them; where
+ * there's none, `struct iovec` is `{void *iov_base; size_t iov_len;}`.
+ */
+struct json_iov {
+  struct iovec *iov; /* The output, malloc-ed */
+  int num_iov;       /* Number of pieces in `iov` */
+  int max_iov;       /* Number allocated */
+  char *copy;        /* Free space for the next copy */
+  size_t copy_avail; /* Its size */
+  char *init;        /* Caller's buffer, may be NULL */
+  size_t init_size;
+  struct json_arena arena; /* Blocks for the copies past the caller's */
+};
+
+extern int json_printer_iov(struct json_out *, const char *, size_t);
+
+#define JSON_OUT_IOV(iov)                \
+  {                                      \
+    json_printer_iov, {                  \
+      { (char *) (iov), 0, 0, -1, NULL } \
+    }                                    \
+  }
+
+/* Initialise the list to copy into `buf,size` first, which may be NULL. */
+void json_iov_init(struct json_iov *iov, void *buf, size_t size);
+
+/* Empty the list, keeping the memory for the next output. */
+void json_iov_reset(struct json_iov *iov);
+
+/* Free the memory of the list, and empty it. */
+void json_iov_free(struct json_iov *iov);
+
 /* json_scanf's %M handler  */
 typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
 
@@ -233,8 +661,14 @@ char *json_fread(const char *file_name);
  * Update given JSON string `s,len` by changing the value at given `json_path`.
  * The result is saved to `out`. If `json_fmt` == NULL, that deletes the key.
  * If path is not present, missing keys are added. Array path without an
- * index pushes a value to the end of an array.
+ * index pushes a value to the end of an array. A string value is replaced
+ * between its quotes, e.g. with "%s".
  * Return 1 if the string was changed, 0 otherwise.
+ * Changes that would not give valid JSON are not made: the string is copied
+ * as is, and JSON_STRING_INVALID is returned. These are any path through a
+ * scalar or a duplicate key, adding a path with an empty key, any path of
+ * JSON_MAX_PATH_LEN or longer, and deleting the whole string with the path
+ * "".
  *
  * Example:  s is a JSON string { "a": 1, "b": [ 2 ] }
  *   json_setf(s, len, out, ".a", "7");     // { "a": 7, "b": [ 2 ] }
@@ -248,12 +682,21 @@ int json_setf(const char *s, int len, struct json_out *out,
 int json_vsetf(const char *s, int len, struct json_out *out,
                const char *json_path, const char *json_fmt, va_list ap);
 
+/* Same as `json_setf()`, `json_vsetf()`, for the input of any size. */
+int json_setf64(const char *s, size_t len, struct json_out *out,
+                const char *json_path, const char *json_fmt, ...);
+int json_vsetf64(const char *s, size_t len, struct json_out *out,
+                 const char *json_path, const char *json_fmt, va_list ap);
+
 /*
  * Pretty-print JSON string `s,len` into `out`.
  * Return number of processed bytes in `s`.
  */
 int json_prettify(const char *s, int len, struct json_out *out);
 
+/* Same as `json_prettify()`, for the input of any size. */
+ptrdiff_t json_prettify64(const char *s, size_t len, struct json_out *out);
+
 /*
  * Prettify JSON file `file_name`.
  * Return number of processed bytes, or negative number of error.
@@ -288,6 +731,172 @@ void *json_next_key(const char *s, int len, void *handle, const char *path,
 void *json_next_elem(const char *s, int len, void *handle, const char *path,
                      int *idx, struct json_token *val);
 
+/* Same as `json_next_key()`, `json_next_elem()`, for the input of any size. */
+void *json_next_key64(const char *s, size_t len, void *handle,
+                      const char *path, struct json_token64 *key,
+                      struct json_token64 *val);
+void *json_next_elem64(const char *s, size_t len, void *handle,
+                       const char *path, ptrdiff_t *idx,
+                       struct json_token64 *val);
+
+/*
+ * Flat token index ("tape") of a JSON string, built by `json_index()`.
+ *
+ * Every value in the string is stored as one `struct json_index_token`, in
+ * document order: a container is immediately followed by its first child,
+ * and the rest of the children are linked through `next`. Paths are resolved
+ * by following these links, so the string is parsed only once no matter how
+ * many lookups are done afterwards.
+ */
+struct json_index_token {
+  int ofs;     /* Value offset in the indexed string */
+  int len;     /* Value length */
+  int key_ofs; /* Object member key offset, or -1 if not an object member */
+  int key_len; /* Object member key length */
+  int parent;  /* Enclosing container, or -1 for the root value */
+  int next;    /* Next sibling, or -1 for the last one */
+  /*
+   * Token type, as reported by `json_walk()` for the complete value:
+   * containers are JSON_TYPE_OBJECT_END or JSON_TYPE_ARRAY_END.
+   */
+  enum json_token_type type;
+};
+
+struct json_index {
+  const char *s;                   /* Indexed JSON string */
+  int len;                         /* Indexed JSON string length */
+  struct json_index_token *tokens; /* Caller-provided token array */
+  int num_tokens;                  /* Number of tokens in the index */
+};
+
+/*
+ * Index JSON string `s,len` into the caller-provided array `tokens` of
+ * `max_tokens` elements, and initialise `idx` to refer to it.
+ * Both `s` and `tokens` must outlive the index.
+ * Return the number of tokens the string needs, or a negative error code.
+ * If the returned number is greater than `max_tokens`, the index is empty,
+ * and the call should be repeated with a larger array.
+ */
+int json_index(const char *s, int len, struct json_index_token *tokens,
+               int max_tokens, struct json_index *idx);
+
+/*
+ * Find the token at `path`, relative to the token number `from` (0 for the
+ * root value). Path syntax is the same as in `json_walk()` callbacks,
+ * e.g. ".foo.bar[2]".
+ * Return the token number, or -1 if there is no such path.
+ */
+int json_index_find(const struct json_index *idx, int from, const char *path);
+
+/*
+ * Same as `json_scanf()`, `json_vscanf()`, but scan the indexed string.
+ */
+int json_index_scanf(const struct json_index *idx, const char *fmt, ...);
+int json_index_vscanf(const struct json_index *idx, const char *fmt,
+                      va_list ap);
+
+/*
+ * Same as `json_scanf_array_elem()`, but scan the indexed string.
+ */
+int json_index_scanf_array_elem(const struct json_index *idx,
+                                const char *path, int index,
+                                struct json_token *token);
+
+/*
+ * Same as `json_next_key()` and `json_next_elem()`, but iterate over the
+ * indexed string.
+ */
+void *json_index_next_key(const struct json_index *idx, void *handle,
+                          const char *path, struct json_token *key,
+                          struct json_token *val);
+void *json_index_next_elem(const struct json_index *idx, void *handle,
+                           const char *path, int *i, struct json_token *val);
+
+/*
+ * Same as `json_setf()`, `json_vsetf()`, but update the indexed string.
+ * The result is byte for byte what `json_setf()` gives for the string.
+ */
+int json_index_setf(const struct json_index *idx, struct json_out *out,
+                    const char *json_path, const char *json_fmt, ...);
+int json_index_vsetf(const struct json_index *idx, struct json_out *out,
+                     const char *json_path, const char *json_fmt,
+                     va_list ap);
+
+/* Type of a C struct member bound to a JSON value, see struct json_field */
+enum json_field_type {
+  JSON_FIELD_BOOL,   /* bool, from true or false */
+  JSON_FIELD_INT,    /* int */
+  JSON_FIELD_UINT,   /* unsigned int */
+  JSON_FIELD_LLONG,  /* long long */
+  JSON_FIELD_ULLONG, /* unsigned long long */
+  JSON_FIELD_DOUBLE, /* double */
+  JSON_FIELD_FLOAT,  /* float */
+  JSON_FIELD_STRING, /* char *, malloc-ed and NUL-terminated, or NULL */
+  JSON_FIELD_CHARS,  /* char[size], NUL-terminated, truncated to fit */
+  JSON_FIELD_TOKEN,  /* struct json_token, pointing into the JSON string */
+  JSON_FIELD_OBJECT  /* Nested struct of `size` bytes, described by `fields` */
+};
+
+/* Flags of struct json_field */
+#define JSON_FIELD_ARRAY 1 /* Array of at most `max` values, see below */
+#define JSON_FIELD_ALLOC 2 /* Malloc-ed array, of at most `max` if not 0 */
+
+/*
+ * Binding of an object key to a member of a C struct. An array of them, up
+ * to the one with `key` NULL, describes the whole struct.
+ *
+ * With JSON_FIELD_ARRAY, the member at `offset` is an array of `max` values
+ * of the type. With JSON_FIELD_ALLOC, it is a pointer to a malloc-ed array,
+ * as large as needed. The number of values is the `int` at `count_offset`.
+ */
+struct json_field {
+  const char *key;
+  size_t offset; /* offsetof() the member */
+  enum json_field_type type;
+  int flags;
+  size_t size; /* For JSON_FIELD_CHARS and JSON_FIELD_OBJECT */
+  const struct json_field *fields; /* For JSON_FIELD_OBJECT */
+  int max;                         /* For arrays */
+  size_t count_offset;             /* For arrays */
+};
+
+/*
+ * Decode the JSON object `str,str_len` into the struct at `base`, described
+ * by `fields`, in a single pass. Keys with no field are skipped without
+ * being parsed, values of the wrong type or out of range are not stored.
+ * Return the number of values stored, or a negative json_walk() error.
+ */
+int json_scan_struct(const char *str, int str_len,
+                     const struct json_field *fields, void *base);
+
+/*
+ * Print the struct at `base`, described by `fields`, as a JSON object with
+ * the keys in the order of `fields`. Return the number of bytes printed.
+ */
+int json_print_struct(struct json_out *out, const struct json_field *fields,
+                      const void *base);
+
+/*
+ * Free the strings and arrays that json_scan_struct() malloc-ed in the
+ * struct at `base`, and set the pointers to NULL and the counts to 0.
+ */
+void json_free_struct(const struct json_field *fields, void *base);
+
+/*
+ * Decode the array at `path` in `s,len` into `dst`, an array of `cap`
+ * values of `type`, in a single pass: JSON_FIELD_INT for int32_t,
+ * JSON_FIELD_LLONG for int64_t, JSON_FIELD_FLOAT, JSON_FIELD_DOUBLE,
+ * JSON_FIELD_BOOL, and the other types but JSON_FIELD_CHARS and
+ * JSON_FIELD_OBJECT. Elements of the wrong type or out of range are left
+ * as they are. If `count` is not NULL, it is set to the number of elements
+ * in the array, even past `cap`.
+ * Return the number of values stored, -1 if there's no array at `path`,
+ * or a negative json_walk() error.
+ */
+int json_scanf_array(const char *s, int len, const char *path,
+                     enum json_field_type type, void *dst, int cap,
+                     int *count);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -15,22 +15,31 @@
  * GNU General Public License for more details.
  */
 
+#include "elsa/arena.c"
 #include "elsa/escape.c"
 #include "elsa/fread.c"
+#include "elsa/index.c"
 #include "elsa/next.c"
+#include "elsa/number.c"
+#include "elsa/parallel.c"
 #include "elsa/prettify.c"
 #include "elsa/printer.c"
 #include "elsa/printf.c"
+#include "elsa/scan.c"
 #include "elsa/scanf.c"
 #include "elsa/setf.c"
+#include "elsa/struct.c"
 #include "elsa/walk.c"
 
+#include <float.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static const char *tok_type_names[] = {
     "INVALID", "STRING",       "NUMBER",     "TRUE",        "FALSE",
@@ -433,6 +442,275 @@ static const char *test_json_printf(void) {
   return NULL;
 }
 
+static int test_printer_calls;
+
+static int test_counting_printer(struct json_out *out, const char *str,
+                                 size_t len) {
+  test_printer_calls++;
+  return json_printer_buf(out, str, len);
+}
+
+static const char *test_printf_template(void) {
+  const char *fmt =
+      "{id: %d, name: %Q, tags: [%B, %.*Q, %H], "
+      "v: %V, s: %*.*s, f: %.2f, m: %M, p: \"100%%\", n: %lld%n}";
+  char buf[300], buf2[300], big[200];
+  struct json_printf_template *tpl = json_printf_compile(fmt);
+  struct json_printf_template *t2;
+  struct my_struct mys = {1, 2};
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  struct json_out out2 = JSON_OUT_BUF(buf2, sizeof(buf2));
+  int n1 = 0, n2 = 0, len;
+
+  ASSERT(tpl != NULL);
+  memset(buf, 0, sizeof(buf));
+  memset(buf2, 0, sizeof(buf2));
+  len = json_printf(&out, fmt, -5, "a\"b", 2, "xyz", 0, 2, "\x01\xfe", "hi",
+                    2, 5, 3, "abcdef", 1.005, print_my_struct, &mys,
+                    123456789012LL, &n1);
+  ASSERT(json_printf_exec(&out2, tpl, -5, "a\"b", 2, "xyz", 0, 2, "\x01\xfe",
+                          "hi", 2, 5, 3, "abcdef", 1.005, print_my_struct,
+                          &mys, 123456789012LL, &n2) == len);
+  ASSERT(strcmp(buf, buf2) == 0 && n1 == n2 && n2 == len - 1);
+  ASSERT(strstr(buf2, "\"s\":   abc, ") != NULL);
+  ASSERT(strstr(buf2, "\"p\": \"100%\"") != NULL);
+  json_printf_template_free(tpl);
+
+  /* The text between two conversions takes a single call */
+  tpl = json_printf_compile("{a: %d, bc: [%d, %Q]}");
+  ASSERT(tpl != NULL);
+  out2.printer = test_counting_printer;
+  out2.u.buf.len = 0;
+  test_printer_calls = 0;
+  ASSERT(json_printf_exec(&out2, tpl, 1, 2, NULL) == 25);
+  ASSERT(strcmp(buf2, "{\"a\": 1, \"bc\": [2, null]}") == 0);
+  ASSERT(test_printer_calls == 7);
+
+  /* json_printf() gathers the text the same way, keys and all */
+  out2.u.buf.len = 0;
+  test_printer_calls = 0;
+  ASSERT(json_printf(&out2, "{a: %d, bc: [%d, %Q]}", 1, 2, NULL) == 25);
+  ASSERT(strcmp(buf2, "{\"a\": 1, \"bc\": [2, null]}") == 0);
+  ASSERT(test_printer_calls == 7);
+  memset(big, 'k', sizeof(big));
+  memcpy(big, "{ ", 2);
+  strcpy(big + sizeof(big) - 8, ": %d}");
+  out2.u.buf.len = 0;
+  test_printer_calls = 0;
+  ASSERT(json_printf(&out2, big, 7) == (int) sizeof(big) - 2);
+  ASSERT(memcmp(buf2, "{ \"kkk", 6) == 0);
+  ASSERT(strcmp(buf2 + sizeof(big) - 8, "k\": 7}") == 0);
+  ASSERT(test_printer_calls == 5);
+  json_printf_template_free(tpl);
+
+  /* No conversions at all, and one larger than the stack buffer */
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  tpl = json_printf_compile("[%s, ok]");
+  t2 = json_printf_compile("");
+  ASSERT(tpl != NULL && t2 != NULL);
+  out2.u.buf.len = 0;
+  ASSERT(json_printf_exec(&out2, tpl, big) == (int) sizeof(big) + 7);
+  ASSERT(memcmp(buf2, "[xxx", 4) == 0);
+  ASSERT(strcmp(buf2 + sizeof(big), ", \"ok\"]") == 0);
+  ASSERT(json_printf_exec(&out2, t2) == 0);
+  json_printf_template_free(tpl);
+  json_printf_template_free(t2);
+
+  return NULL;
+}
+
+static const char *test_printf_dynbuf(void) {
+  struct json_out out = JSON_OUT_DYNBUF();
+  char *p;
+  int i, len = 0;
+
+  /* Grows past the first size, then past several doublings */
+  ASSERT(json_printf(&out, "{a: %d}", 1) == 8);
+  ASSERT(out.u.buf.len == 8 && strcmp(out.u.buf.buf, "{\"a\": 1}") == 0);
+  for (i = 0; i < 1000; i++) len += json_printf(&out, "[%d, %Q]", i, "x");
+  ASSERT(out.u.buf.len == (size_t) len + 8);
+  ASSERT(out.u.buf.size > out.u.buf.len);
+  ASSERT(out.u.buf.buf[out.u.buf.len] == '\0');
+  ASSERT(strcmp(out.u.buf.buf + out.u.buf.len - 10, "[999, \"x\"]") == 0);
+
+  /* Reset keeps the buffer for the next output */
+  p = out.u.buf.buf;
+  json_out_dynbuf_reset(&out);
+  ASSERT(out.u.buf.len == 0 && out.u.buf.buf == p && p[0] == '\0');
+  ASSERT(json_prettify("{\"b\":[]}", 8, &out) == 8 && out.u.buf.len == 13);
+  ASSERT(out.u.buf.buf == p && strcmp(p, "{\n  \"b\": []\n}") == 0);
+
+  json_out_dynbuf_free(&out);
+  ASSERT(out.u.buf.buf == NULL && out.u.buf.size == 0 && out.u.buf.len == 0);
+  json_out_dynbuf_reset(&out);
+  json_out_dynbuf_free(&out);
+
+  return NULL;
+}
+
+static const char *test_printf_fd(void) {
+  char buf[16], big[40], rd[128];
+#ifdef PRINTER_WRITEV
+  int fds[2];
+
+  ASSERT(pipe(fds) == 0);
+  memset(big, 'b', sizeof(big));
+  {
+    struct json_out out = JSON_OUT_FD(fds[1], buf, sizeof(buf));
+    /* Written once the buffer is full, in pieces of its size */
+    ASSERT(json_printf(&out, "{a: %d}", 1) == 8 && out.u.buf.len == 8);
+    ASSERT(json_printf(&out, "[%d, %d]", 10, 20) == 8);
+    ASSERT(out.u.buf.len == 16);
+    ASSERT(json_printf(&out, "%Q", "xy") == 4 && out.u.buf.len == 4);
+    ASSERT(read(fds[0], rd, sizeof(rd)) == 16);
+    ASSERT(memcmp(rd, "{\"a\": 1}[10, 20]", 16) == 0);
+    /* Output larger than the buffer goes along with it, uncopied */
+    ASSERT(json_printf(&out, "%.*s", (int) sizeof(big), big) == 40);
+    ASSERT(out.u.buf.len == 0);
+    ASSERT(read(fds[0], rd, sizeof(rd)) == 44);
+    ASSERT(memcmp(rd, "\"xy\"", 4) == 0 && memcmp(rd + 4, big, 40) == 0);
+    ASSERT(json_printf(&out, "[]") == 2 && json_out_flush(&out) == 0);
+    ASSERT(read(fds[0], rd, sizeof(rd)) == 2 && memcmp(rd, "[]", 2) == 0);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  {
+    /* The rest of the output is dropped after a write error */
+    struct json_out out = JSON_OUT_FD(fds[1], buf, sizeof(buf));
+    ASSERT(json_printf(&out, "%d", 1) == 1);
+    ASSERT(json_out_flush(&out) == -1 && out.u.buf.fd == -1);
+    ASSERT(json_printf(&out, "%d", 1) == 0 && json_out_flush(&out) == -1);
+  }
+#endif
+
+  {
+    FILE *fp = tmpfile();
+    struct json_out out = JSON_OUT_FILE_BUF(fp, buf, sizeof(buf));
+    ASSERT(fp != NULL);
+    ASSERT(json_printf(&out, "{a: [%d, %d, %d]}", 1, 2, 3) == 16);
+    ASSERT(ftell(fp) == 0);
+    ASSERT(json_printf(&out, "%.*s", 5, "bbbbb") == 5 && ftell(fp) == 16);
+    ASSERT(json_out_flush(&out) == 0 && ftell(fp) == 21);
+    rewind(fp);
+    ASSERT(fread(rd, 1, sizeof(rd), fp) == 21);
+    ASSERT(memcmp(rd, "{\"a\": [1, 2, 3]}bbbbb", 21) == 0);
+    fclose(fp);
+  }
+
+  return NULL;
+}
+
+static const char *test_printf_iov(void) {
+  char space[32], big[600], *p;
+  struct json_iov iov;
+  struct json_out out = JSON_OUT_IOV(&iov), ref = JSON_OUT_DYNBUF();
+  int i, len;
+
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  json_iov_init(&iov, space, sizeof(space));
+
+  /* Long strings are referenced, the rest is copied, then malloc-ed */
+  len = json_printf(&out, "{a: %d, b: %Q, c: %s, d: %.*Q}", 1, big, big, 3,
+                    "a\nb");
+  ASSERT(len == json_printf(&ref, "{a: %d, b: %Q, c: %s, d: %.*Q}", 1, big,
+                            big, 3, "a\nb"));
+  ASSERT(iov.num_iov == 6);
+  ASSERT(iov.iov[0].iov_base == space && iov.iov[0].iov_len == 15);
+  ASSERT(iov.iov[1].iov_base == big && iov.iov[1].iov_len == 599);
+  ASSERT(iov.iov[2].iov_base == space + 15 && iov.iov[2].iov_len == 8);
+  ASSERT(iov.iov[3].iov_base == big && iov.iov[3].iov_len == 599);
+  ASSERT(iov.iov[4].iov_base == space + 23 && iov.iov[4].iov_len == 9);
+  ASSERT(iov.iov[5].iov_len == 5 && iov.arena.blocks != NULL);
+  for (i = 0, p = ref.u.buf.buf; i < iov.num_iov; i++) {
+    ASSERT(memcmp(p, iov.iov[i].iov_base, iov.iov[i].iov_len) == 0);
+    p += iov.iov[i].iov_len;
+  }
+  ASSERT(p == ref.u.buf.buf + len);
+
+  /* Escaping splits the reference */
+  json_iov_reset(&iov);
+  big[300] = '"';
+  ASSERT(json_printf(&out, "[%Q, %Q, %d]", big, "short", 7) == 616);
+  ASSERT(iov.num_iov == 5);
+  ASSERT(iov.iov[0].iov_base == space && iov.iov[0].iov_len == 2);
+  ASSERT(iov.iov[1].iov_base == big && iov.iov[1].iov_len == 300);
+  ASSERT(iov.iov[2].iov_len == 2);
+  ASSERT(memcmp(iov.iov[2].iov_base, "\\\"", 2) == 0);
+  ASSERT(iov.iov[3].iov_base == big + 301 && iov.iov[3].iov_len == 298);
+  ASSERT(iov.iov[4].iov_len == 14);
+  ASSERT(memcmp(iov.iov[4].iov_base, "\", \"short\", 7]", 14) == 0);
+
+  json_iov_free(&iov);
+  ASSERT(iov.iov == NULL && iov.num_iov == 0);
+  json_out_dynbuf_free(&ref);
+
+  return NULL;
+}
+
+static const char *test_printf_numbers(void) {
+  static const char *fmts[] = {"%f", "%.3f", "%g", "%.10g", "%e", "%.17g",
+                               "%+f", "%a"};
+  static const double ds[] = {0.1, -0.0, 1e21, 123456.5, 5e-324,
+                              2.5e-5, 1.0 / 3, -1e100};
+  char buf[200], ref[200], num[40];
+  size_t i, j;
+  float f;
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    json_printf(&out, "%d %i %u %hd %hhd %hhu %ld %lld %llu", INT_MIN, -7,
+                UINT_MAX, 70000, 300, 300, LONG_MIN, LLONG_MIN, ULLONG_MAX);
+    snprintf(ref, sizeof(ref), "%d %i %u %hd %hhd %hhu %ld %lld %llu",
+             INT_MIN, -7, UINT_MAX, 70000, 300, 300, LONG_MIN, LLONG_MIN,
+             ULLONG_MAX);
+    ASSERT(strcmp(buf, ref) == 0);
+  }
+
+  /* Same as the system printf(), from the shortest digits or not */
+  for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+    for (j = 0; j < sizeof(ds) / sizeof(ds[0]); j++) {
+      struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+      json_printf(&out, fmts[i], ds[j]);
+      snprintf(ref, sizeof(ref), fmts[i], ds[j]);
+      ASSERT(strcmp(buf, ref) == 0);
+    }
+  }
+
+  /* Shortest numbers that read back the same */
+  ASSERT(json_format_double(num, 0.1, 0) == 3 && memcmp(num, "0.1", 3) == 0);
+  ASSERT(json_format_double(num, -0.0, 0) == 2 && memcmp(num, "-0", 2) == 0);
+  ASSERT(json_format_double(num, 1e21, 0) == 5 && memcmp(num, "1e+21", 5) == 0);
+  ASSERT(json_format_double(num, 5e-324, 0) == 6);
+  ASSERT(memcmp(num, "5e-324", 6) == 0);
+  ASSERT(json_format_double(num, 0.1f, 1) == 3 && memcmp(num, "0.1", 3) == 0);
+  ASSERT(json_format_double(num, 16777216.0f, 1) == 8);
+  ASSERT(memcmp(num, "16777216", 8) == 0);
+  ASSERT(json_format_double(num, 1e10f, 1) == 5);
+  ASSERT(memcmp(num, "1e+10", 5) == 0);
+  for (i = 0; i < 2000; i++) {
+    double d = ds[i % 8] * (double) (i * 2654435761U) / (i + 1);
+    num[json_format_double(num, d, 0)] = '\0';
+    ASSERT(strtod(num, NULL) == d);
+    f = (float) d;
+    num[json_format_double(num, f, 1)] = '\0';
+    ASSERT(strtof(num, NULL) == f);
+  }
+  ASSERT(json_format_int(num, 1, 9223372036854775808ULL) == 20);
+  ASSERT(memcmp(num, "-9223372036854775808", 20) == 0);
+
+  /* The decimal point of JSON, whatever the locale */
+  if (setlocale(LC_NUMERIC, "de_DE.UTF-8") != NULL) {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    json_printf(&out, "[%g, %.20g, %.2Lf]", 1.5, 0.1, (long double) 2);
+    setlocale(LC_NUMERIC, "C");
+    ASSERT(strcmp(buf, "[1.5, 0.10000000000000000555, 2.00]") == 0);
+  }
+
+  return NULL;
+}
+
 static void cb(void *data, const char *name, size_t name_len, const char *path,
                const struct json_token *token) {
   char *buf = (char *) data;
@@ -525,6 +803,516 @@ static const char *test_callback_api_long_path(void) {
   return NULL;
 }
 
+static int ex_cb(void *data, const struct json_walk_event *ev,
+                 const struct json_token *token) {
+  char *buf = (char *) data;
+  sprintf(buf + strlen(buf), "%d %d '%.*s' %s %s '%.*s'\n", ev->depth,
+          ev->index, (int) ev->name_len, ev->name != NULL ? ev->name : "",
+          ev->path != NULL ? ev->path : "<null>", tok_type_names[token->type],
+          token->ptr != NULL ? token->len : 0,
+          token->ptr != NULL ? token->ptr : "");
+  return token->type == JSON_TYPE_FALSE ? -100 : 0;
+}
+
+static void cb64(void *data, const char *name, size_t name_len,
+                 const char *path, const struct json_token64 *token) {
+  struct json_token t;
+  t.ptr = token->ptr;
+  t.len = (int) token->len;
+  t.type = token->type;
+  cb(data, name, name_len, path, &t);
+}
+
+static const char *test_walk64(void) {
+  const char *s = "{\"c\":[\"foo\", {\"a\":9}], \"\": null, d: [] } x";
+  char buf1[4096] = "", buf2[4096] = "";
+
+  ASSERT(json_walk(s, strlen(s), cb, buf1) == (int) strlen(s) - 2);
+  ASSERT(json_walk64(s, strlen(s), cb64, buf2) == (ptrdiff_t) strlen(s) - 2);
+  ASSERT(strcmp(buf1, buf2) == 0);
+  ASSERT(json_walk64("[1", 2, NULL, NULL) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_walk(s, -1, NULL, NULL) == JSON_STRING_INVALID);
+
+  {
+    /* The rest of the 64-bit API gives the same as the int one */
+    struct json_token t1, k1, t3, k3;
+    struct json_token64 t2, k2;
+    struct json_out out = JSON_OUT_BUF(buf1, sizeof(buf1));
+    void *h1 = NULL, *h2 = NULL;
+    int a1 = 0, a2 = 0, i1 = 0;
+    ptrdiff_t i2 = 0;
+
+    ASSERT(json_walk_ex64(s, strlen(s), NULL, NULL, NULL) ==
+           (ptrdiff_t) strlen(s) - 2);
+    ASSERT(json_scanf(s, strlen(s), "{c: %T, d: %T}", &t1, &k1) == 2);
+    ASSERT(json_scanf64(s, strlen(s), "{d: %T, c: %T}", &k3, &t3) == 2);
+    ASSERT(t1.ptr == t3.ptr && t1.len == t3.len && t1.len == 16);
+    ASSERT(k1.ptr == k3.ptr && k1.len == k3.len);
+    ASSERT(json_scanf64("{\"a\": -7, \"b\": 1}", 18, "{a: %d, b: %d}", &a1,
+                        &a2) == 2);
+    ASSERT(a1 == -7 && a2 == 1);
+    ASSERT(json_scanf(s, -1, "{c: %T}", &t1) == 0);
+
+    memset(buf1, 0, sizeof(buf1));
+    ASSERT(json_setf(s, strlen(s), &out, ".c[1].a", "%d", 10) == 1);
+    out = (struct json_out) JSON_OUT_BUF(buf2, sizeof(buf2));
+    memset(buf2, 0, sizeof(buf2));
+    ASSERT(json_setf64(s, strlen(s), &out, ".c[1].a", "%d", 10) == 1);
+    ASSERT(strcmp(buf1, buf2) == 0 && strstr(buf2, "{\"a\":10}") != NULL);
+
+    while ((h1 = json_next_key(s, strlen(s), h1, "", &k1, &t1)) != NULL) {
+      h2 = json_next_key64(s, strlen(s), h2, "", &k2, &t2);
+      ASSERT(h1 == h2 && k1.ptr == k2.ptr && (size_t) k1.len == k2.len);
+      ASSERT(t1.ptr == t2.ptr && (size_t) t1.len == t2.len);
+    }
+    ASSERT(json_next_key64(s, strlen(s), h2, "", &k2, &t2) == NULL);
+    h1 = h2 = NULL;
+    while ((h1 = json_next_elem(s, strlen(s), h1, ".c", &i1, &t1)) != NULL) {
+      h2 = json_next_elem64(s, strlen(s), h2, ".c", &i2, &t2);
+      ASSERT(h1 == h2 && i1 == i2 && t1.type == t2.type);
+    }
+    ASSERT(i2 == 1);
+  }
+
+  return NULL;
+}
+
+static int escaped_cb(void *data, const struct json_walk_event *ev,
+                      const struct json_token *token) {
+  if (token->type == JSON_TYPE_STRING) {
+    strcat((char *) data, ev->escaped ? "1" : "0");
+  }
+  return 0;
+}
+
+static const char *test_walk_ex(void) {
+  const char *s = "{\"c\":[\"foo\", {\"a\":9}], \"\": null, d: []}";
+  const char *result =
+      "0 -1 '' <null> OBJECT_START ''\n"
+      "1 -1 'c' <null> ARRAY_START ''\n"
+      "2 0 '' <null> STRING 'foo'\n"
+      "2 1 '' <null> OBJECT_START ''\n"
+      "3 -1 'a' <null> NUMBER '9'\n"
+      "2 -1 '' <null> OBJECT_END '{\"a\":9}'\n"
+      "1 -1 '' <null> ARRAY_END '[\"foo\", {\"a\":9}]'\n"
+      "1 -1 '' <null> NULL 'null'\n"
+      "1 -1 'd' <null> ARRAY_START ''\n"
+      "1 -1 '' <null> ARRAY_END '[]'\n"
+      "0 -1 '' <null> OBJECT_END '{\"c\":[\"foo\", {\"a\":9}], \"\": null, "
+      "d: []}'\n";
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  char buf[4096] = "";
+
+  ASSERT(json_walk_ex(s, strlen(s), &opts, ex_cb, buf) ==
+         (int) strlen(s));
+  ASSERT(strcmp(buf, result) == 0);
+
+  /* Paths are the same as in json_walk() */
+  buf[0] = '\0';
+  ASSERT(json_walk_ex("[1,{\"x\":[2]}]", 13, NULL, ex_cb, buf) == 13);
+  ASSERT(strcmp(buf,
+                "0 -1 ''  ARRAY_START ''\n"
+                "1 0 '' [0] NUMBER '1'\n"
+                "1 1 '' [1] OBJECT_START ''\n"
+                "2 -1 'x' [1].x ARRAY_START ''\n"
+                "3 0 '' [1].x[0] NUMBER '2'\n"
+                "2 -1 '' [1].x ARRAY_END '[2]'\n"
+                "1 -1 '' [1] OBJECT_END '{\"x\":[2]}'\n"
+                "0 -1 ''  ARRAY_END '[1,{\"x\":[2]}]'\n") == 0);
+
+  /* Negative return value stops the walk */
+  buf[0] = '\0';
+  ASSERT(json_walk_ex("[1,false,2]", 11, NULL, ex_cb, buf) == -100);
+  ASSERT(strstr(buf, "'2'") == NULL);
+  ASSERT(json_walk_ex("[1,", 3, NULL, NULL, NULL) == JSON_STRING_INCOMPLETE);
+
+  /* Strings with escapes are told apart, keys don't count */
+  buf[0] = '\0';
+  s = "{\"a\\n\": \"x\", b: [\"\\u0041\", \"\", \"\xc3\xa9\", \"\\\"\"]}";
+  ASSERT(json_walk_ex(s, strlen(s), NULL, escaped_cb, buf) == (int) strlen(s));
+  ASSERT(strcmp(buf, "01001") == 0);
+
+  return NULL;
+}
+
+/* Same as cb(), with the containers ending where json_parser reports them */
+static void end_cb(void *data, const char *name, size_t name_len,
+                   const char *path, const struct json_token *token) {
+  struct json_token t = *token;
+  if (t.type == JSON_TYPE_OBJECT_END || t.type == JSON_TYPE_ARRAY_END) {
+    t.ptr += t.len - 1;
+    t.len = 1;
+  }
+  cb(data, name, name_len, path, &t);
+}
+
+/* Count the bytes of the strings reported */
+static void str_len_cb(void *data, const char *name, size_t name_len,
+                       const char *path, const struct json_token *token) {
+  (void) name;
+  (void) name_len;
+  (void) path;
+  if (token->type == JSON_TYPE_STRING) *(size_t *) data += token->len;
+}
+
+static const char *test_parser(void) {
+  const char *s =
+      " { a: 1, \"b\": \"hi \\u0041 there\", c: true, d: false, e : null, "
+      "f: [ 1, -2.5e3, 3, [], {}], \"g\\\"\": { \"1\": [], h: [ 7 ] } } xx";
+  int len = strlen(s), n = len - 3, i, j, res;
+  char expected[4096] = "", buf[4096];
+  struct json_parser *p;
+
+  ASSERT(json_walk(s, len, end_cb, expected) == n);
+
+  /* Any way to split the input gives the same events */
+  for (i = 1; i <= 7; i++) {
+    buf[0] = '\0';
+    ASSERT((p = json_parser_create(cb, buf)) != NULL);
+    for (j = 0, res = 0; j < len && res == 0; j += i) {
+      res = json_parser_feed(p, s + j, j + i > len ? len - j : i);
+    }
+    /* Value is reported complete with the chunk that has its last byte */
+    ASSERT(res == n && j - i < n && j >= n);
+    ASSERT(json_parser_feed(p, "]", 1) == n);
+    ASSERT(json_parser_finish(p) == n);
+    ASSERT(strcmp(buf, expected) == 0);
+    json_parser_free(p);
+  }
+
+  /* Top-level number is complete only at the end of input */
+  buf[0] = '\0';
+  p = json_parser_create(cb, buf);
+  ASSERT(json_parser_feed(p, " 12", 3) == 0);
+  ASSERT(json_parser_feed(p, "34", 2) == 0);
+  ASSERT(buf[0] == '\0');
+  ASSERT(json_parser_finish(p) == 5);
+  ASSERT(strstr(buf, "val:'1234'") != NULL);
+  json_parser_free(p);
+
+  p = json_parser_create(NULL, NULL);
+  ASSERT(json_parser_feed(p, "[1, ", 4) == 0);
+  ASSERT(json_parser_finish(p) == JSON_STRING_INCOMPLETE);
+  json_parser_free(p);
+
+  /* Errors are sticky */
+  p = json_parser_create(NULL, NULL);
+  ASSERT(json_parser_feed(p, "[1, ", 4) == 0);
+  ASSERT(json_parser_feed(p, "x", 1) == JSON_STRING_INVALID);
+  ASSERT(json_parser_feed(p, "]", 1) == JSON_STRING_INVALID);
+  ASSERT(json_parser_finish(p) == JSON_STRING_INVALID);
+  json_parser_free(p);
+
+  /* A value past 2 GiB of the stream, as if that much was fed already */
+  p = json_parser_create(NULL, NULL);
+  ASSERT(json_parser_feed(p, "[", 1) == 0);
+  p->offset += (size_t) INT_MAX;
+  ASSERT(json_parser_feed64(p, "1]", 2) == (ptrdiff_t) INT_MAX + 3);
+  ASSERT(json_parser_feed(p, " ", 1) == INT_MAX);
+  ASSERT(json_parser_finish64(p) == (ptrdiff_t) INT_MAX + 3);
+  ASSERT(json_parser_finish(p) == INT_MAX);
+  json_parser_free(p);
+
+  {
+    /*
+     * A long string in small chunks is scanned only once: a rescan from its
+     * start on every chunk would take minutes
+     */
+    size_t size = 4 << 20, total = 0;
+    char *big = (char *) malloc(size);
+    clock_t start = clock();
+    memset(big, 'x', size);
+    for (i = 0; i < 64; i++) memcpy(big + size / 64 * i, "\\u00e9 \xc3\xa9", 9);
+    p = json_parser_create(str_len_cb, &total);
+    ASSERT(json_parser_feed(p, "{\"k\": [\"", 8) == 0);
+    for (j = 0, res = 0; j < (int) size && res == 0; j += 61) {
+      res = json_parser_feed(p, big + j, j + 61 > (int) size ? size - j : 61);
+    }
+    ASSERT(res == 0);
+    ASSERT(json_parser_feed(p, "\"]}", 3) == (int) size + 11);
+    ASSERT(total == size);
+    ASSERT(clock() - start < CLOCKS_PER_SEC * 2);
+    json_parser_free(p);
+    free(big);
+  }
+
+  return NULL;
+}
+
+struct lines_data {
+  unsigned long hash; /* Hash of the reported events, in their order */
+  int num_records, num_errors;
+};
+
+static void lines_hash(struct lines_data *d, const char *s, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) d->hash = (d->hash ^ (unsigned char) s[i]) * 31;
+}
+
+static void lines_cb(void *data, const char *name, size_t name_len,
+                     const char *path, const struct json_token *token) {
+  struct lines_data *d = (struct lines_data *) data;
+  lines_hash(d, name == NULL ? "<null>" : name, name == NULL ? 6 : name_len);
+  lines_hash(d, path, strlen(path));
+  lines_hash(d, token->ptr == NULL ? "" : token->ptr, token->len);
+  d->hash += token->type;
+}
+
+static void lines_result_cb(void *data, const char *record, int record_len,
+                            int result) {
+  struct lines_data *d = (struct lines_data *) data;
+  d->num_records++;
+  if (result < 0) d->num_errors++;
+  d->hash = d->hash * 7 + result;
+  (void) record;
+  (void) record_len;
+}
+
+static const char *test_walk_lines(void) {
+  struct lines_data expected, d[4];
+  void *data[4] = {&d[0], &d[1], &d[2], &d[3]};
+  struct json_walk_lines_opts opts;
+  int i, len = 0, size = 300000;
+  char *s = (char *) malloc(size), *p;
+
+  /* Enough records for many batches, with blank and invalid lines */
+  memset(&expected, 0, sizeof(expected));
+  for (i = 0; len < size - 200; i++) {
+    p = s + len;
+    if (i % 97 == 5) {
+      len += sprintf(p, " \r\n");
+    } else if (i % 101 == 7) {
+      len += sprintf(p, "{\"id\": %d, \"bad\n", i);
+    } else {
+      len += sprintf(p, "{\"id\": %d, \"tags\": [\"a\", \"b\\n%d\"], x: {}}\n", i, i);
+    }
+    if (json_scan_spaces(p, s + len - 1) < s + len - 1) {
+      lines_result_cb(&expected, p, s + len - p - 1,
+                      json_walk(p, s + len - p - 1, lines_cb, &expected));
+    }
+  }
+
+  memset(&opts, 0, sizeof(opts));
+  opts.callback = lines_cb;
+  opts.result = lines_result_cb;
+  opts.callback_data = data;
+
+  /* All threads report to one place: the order is the same as in input */
+  opts.flags = JSON_WALK_LINES_ORDERED;
+  for (i = 0; i < 4; i++) data[i] = &d[0];
+  for (opts.num_threads = 1; opts.num_threads <= 4; opts.num_threads++) {
+    memset(d, 0, sizeof(d));
+    ASSERT(json_walk_lines(s, len, &opts) == expected.num_records);
+    ASSERT(d[0].hash == expected.hash);
+    ASSERT(d[0].num_records == expected.num_records);
+    ASSERT(d[0].num_errors == expected.num_errors);
+    ASSERT(expected.num_errors > 0);
+  }
+
+  /* Unordered, every thread has its own data */
+  opts.flags = 0;
+  opts.num_threads = 4;
+  memset(d, 0, sizeof(d));
+  for (i = 0; i < 4; i++) data[i] = &d[i];
+  ASSERT(json_walk_lines(s, len, &opts) == expected.num_records);
+  ASSERT(d[0].num_records + d[1].num_records + d[2].num_records +
+             d[3].num_records ==
+         expected.num_records);
+  ASSERT(d[0].num_errors + d[1].num_errors + d[2].num_errors +
+             d[3].num_errors ==
+         expected.num_errors);
+
+  /* Last line doesn't need a newline */
+  memset(d, 0, sizeof(d));
+  opts.num_threads = 2;
+  ASSERT(json_walk_lines("1\n\n [2]", 8, &opts) == 2);
+  ASSERT(json_walk_lines("", 0, &opts) == 0);
+
+  free(s);
+  return NULL;
+}
+
+/* Check that json_walk_array() gives the same as json_walk() in order */
+static int check_walk_array(const char *s, int len) {
+  struct lines_data expected, d;
+  void *data[4] = {&d, &d, &d, &d};
+  struct json_walk_lines_opts opts;
+  int res;
+
+  memset(&expected, 0, sizeof(expected));
+  res = json_walk(s, len, lines_cb, &expected);
+  memset(&opts, 0, sizeof(opts));
+  opts.flags = JSON_WALK_LINES_ORDERED;
+  opts.callback = lines_cb;
+  opts.callback_data = data;
+  for (opts.num_threads = 1; opts.num_threads <= 4; opts.num_threads++) {
+    memset(&d, 0, sizeof(d));
+    if (json_walk_array(s, len, &opts) != res) return 0;
+    if (d.hash != expected.hash) return 0;
+  }
+  return 1;
+}
+
+static const char *test_walk_array(void) {
+  const char *cases[] = {"[1, 2 3]",       "[1,]",   "[1,,2]", "[,1]",
+                         "[1, {\"a\":}, 2]", "[1",     "[",      "[1, 2}",
+                         "[1, [2, 3",       "[]",     " [ ] ",  "5",
+                         "{\"a\": [1]}",     "[1, x]", "[\"a\", \"b", "[1true, 2]"};
+  struct lines_data d[4];
+  void *data[4] = {&d[0], &d[1], &d[2], &d[3]};
+  struct json_walk_lines_opts opts;
+  int i, len = 0, size = 300000, n = 0;
+  char *s = (char *) malloc(size);
+
+  for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+    ASSERT(check_walk_array(cases[i], strlen(cases[i])));
+  }
+
+  /* Enough elements for many batches */
+  len = sprintf(s, " [");
+  for (i = 0; len < size - 200; i++, n++) {
+    len += sprintf(s + len, "%s\n", i == 0 ? "" : ",");
+    if (i % 3 == 0) {
+      len += sprintf(s + len, "{\"id\": %d, \"t\": [\"]\", [%d]], x: {}}", i, i);
+    } else {
+      len += sprintf(s + len, i % 3 == 1 ? "%d" : "\"%d\"", i);
+    }
+  }
+  len += sprintf(s + len, "] ");
+  ASSERT(check_walk_array(s, len));
+
+  /* Unordered, every thread has its own data */
+  memset(&opts, 0, sizeof(opts));
+  memset(d, 0, sizeof(d));
+  opts.num_threads = 4;
+  opts.result = lines_result_cb;
+  opts.callback_data = data;
+  ASSERT(json_walk_array(s, len, &opts) == len - 1);
+  ASSERT(d[0].num_records + d[1].num_records + d[2].num_records +
+             d[3].num_records ==
+         n);
+
+  /* Broken element in the middle */
+  memcpy(s + len / 2, "}}}", 3);
+  ASSERT(check_walk_array(s, len));
+
+  /* The depth limit covers the array, not just its elements */
+  for (i = JSON_MAX_DEPTH - 1; i <= JSON_MAX_DEPTH; i++) {
+    len = sprintf(s, "[1, ");
+    memset(s + len, '[', i);
+    memset(s + len + i, ']', i);
+    len += 2 * i;
+    len += sprintf(s + len, ", 2]");
+    ASSERT(check_walk_array(s, len));
+  }
+  ASSERT(json_walk(s, len, NULL, NULL) == JSON_STRING_TOO_DEEP);
+
+  free(s);
+  return NULL;
+}
+
+static int skip_cb(void *data, const struct json_walk_event *ev,
+                   const struct json_token *token) {
+  ex_cb(data, ev, token);
+  return ev->name != NULL && ev->name_len == 7 &&
+                 memcmp(ev->name, "payload", 7) == 0
+             ? JSON_WALK_SKIP
+             : 0;
+}
+
+static const char *test_walk_filtered(void) {
+  const char *s =
+      "{\"meta\": {\"id\": 1, \"tags\": [\"a\"]}, \"metadata\": {\"id\": 2}, "
+      "\"payload\": {\"x\": [1, {\"y\": \"]}\\\"\"}], \"meta\": {}}, z: 5}";
+  const char *result =
+      "name:'meta', path:'.meta', type:OBJECT_START, val:'<null>'\n"
+      "name:'id', path:'.meta.id', type:NUMBER, val:'1'\n"
+      "name:'tags', path:'.meta.tags', type:ARRAY_START, val:'<null>'\n"
+      "name:'0', path:'.meta.tags[0]', type:STRING, val:'a'\n"
+      "name:'<null>', path:'.meta.tags', type:ARRAY_END, val:'[\"a\"]'\n"
+      "name:'<null>', path:'.meta', type:OBJECT_END, val:'{\"id\": 1, "
+      "\"tags\": [\"a\"]}'\n";
+  struct json_walk_ex_opts opts = {JSON_WALK_NO_PATH, 0};
+  char buf[4096] = "";
+
+  ASSERT(json_walk_filtered(s, strlen(s), ".meta", cb, buf) == (int) strlen(s));
+  ASSERT(strcmp(buf, result) == 0);
+
+  buf[0] = '\0';
+  ASSERT(json_walk_filtered(s, strlen(s), ".meta.tags[0]", cb, buf) > 0);
+  ASSERT(strcmp(buf, "name:'0', path:'.meta.tags[0]', type:STRING, "
+                     "val:'a'\n") == 0);
+
+  /* Skipped containers are not validated, but must be complete */
+  buf[0] = '\0';
+  ASSERT(json_walk_filtered("[1, {a: ?}, 2]", 14, "[2]", cb, buf) == 14);
+  ASSERT(strcmp(buf, "name:'2', path:'[2]', type:NUMBER, val:'2'\n") == 0);
+  ASSERT(json_walk_filtered("[1, {a: 2]", 10, "[0]", NULL, NULL) ==
+         JSON_STRING_INCOMPLETE);
+
+  /* Callback can skip a container, and gets its end */
+  buf[0] = '\0';
+  ASSERT(json_walk_ex(s, strlen(s), &opts, skip_cb, buf) ==
+         (int) strlen(s));
+  ASSERT(strstr(buf, "'x'") == NULL);
+  ASSERT(strstr(buf,
+                "1 -1 'payload' <null> OBJECT_START ''\n"
+                "1 -1 '' <null> OBJECT_END '{\"x\": [1, {\"y\": \"]}\\\"\"}], "
+                "\"meta\": {}}'\n"
+                "1 -1 'z' <null> NUMBER '5'\n") != NULL);
+
+  return NULL;
+}
+
+static const char *test_deep_nesting(void) {
+  char s[JSON_MAX_DEPTH * 6 + 10];
+  int i, n = 0;
+
+  /* Nesting up to the limit is fine, mixing objects and arrays */
+  for (i = 0; i < JSON_MAX_DEPTH; i++) {
+    n += sprintf(s + n, "%s", i % 2 ? "[" : "{a:");
+  }
+  n += sprintf(s + n, "1");
+  for (i = JSON_MAX_DEPTH - 1; i >= 0; i--) {
+    n += sprintf(s + n, "%s", i % 2 ? "]" : "}");
+  }
+  ASSERT(json_walk(s, n, NULL, NULL) == n);
+  ASSERT(json_walk(s, n - 1, NULL, NULL) == JSON_STRING_INCOMPLETE);
+
+  /* One more level is an error, not a stack overflow */
+  memset(s, '[', JSON_MAX_DEPTH + 1);
+  ASSERT(json_walk(s, JSON_MAX_DEPTH, NULL, NULL) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_walk(s, JSON_MAX_DEPTH + 1, NULL, NULL) ==
+         JSON_STRING_TOO_DEEP);
+
+  return NULL;
+}
+
+static const char *test_walk_max_depth(void) {
+  struct json_walk_ex_opts opts = {0, 2};
+  char *s = (char *) malloc(2002);
+  int i;
+
+  ASSERT(json_walk_ex("[{}]", 4, &opts, NULL, NULL) == 4);
+  ASSERT(json_walk_ex("[{a:[]}]", 8, &opts, NULL, NULL) ==
+         JSON_STRING_TOO_DEEP);
+
+  /* Deeper than the inline frames: the rest live on the heap */
+  for (i = 0; i < 1001; i++) {
+    s[i] = '[';
+    s[2001 - i] = ']';
+  }
+  opts.max_depth = 1000;
+  ASSERT(json_walk_ex(s + 1, 2000, &opts, NULL, NULL) == 2000);
+  ASSERT(json_walk_ex(s, 2002, &opts, NULL, NULL) == JSON_STRING_TOO_DEEP);
+  ASSERT(json_walk_ex(s, 2002, NULL, NULL, NULL) == JSON_STRING_TOO_DEEP);
+  opts.max_depth = 1001;
+  ASSERT(json_walk_ex(s, 2002, &opts, NULL, NULL) == 2002);
+  free(s);
+
+  return NULL;
+}
+
 static void scan_array(const char *str, int len, void *user_data) {
   struct json_token t;
   int i;
@@ -710,6 +1498,464 @@ static const char *test_scanf(void) {
   return NULL;
 }
 
+static const char *test_scanf_plan(void) {
+  struct json_scanf_plan *plan =
+      json_scanf_compile("{a: %d, b: {c: %Q, d: %M}, e: %T, f: %5s}");
+  const char *s1 =
+      "{a: 1, b: {c: \"x\\ty\", d: {x: [2, 3]}}, e: [], f: \"hey\"}";
+  const char *s2 = "{f: \"abcdefgh\", b: {d: {}, c: null}, a: -7}";
+  char buf[100] = "", f[10] = "";
+  char *c = NULL;
+  struct json_token e;
+  int a = 0;
+
+  ASSERT(plan != NULL);
+  ASSERT(json_scanf_exec(plan, s1, strlen(s1), &a, &c, &scan_array, buf, &e,
+                         f) == 5);
+  ASSERT(a == 1 && c != NULL && strcmp(c, "x\ty") == 0);
+  ASSERT(strcmp(buf, "0[2] 1[3] ") == 0);
+  ASSERT(e.type == JSON_TYPE_ARRAY_END && e.len == 2);
+  ASSERT(strcmp(f, "hey") == 0);
+  free(c);
+
+  /* Same plan, another string */
+  buf[0] = '\0';
+  memset(&e, 0, sizeof(e));
+  ASSERT(json_scanf_exec(plan, s2, strlen(s2), &a, &c, &scan_array, buf, &e,
+                         f) == 3);
+  ASSERT(a == -7 && c == NULL && buf[0] == '\0' && e.ptr == NULL);
+  ASSERT(strcmp(f, "abcde") == 0);
+  json_scanf_plan_free(plan);
+
+  {
+    /* Format that doesn't fit on the stack in json_scanf() */
+    char fmt[2048] = "{", str[2048] = "{";
+    int i, vals[64];
+    for (i = 0; i < 64; i++) {
+      sprintf(fmt + strlen(fmt), "long_key_number_%d: %%d, ", i);
+      sprintf(str + strlen(str), "long_key_number_%d: %d, ", i, i * 3);
+    }
+    strcat(fmt, "}");
+    strcat(str, "}");
+    ASSERT(json_scanf(str, strlen(str), fmt, &vals[0], &vals[1], &vals[2],
+                      &vals[3], &vals[4], &vals[5], &vals[6], &vals[7],
+                      &vals[8], &vals[9], &vals[10], &vals[11], &vals[12],
+                      &vals[13], &vals[14], &vals[15], &vals[16], &vals[17],
+                      &vals[18], &vals[19], &vals[20], &vals[21], &vals[22],
+                      &vals[23], &vals[24], &vals[25], &vals[26], &vals[27],
+                      &vals[28], &vals[29], &vals[30], &vals[31], &vals[32],
+                      &vals[33], &vals[34], &vals[35], &vals[36], &vals[37],
+                      &vals[38], &vals[39], &vals[40], &vals[41], &vals[42],
+                      &vals[43], &vals[44], &vals[45], &vals[46], &vals[47],
+                      &vals[48], &vals[49], &vals[50], &vals[51], &vals[52],
+                      &vals[53], &vals[54], &vals[55], &vals[56], &vals[57],
+                      &vals[58], &vals[59], &vals[60], &vals[61], &vals[62],
+                      &vals[63]) == 64);
+    for (i = 0; i < 64; i++) ASSERT(vals[i] == i * 3);
+  }
+
+  {
+    /* One walk fills all the conversions, with the last duplicate winning */
+    const char *s3 = "{x: {y: [1, {z: 2}]}, a: {b: 1, c: 2, b: 3}, d: 4}";
+    int b = 0, d = 0, z = 0;
+    ASSERT(json_scanf(s3, strlen(s3), "{d: %d, x: {y: %T}, a: {b: %d}}", &d,
+                      &e, &b) == 4);
+    ASSERT(b == 3 && d == 4);
+    ASSERT(e.type == JSON_TYPE_ARRAY_END && e.len == 11);
+
+    /* A truncated tail doesn't lose the values before it */
+    s3 = "{a: {b: 5}, c: [1, 2";
+    ASSERT(json_scanf(s3, strlen(s3), "{a: {b: %d}}", &b) == 1);
+    ASSERT(b == 5);
+
+    /* A closed object can turn up again, under a duplicate key */
+    s3 = "{\"a\":{\"b\":1},\"a\":{\"b\":2}}";
+    ASSERT(json_scanf(s3, strlen(s3), "{a:{b:%d}}", &b) == 2);
+    ASSERT(b == 2);
+    s3 = "{x: {a: [1, {b: 1}]}, x: {a: [2, {b: 2, c: 3}]}}";
+    ASSERT(json_scanf(s3, strlen(s3), "{x: {a: %T}}", &e) == 2);
+    ASSERT(e.type == JSON_TYPE_ARRAY_END && e.len == 17);
+
+    /* Skips what's not needed, without looking into it */
+    s3 = "{x: [1 2 {]}, y: {z: 6}}";
+    ASSERT(json_scanf(s3, strlen(s3), "{y: {z: %d}}", &z) == 1);
+    ASSERT(z == 6);
+  }
+
+  {
+    /*
+     * Paths that share a beginning, but only some are inside others, and
+     * the same path twice
+     */
+    const char *s4 =
+        "{a: {b: 1, b0: 2}, a0: 3, a_b: 4, ab: {b: 5}, c: [7]}";
+    int ab = 0, ab0 = 0, a0 = 0, a_b = 0, abb = 0, ab2 = 0;
+    struct json_token ta, tc, tx;
+    ASSERT(json_scanf(s4, strlen(s4),
+                      "{a_b: %d, a0: %d, ab: {b: %d, x: %T}, c: %T, a: %T, "
+                      "a: {b0: %d, b: %d, x: %T}, a: {b: %d, x: %T}}",
+                      &a_b, &a0, &abb, &tx, &tc, &ta, &ab0, &ab, &tx, &ab2,
+                      &tx) == 8);
+    ASSERT(ab == 1 && ab2 == 1 && ab0 == 2 && a0 == 3 && a_b == 4);
+    ASSERT(abb == 5);
+    ASSERT(ta.type == JSON_TYPE_OBJECT_END && ta.len == 13);
+    ASSERT(tc.type == JSON_TYPE_ARRAY_END && tc.len == 3);
+  }
+
+  return NULL;
+}
+
+static const char *test_scanf_numbers(void) {
+  const char *str =
+      "{a: -2147483648, b: 2147483648, c: 18446744073709551615, "
+      "d: -1, e: 0.1, f: -0, g: 1.7976931348623157e308, h: 1e309, "
+      "i: \"0x1F\", j: \"012\", k: \"  42\", "
+      "l: 1.00000000000000000000000000000000000000000000000000001, "
+      "m: 300, n: -129, o: 4.9e-324}";
+  int a = 0, b = 7, i = 0, j = 0, k = 0;
+  unsigned long long c = 0;
+  unsigned u = 7;
+  double e = 0, f = 1, g = 0, h = 7, l = 0, o = 0;
+  float ef = 0;
+  unsigned char m = 7;
+  signed char n = 7;
+  long d = 0;
+  long long ll = 0;
+
+  ASSERT(json_scanf(str, strlen(str),
+                    "{a: %d, b: %d, c: %llu, d: %u, e: %lf, f: %lg, g: %le, "
+                    "h: %lf, i: %i, j: %i, k: %d, l: %lf, m: %hhu, n: %hhd, "
+                    "o: %lf}",
+                    &a, &b, &c, &u, &e, &f, &g, &h, &i, &j, &k, &l, &m, &n,
+                    &o) == 10);
+  ASSERT(a == INT_MIN);
+  ASSERT(b == 7); /* Doesn't fit */
+  ASSERT(c == 18446744073709551615ULL);
+  ASSERT(u == 7); /* Negative */
+  ASSERT(e == 0.1);
+  ASSERT(f == 0 && 1 / f < 0);
+  ASSERT(g == DBL_MAX);
+  ASSERT(h == 7); /* Infinite */
+  ASSERT(i == 31 && j == 10 && k == 42);
+  ASSERT(l == 1.0);
+  ASSERT(m == 7 && n == 7);
+  ASSERT(o == 4.9e-324);
+
+  ASSERT(json_scanf(str, strlen(str), "{a: %lld, e: %f, d: %ld}", &ll, &ef,
+                    &d) == 3);
+  ASSERT(ll == INT_MIN && ef == 0.1f && d == -1);
+
+  return NULL;
+}
+
+static const char *test_scanf_arena(void) {
+  const char *str = "{a: \"hi\\n\", b: \"aGVsbG8=\", c: \"f00d\", d: null}";
+  char mem[64], *a = NULL, *b = NULL, *c = NULL, *d = mem, *p;
+  struct json_scanf_plan *plan;
+  struct json_arena arena;
+  int i, b_len = 0, c_len = 0;
+
+  json_arena_init(&arena, mem, sizeof(mem));
+  ASSERT(json_scanf_arena(str, strlen(str), &arena,
+                          "{a: %Q, b: %V, c: %H, d: %Q}", &a, &b, &b_len,
+                          &c_len, &c, &d) == 3);
+  ASSERT(strcmp(a, "hi\n") == 0);
+  ASSERT(b_len == 5 && strcmp(b, "hello") == 0);
+  ASSERT(c_len == 2 && memcmp(c, "\xf0\x0d", 2) == 0);
+  ASSERT(d == NULL);
+  /* Nothing was malloc-ed */
+  ASSERT(a >= mem && c < mem + sizeof(mem) && arena.blocks == NULL);
+
+  /* Allocations are aligned, and go on in chained blocks */
+  ASSERT(((uintptr_t) json_arena_alloc(&arena, 1) & 7) == 0);
+  p = (char *) json_arena_alloc(&arena, 100);
+  ASSERT(p != NULL && (p < mem || p >= mem + sizeof(mem)));
+  ASSERT(arena.blocks != NULL);
+  p = (char *) json_arena_alloc(&arena, 10000);
+  ASSERT(p != NULL);
+  memset(p, 'x', 10000);
+
+  /* The largest block is kept */
+  json_arena_reset(&arena);
+  ASSERT(arena.blocks != NULL && arena.size >= 10000);
+  ASSERT(json_arena_alloc(&arena, 5000) == p);
+
+  /* Plans with many conversions don't need malloc() either */
+  json_arena_reset(&arena);
+  plan = json_scanf_compile(
+      "{a: %Q, b: %Q, c: %Q, d: %Q, e: %Q, f: %Q, g: %Q, h: %Q, i: %Q, "
+      "j: %Q, k: %Q, l: %Q, m: %Q, n: %Q, o: %Q, p: %Q, q: %Q}");
+  ASSERT(plan != NULL);
+  {
+    const char *s2 = "{q: \"last\", a: \"first\"}";
+    char *v[17];
+    for (i = 0; i < 17; i++) v[i] = NULL;
+    ASSERT(json_scanf_exec_arena(plan, s2, strlen(s2), &arena, &v[0], &v[1],
+                                 &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+                                 &v[8], &v[9], &v[10], &v[11], &v[12], &v[13],
+                                 &v[14], &v[15], &v[16]) == 2);
+    ASSERT(strcmp(v[0], "first") == 0 && strcmp(v[16], "last") == 0);
+    ASSERT(v[1] == NULL);
+  }
+  json_scanf_plan_free(plan);
+
+  json_arena_free(&arena);
+  ASSERT(arena.blocks == NULL && arena.buf == mem);
+  return NULL;
+}
+
+static const char *test_scanf_borrowed(void) {
+  const char *str = "{a: \"plain\", b: \"tab\\there\", c: null, d: 12}";
+  const char *a = NULL, *b = NULL, *c = str, *d = NULL;
+  int a_len = 0, b_len = 0, c_len = 7, d_len = 0;
+  struct json_index_token toks[10];
+  struct json_index idx;
+  struct json_arena arena;
+  char mem[64];
+
+  ASSERT(json_scanf(str, strlen(str), "{a: %S, b: %S, c: %S, d: %S}", &a,
+                    &a_len, &b, &b_len, &c, &c_len, &d, &d_len) == 3);
+  /* Borrowed from the string */
+  ASSERT(a == str + 5 && a_len == 5);
+  ASSERT(d == str + strlen(str) - 3 && d_len == 2);
+  /* Decoded, and malloc-ed */
+  ASSERT(b_len == 8 && strcmp(b, "tab\there") == 0);
+  ASSERT(b < str || b >= str + strlen(str));
+  free((char *) b);
+  ASSERT(c == NULL && c_len == 0);
+
+  /* Decoded into the arena */
+  json_arena_init(&arena, mem, sizeof(mem));
+  ASSERT(json_scanf_arena(str, strlen(str), &arena, "{a: %S, b: %S}", &a,
+                          &a_len, &b, &b_len) == 2);
+  ASSERT(a == str + 5 && b == mem && strcmp(b, "tab\there") == 0);
+  json_arena_free(&arena);
+
+  /* Same with an index */
+  ASSERT(json_index(str, strlen(str), toks, 10, &idx) == 5);
+  ASSERT(json_index_scanf(&idx, "{a: %S, b: %S}", &a, &a_len, &b, &b_len) ==
+         2);
+  ASSERT(a == str + 5 && a_len == 5);
+  ASSERT(b_len == 8 && strcmp(b, "tab\there") == 0);
+  free((char *) b);
+
+  {
+    /* Into the caller's buffers, cut to fit and then not counted */
+    const char *s2 =
+        "{cc: \"NZ\", id: \"a\\tb\", name: \"too long\", n: null, "
+        "e: \"\", x: 5}";
+    char cc[3], id[4], name[4], n[4] = "?", e[1] = "?", x[4], bad[1] = "?";
+    ASSERT(json_scanf(s2, strlen(s2),
+                      "{cc: %.*Q, id: %.*Q, name: %.*Q, n: %.*Q, e: %.*Q, "
+                      "x: %.*Q, cc: %.*Q}",
+                      (int) sizeof(cc), cc, (int) sizeof(id), id,
+                      (int) sizeof(name), name, (int) sizeof(n), n,
+                      (int) sizeof(e), e, (int) sizeof(x), x, 0, bad) == 4);
+    ASSERT(strcmp(cc, "NZ") == 0 && strcmp(id, "a\tb") == 0);
+    ASSERT(strcmp(name, "too") == 0 && n[0] == '\0' && e[0] == '\0');
+    ASSERT(strcmp(x, "5") == 0 && bad[0] == '?');
+
+    ASSERT(json_index(s2, strlen(s2), toks, 10, &idx) == 7);
+    ASSERT(json_index_scanf(&idx, "{id: %.*Q, name: %.*Q}", (int) sizeof(id),
+                            id, (int) sizeof(name), name) == 1);
+    ASSERT(strcmp(id, "a\tb") == 0 && strcmp(name, "too") == 0);
+  }
+
+  return NULL;
+}
+
+struct test_point {
+  int x, y;
+};
+
+struct test_msg {
+  int id;
+  char *name;
+  char tag[8];
+  double score;
+  float ratio;
+  bool ok;
+  unsigned long long big;
+  struct test_point pos;
+  int num_tags;
+  int tags[3];
+  int num_points;
+  struct test_point *points;
+  struct json_token extra;
+};
+
+static const struct json_field test_point_fields[] = {
+    {"x", offsetof(struct test_point, x), JSON_FIELD_INT, 0, 0, NULL, 0, 0},
+    {"y", offsetof(struct test_point, y), JSON_FIELD_INT, 0, 0, NULL, 0, 0},
+    {NULL, 0, JSON_FIELD_INT, 0, 0, NULL, 0, 0},
+};
+
+static const struct json_field test_msg_fields[] = {
+    {"id", offsetof(struct test_msg, id), JSON_FIELD_INT, 0, 0, NULL, 0, 0},
+    {"name", offsetof(struct test_msg, name), JSON_FIELD_STRING, 0, 0, NULL, 0,
+     0},
+    {"tag", offsetof(struct test_msg, tag), JSON_FIELD_CHARS, 0,
+     sizeof(((struct test_msg *) 0)->tag), NULL, 0, 0},
+    {"score", offsetof(struct test_msg, score), JSON_FIELD_DOUBLE, 0, 0, NULL,
+     0, 0},
+    {"ratio", offsetof(struct test_msg, ratio), JSON_FIELD_FLOAT, 0, 0, NULL, 0,
+     0},
+    {"ok", offsetof(struct test_msg, ok), JSON_FIELD_BOOL, 0, 0, NULL, 0, 0},
+    {"big", offsetof(struct test_msg, big), JSON_FIELD_ULLONG, 0, 0, NULL, 0,
+     0},
+    {"pos", offsetof(struct test_msg, pos), JSON_FIELD_OBJECT, 0,
+     sizeof(struct test_point), test_point_fields, 0, 0},
+    {"tags", offsetof(struct test_msg, tags), JSON_FIELD_INT, JSON_FIELD_ARRAY,
+     0, NULL, 3, offsetof(struct test_msg, num_tags)},
+    {"points", offsetof(struct test_msg, points), JSON_FIELD_OBJECT,
+     JSON_FIELD_ALLOC, sizeof(struct test_point), test_point_fields, 0,
+     offsetof(struct test_msg, num_points)},
+    {"extra", offsetof(struct test_msg, extra), JSON_FIELD_TOKEN, 0, 0, NULL, 0,
+     0},
+    {NULL, 0, JSON_FIELD_INT, 0, 0, NULL, 0, 0},
+};
+
+static const char *test_scan_struct(void) {
+  const char *str =
+      "{\"id\": -5, \"skip\": {\"a\": [1, {}]}, \"name\": \"n\\\"m\", "
+      "\"tag\": \"too long tag\", \"score\": 0.1, \"ratio\": 0.5, "
+      "\"ok\": true, \"big\": 18446744073709551615, "
+      "\"pos\": {\"y\": 2, \"x\": 1, \"z\": 0}, \"tags\": [7, 8, 9, 10], "
+      "\"points\": [{\"x\": 1}, {\"y\": 2}, {}, {\"x\": 4, \"y\": 5}, "
+      "{\"x\": 6}], \"extra\": {\"any\": [\"thing\"]}}";
+  const char *printed =
+      "{\"id\":-5,\"name\":\"n\\\"m\",\"tag\":\"too lon\",\"score\":0.1,"
+      "\"ratio\":0.5,\"ok\":true,\"big\":18446744073709551615,"
+      "\"pos\":{\"x\":1,\"y\":2},\"tags\":[7,8,9],"
+      "\"points\":[{\"x\":1,\"y\":0},{\"x\":0,\"y\":2},{\"x\":0,\"y\":0},"
+      "{\"x\":4,\"y\":5},{\"x\":6,\"y\":0}],\"extra\":{\"any\": [\"thing\"]}}";
+  struct test_msg m, m2;
+  char buf[512];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+
+  memset(&m, 0, sizeof(m));
+  ASSERT(json_scan_struct(str, strlen(str), test_msg_fields, &m) == 18);
+  ASSERT(m.id == -5 && strcmp(m.name, "n\"m") == 0);
+  ASSERT(strcmp(m.tag, "too lon") == 0);
+  ASSERT(m.score == 0.1 && m.ratio == 0.5f && m.ok);
+  ASSERT(m.big == 18446744073709551615ULL);
+  ASSERT(m.pos.x == 1 && m.pos.y == 2);
+  ASSERT(m.num_tags == 3 && m.tags[2] == 9);
+  ASSERT(m.num_points == 5 && m.points[3].x == 4 && m.points[4].x == 6);
+  ASSERT(m.extra.type == JSON_TYPE_OBJECT_END && m.extra.len == 18);
+
+  ASSERT(json_print_struct(&out, test_msg_fields, &m) == (int) strlen(printed));
+  ASSERT(strcmp(buf, printed) == 0);
+
+  /* What's printed decodes back to the same */
+  memset(&m2, 0, sizeof(m2));
+  ASSERT(json_scan_struct(buf, strlen(buf), test_msg_fields, &m2) == 23);
+  ASSERT(m2.id == m.id && strcmp(m2.name, m.name) == 0);
+  ASSERT(m2.score == m.score && m2.num_points == 5 && m2.points[1].y == 2);
+
+  json_free_struct(test_msg_fields, &m);
+  ASSERT(m.name == NULL && m.points == NULL && m.num_points == 0);
+  json_free_struct(test_msg_fields, &m2);
+
+  /* Wrong types and values out of range are not stored */
+  memset(&m, 0, sizeof(m));
+  str = "{\"id\": 1.5, \"ok\": 1, \"big\": -1, \"pos\": [], \"tags\": {}, "
+        "\"name\": 5, \"points\": [1, {\"x\": 3}]}";
+  ASSERT(json_scan_struct(str, strlen(str), test_msg_fields, &m) == 1);
+  ASSERT(m.id == 0 && m.name == NULL && m.num_tags == 0);
+  ASSERT(m.num_points == 2 && m.points[1].x == 3);
+  json_free_struct(test_msg_fields, &m);
+
+  ASSERT(json_scan_struct("{\"id\": 1", 8, test_msg_fields, &m) ==
+         JSON_STRING_INCOMPLETE);
+
+  return NULL;
+}
+
+static const char *test_scanf_array(void) {
+  const char *str =
+      "{\"a\": {\"i\": [1, -2, 2147483648, \"4\", 5, [6], {}, 8]}, "
+      "\"d\": [0.5, -1e3, 1], \"b\": [true, false, null, true], "
+      "\"s\": [\"x\\ny\", 2], \"n\": 1}";
+  int i[8], n = -1;
+  long long ll[3];
+  double d[3];
+  float f[2];
+  bool b[4];
+  char *s[2] = {NULL, NULL};
+  char *big;
+  size_t len, k;
+
+  memset(i, 0, sizeof(i));
+  ASSERT(json_scanf_array(str, strlen(str), ".a.i", JSON_FIELD_INT, i, 8,
+                          &n) == 4);
+  ASSERT(n == 8);
+  ASSERT(i[0] == 1 && i[1] == -2 && i[2] == 0 && i[3] == 0 && i[4] == 5);
+  ASSERT(i[5] == 0 && i[6] == 0 && i[7] == 8);
+
+  /* Past the capacity, elements are only counted */
+  ASSERT(json_scanf_array(str, strlen(str), ".a.i", JSON_FIELD_LLONG, ll, 3,
+                          &n) == 3);
+  ASSERT(n == 8 && ll[2] == 2147483648LL);
+  ASSERT(json_scanf_array(str, strlen(str), ".a.i", JSON_FIELD_INT, NULL, 0,
+                          &n) == 0);
+  ASSERT(n == 8);
+
+  ASSERT(json_scanf_array(str, strlen(str), ".d", JSON_FIELD_DOUBLE, d, 3,
+                          NULL) == 3);
+  ASSERT(d[0] == 0.5 && d[1] == -1000 && d[2] == 1);
+  ASSERT(json_scanf_array(str, strlen(str), ".d", JSON_FIELD_FLOAT, f, 2,
+                          &n) == 2);
+  ASSERT(n == 3 && f[0] == 0.5f && f[1] == -1000.0f);
+
+  memset(b, 0, sizeof(b));
+  ASSERT(json_scanf_array(str, strlen(str), ".b", JSON_FIELD_BOOL, b, 4,
+                          &n) == 3);
+  ASSERT(n == 4 && b[0] && !b[1] && !b[2] && b[3]);
+
+  ASSERT(json_scanf_array(str, strlen(str), ".s", JSON_FIELD_STRING, s, 2,
+                          &n) == 1);
+  ASSERT(n == 2 && strcmp(s[0], "x\ny") == 0 && s[1] == NULL);
+  free(s[0]);
+
+  /* Not an array, or no such path */
+  ASSERT(json_scanf_array(str, strlen(str), ".n", JSON_FIELD_INT, i, 8,
+                          &n) == -1);
+  ASSERT(n == 0);
+  ASSERT(json_scanf_array(str, strlen(str), ".x", JSON_FIELD_INT, i, 8,
+                          &n) == -1);
+  ASSERT(json_scanf_array(str, strlen(str), ".d", JSON_FIELD_CHARS, i, 8,
+                          &n) == -1);
+  ASSERT(json_scanf_array("[1, 2", 5, "", JSON_FIELD_INT, i, 8, &n) ==
+         JSON_STRING_INCOMPLETE);
+  ASSERT(n == 2);
+  ASSERT(json_scanf_array(" [3, 4] ", 8, "", JSON_FIELD_INT, i, 8, &n) == 2);
+  ASSERT(n == 2 && i[0] == 3 && i[1] == 4);
+
+  /* Large enough for the digits to be read eight at a time */
+  len = 2 + 1000 * 21;
+  ASSERT((big = (char *) malloc(len + 1)) != NULL);
+  for (len = 1, big[0] = '[', k = 0; k < 1000; k++) {
+    len += sprintf(big + len, "%s%lld", k > 0 ? "," : "",
+                   (long long) k * 1000000007LL - 123456789012LL);
+  }
+  big[len++] = ']';
+  {
+    long long *v = (long long *) malloc(1000 * sizeof(*v));
+    ASSERT(v != NULL);
+    ASSERT(json_scanf_array(big, (int) len, "", JSON_FIELD_LLONG, v, 1000,
+                            &n) == 1000);
+    ASSERT(n == 1000);
+    for (k = 0; k < 1000; k++) {
+      ASSERT(v[k] == (long long) k * 1000000007LL - 123456789012LL);
+    }
+    free(v);
+  }
+  free(big);
+
+  return NULL;
+}
+
 static const char *test_json_unescape(void) {
   ASSERT(json_unescape("foo", 3, NULL, 0) == 3);
   ASSERT(json_unescape("foo\\", 4, NULL, 0) == JSON_STRING_INCOMPLETE);
@@ -887,6 +2133,68 @@ static const char *test_json_setf(void) {
     ASSERT(strcmp(buf, s2) == 0);
   }
 
+  {
+    /* Strings, nested containers, and paths that can't be added */
+    static const struct {
+      const char *s, *path, *fmt;
+      int res;
+      const char *result;
+    } tests[] = {
+        {"{\"a\": \"x\", \"b\": 1}", ".a", "%s", 1, "{\"a\": \"y\", \"b\": 1}"},
+        {"{\"a\":\"x\",\"b\":1}", ".a", "%s", 1, "{\"a\":\"y\",\"b\":1}"},
+        {"{\"a\": \"\", \"b\": 1}", ".a", "%s", 1, "{\"a\": \"y\", \"b\": 1}"},
+        {"{\"a\": \"x\", \"b\": 1}", ".a", NULL, 1, "{ \"b\": 1}"},
+        {"{\"a\": \"x\", \"b\": 1}", ".b", NULL, 1, "{\"a\": \"x\"}"},
+        {"[\"x\"]", "[1]", "%Q", 0, "[\"x\",\"y\"]"},
+        {"{\"a\":\"s\",\"b\":[1,2]}", ".b", NULL, 1, "{\"a\":\"s\"}"},
+        {"[1,[2,3],{\"a\":4}]", "[0]", NULL, 1, "[[2,3],{\"a\":4}]"},
+        {"{}", ".d.x", "%Q", 0, "{\"d\":{\"x\":\"y\"}}"},
+        {"{\"a\":[]}", ".a[0]", "%Q", 0, "{\"a\":[\"y\"]}"},
+        {"{\"ab\":1}", ".a", "%Q", 0, "{\"ab\":1,\"a\":\"y\"}"},
+    };
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+      struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+      const char *s = tests[i].s;
+      int res = json_setf(s, strlen(s), &out, tests[i].path, tests[i].fmt, "y");
+      ASSERT(res == tests[i].res);
+      ASSERT(strcmp(buf, tests[i].result) == 0);
+    }
+  }
+
+  {
+    /* Changes that would break the string are an error, it is kept as is */
+    static const struct {
+      const char *s, *path, *fmt;
+    } tests[] = {
+        {"{\"a\":1}", ".a.q", "%Q"},         {"{\"a\":{}}", ".a[0]", "%Q"},
+        {"{\"a\":[1]}", ".a.b", NULL},       {"{\"a\":{},\"a\":2}", ".a.b", "%Q"},
+        {"{\"a\":2,\"a\":{}}", ".a.b", "%Q"}, {"{}", ".a..b", "%Q"},
+        {"{}", ".", "%Q"},                   {"{\"a\":1}", "", NULL},
+    };
+    char path[JSON_MAX_PATH_LEN + 2];
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    size_t i, ok = 0;
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+      const char *s = tests[i].s;
+      out.u.buf.len = 0;
+      if (json_setf(s, strlen(s), &out, tests[i].path, tests[i].fmt, "y") ==
+              JSON_STRING_INVALID &&
+          strcmp(buf, s) == 0) {
+        ok++;
+      }
+    }
+    ASSERT(ok == ARRAY_SIZE(tests));
+
+    /* A path too long to tell apart from others */
+    memset(path, 'a', sizeof(path) - 1);
+    path[0] = '.';
+    path[sizeof(path) - 1] = '\0';
+    out.u.buf.len = 0;
+    ASSERT(json_setf("{}", 2, &out, path, "1") == JSON_STRING_INVALID);
+    ASSERT(strcmp(buf, "{}") == 0);
+  }
+
   return NULL;
 }
 
@@ -902,6 +2210,20 @@ static const char *test_prettify(void) {
         "{},\n    true\n  ]\n}";
     ASSERT(json_prettify(s1, strlen(s1), &out) > 0);
     ASSERT(strcmp(buf, s2) == 0);
+
+    out.u.buf.len = 0;
+    ASSERT(json_prettify64(s1, strlen(s1), &out) == (ptrdiff_t) strlen(s1));
+    ASSERT(strcmp(buf, s2) == 0);
+
+    /* A key that looks like an array index is still a key */
+    s1 = "{\"a]\":1,\"b\":[2]}";
+    s2 = "{\n  \"a]\": 1,\n  \"b\": [\n    2\n  ]\n}";
+    out.u.buf.len = 0;
+    ASSERT(json_prettify64(s1, strlen(s1), &out) == (ptrdiff_t) strlen(s1));
+    ASSERT(strcmp(buf, s2) == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_prettify(s1, strlen(s1), &out) == (int) strlen(s1));
+    ASSERT(strcmp(buf, s2) == 0);
   }
 
   {
@@ -995,22 +2317,350 @@ static const char *test_json_next(void) {
     ASSERT(i == 2);
   }
 
+  {
+    /* Stops at a malformed value or member, like json_walk() */
+    const char *s3 = "{\"a\": [1, tru, nul, ], \"b\": {\"x\": 1 [2]}, "
+                     "\"c\": [3, \"y\": 4]}";
+    void *h;
+    int idx = 5;
+    h = json_next_elem(s3, strlen(s3), NULL, ".a", &idx, &val);
+    ASSERT(h != NULL && idx == 0 && val.type == JSON_TYPE_NUMBER);
+    ASSERT(json_next_elem(s3, strlen(s3), h, ".a", &idx, &val) == NULL);
+    ASSERT(json_scanf_array_elem(s3, strlen(s3), ".a", 1, &val) == -1);
+    h = json_next_key(s3, strlen(s3), NULL, ".b", &key, &val);
+    ASSERT(h != NULL && key.len == 1 && key.ptr[0] == 'x');
+    ASSERT(json_next_key(s3, strlen(s3), h, ".b", &key, &val) == NULL);
+    h = json_next_elem(s3, strlen(s3), NULL, ".c", &idx, &val);
+    ASSERT(h != NULL && idx == 0 && val.ptr[0] == '3');
+    h = json_next_elem(s3, strlen(s3), h, ".c", &idx, &val);
+    ASSERT(h != NULL && idx == 1 && val.type == JSON_TYPE_STRING);
+    ASSERT(json_next_elem(s3, strlen(s3), h, ".c", &idx, &val) == NULL);
+    ASSERT(json_next_key(s3, strlen(s3), NULL, "", &key, &val) == NULL);
+    s3 = "{\"a\": 1, \"b\x01\": 2}";
+    h = json_next_key(s3, strlen(s3), NULL, "", &key, &val);
+    ASSERT(h != NULL && key.len == 1 && key.ptr[0] == 'a');
+    ASSERT(json_next_key(s3, strlen(s3), h, "", &key, &val) == NULL);
+
+    /* The index is the element's position, whatever `idx` was before */
+    s3 = "[1, [2], 3]";
+    h = json_next_elem(s3, strlen(s3), NULL, "", &idx, &val);
+    ASSERT(h != NULL && idx == 0);
+    idx = 0;
+    h = json_next_elem(s3, strlen(s3), h, "", &idx, &val);
+    ASSERT(h != NULL && idx == 1 && val.type == JSON_TYPE_ARRAY_END);
+    idx = 0;
+    h = json_next_elem(s3, strlen(s3), h, "", &idx, &val);
+    ASSERT(h != NULL && idx == 2 && val.ptr[0] == '3');
+    h = json_next_elem(s3, strlen(s3), h, "", NULL, &val);
+    ASSERT(h == NULL);
+  }
+
+  return NULL;
+}
+
+static const char *test_skip_value(void) {
+  const char *s = " {\"a\": [1, \"]}\"], \"b\": {}} , 2";
+  int len = strlen(s);
+
+  ASSERT(json_skip_value(s, len) == 26);
+  ASSERT(json_skip_value(s + 26, len - 26) == JSON_STRING_INVALID);
+  ASSERT(json_skip_value(s + 28, len - 28) == 2);
+  ASSERT(json_skip_value(" \"a\\\"b\" ", 8) == 7);
+  ASSERT(json_skip_value("true,", 5) == 4);
+  ASSERT(json_skip_value("-12.5e3", 7) == 7);
+  ASSERT(json_skip_value(s, 20) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_skip_value("  ", 2) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_skip_value("\"abc", 4) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_skip_value(" ]", 2) == JSON_STRING_INVALID);
+  ASSERT(json_skip_value(":1", 2) == JSON_STRING_INVALID);
+
+  {
+    /* Random access helpers jump over the values they don't need */
+    struct json_token t;
+    const char *s2 = "{\"a\": [{\"x\": \"[\"}, [[2]], \"hi\"], \"a\": [3]}";
+    ASSERT(json_scanf_array_elem(s2, strlen(s2), ".a", 0, &t) == 1);
+    ASSERT(t.type == JSON_TYPE_NUMBER && t.ptr[0] == '3');
+    ASSERT(json_scanf_array_elem(s2, 18, ".a", 1, &t) == -1);
+    ASSERT(t.ptr == NULL);
+    s2 = "[{\"x\": \"[\"}, [[2]], \"hi\"]";
+    ASSERT(json_scanf_array_elem(s2, strlen(s2), "", 2, &t) == 2);
+    ASSERT(t.type == JSON_TYPE_STRING && strncmp(t.ptr, "hi", 2) == 0);
+    ASSERT(json_scanf_array_elem(s2, strlen(s2), "", 1, &t) == 5);
+    ASSERT(t.type == JSON_TYPE_ARRAY_END);
+  }
+
+  return NULL;
+}
+
+static const char *test_index(void) {
+  const char *s =
+      "{ \"a\": 123, \"b\": [ 1, {\"x\": \"hi\"}, 3 ], \"c\": true }";
+  struct json_index_token tokens[10];
+  struct json_index idx;
+  struct json_token t;
+  int len = strlen(s);
+
+  {
+    /* Index size is reported even if the array is too small */
+    ASSERT(json_index(s, len, tokens, 3, &idx) == 8);
+    ASSERT(idx.num_tokens == 0);
+    ASSERT(json_index_find(&idx, 0, "") == -1);
+    ASSERT(json_index("{a:", 3, tokens, 10, &idx) == JSON_STRING_INCOMPLETE);
+  }
+
+  {
+    ASSERT(json_index(s, len, tokens, 10, &idx) == 8);
+    ASSERT(idx.num_tokens == 8);
+    ASSERT(tokens[0].type == JSON_TYPE_OBJECT_END);
+    ASSERT(tokens[0].ofs == 0 && tokens[0].len == len);
+    ASSERT(tokens[0].parent == -1 && tokens[0].next == -1);
+    ASSERT(json_index_find(&idx, 0, "") == 0);
+    ASSERT(json_index_find(&idx, 0, ".a") == 1);
+    ASSERT(tokens[1].next == 2 && tokens[2].next == 7);
+    ASSERT(json_index_find(&idx, 0, ".b[1].x") == 5);
+    ASSERT(tokens[5].parent == 4 && tokens[5].type == JSON_TYPE_STRING);
+    ASSERT(strncmp(s + tokens[5].ofs, "hi", tokens[5].len) == 0);
+    ASSERT(json_index_find(&idx, 2, "[2]") == 6);
+    ASSERT(json_index_find(&idx, 0, ".b[3]") == -1);
+    ASSERT(json_index_find(&idx, 0, ".a.x") == -1);
+    ASSERT(json_index_find(&idx, 0, ".d") == -1);
+  }
+
+  {
+    int a = 0, c = 0;
+    char *x = NULL;
+    ASSERT(json_index_scanf(&idx, "{a: %d, b: [%T], c: %B, b[1]: {x: %Q}}",
+                            &a, &t, &c, &x) == 4);
+    ASSERT(a == 123 && c == 1);
+    ASSERT(t.type == JSON_TYPE_ARRAY_END && t.ptr == s + tokens[2].ofs);
+    ASSERT(x != NULL && strcmp(x, "hi") == 0);
+    free(x);
+  }
+
+  {
+    ASSERT(json_index_scanf_array_elem(&idx, ".b", 0, &t) == 1);
+    ASSERT(json_index_scanf_array_elem(&idx, ".b", 1, &t) == 11);
+    ASSERT(t.type == JSON_TYPE_OBJECT_END);
+    ASSERT(json_index_scanf_array_elem(&idx, ".b", 3, &t) == -1);
+    ASSERT(json_index_scanf_array_elem(&idx, ".a", 0, &t) == -1);
+  }
+
+  {
+    void *h = NULL;
+    struct json_token key, val;
+    char buf[100];
+    int i = 0, n;
+    const char *keys[] = {"[a] -> [123]", "[b] -> [[ 1, {\"x\": \"hi\"}, 3 ]]",
+                          "[c] -> [true]"};
+    while ((h = json_index_next_key(&idx, h, "", &key, &val)) != NULL) {
+      snprintf(buf, sizeof(buf), "[%.*s] -> [%.*s]", key.len, key.ptr, val.len,
+               val.ptr);
+      ASSERT(strcmp(keys[i], buf) == 0);
+      i++;
+    }
+    ASSERT(i == 3);
+    for (i = 0; (h = json_index_next_elem(&idx, h, ".b", &n, &val)) != NULL;
+         i++) {
+      if (n != i) break;
+      n = 0;
+    }
+    ASSERT(i == 3);
+  }
+
+  {
+    /* Index and non-index setf must agree */
+    static const struct {
+      const char *path, *fmt;
+    } tests[] = {{".a", "7"},   {".b[1]", "5"}, {".b[]", "4"}, {".d.e", "8"},
+                 {".d[]", "3"}, {"", "123"},    {".a", NULL},  {".c", NULL},
+                 {".d", NULL},  {".b[0]", NULL}};
+    char buf1[200], buf2[200];
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+      struct json_out out1 = JSON_OUT_BUF(buf1, sizeof(buf1));
+      struct json_out out2 = JSON_OUT_BUF(buf2, sizeof(buf2));
+      int r1 = json_setf(s, len, &out1, tests[i].path, tests[i].fmt);
+      int r2 = json_index_setf(&idx, &out2, tests[i].path, tests[i].fmt);
+      ASSERT(r1 == r2);
+      ASSERT(strcmp(buf1, buf2) == 0);
+    }
+  }
+
+  {
+    /* Same byte for byte, also where json_setf() has to make things up */
+    static const char *docs[] = {
+        "{}", "[ ]", "1", "{\"a\":1,\"a\":2}",
+        "{ \"a\" : 1 , \"b\" : [ 1 , 2 ] }",
+        "{\"a\":[1,{\"c\":3}],\"d\":{\"e\":\"x\"}}", "[1,[2,3],{\"a\":4}]",
+        "{\"\":1,\"x.y\":{\"k[0]\":[]}}", "{\"a\":", "[1,2"};
+    static const char *paths[] = {"",        ".a",      ".d.x",   ".a.q",
+                                  ".b[1]",   ".b[5]",   "[1][0]", "[2].z",
+                                  ".a[1].c", ".d.e.f",  ".",      ".x.y",
+                                  "[0].k",   ".a[1].z", "[9]",    ".b.c[2]"};
+    struct json_index_token toks[20];
+    char buf1[200], buf2[200];
+    size_t i, j, k, differ = 0;
+    for (i = 0; i < ARRAY_SIZE(docs); i++) {
+      int n = strlen(docs[i]);
+      /* An index too small to hold the string falls back to walking it */
+      json_index(docs[i], n, toks, i == 1 ? 0 : 20, &idx);
+      for (j = 0; j < ARRAY_SIZE(paths) * 2; j++) {
+        struct json_out out1 = JSON_OUT_BUF(buf1, sizeof(buf1));
+        struct json_out out2 = JSON_OUT_BUF(buf2, sizeof(buf2));
+        const char *fmt = j % 2 ? "%Q" : NULL;
+        int r1, r2;
+        k = j / 2;
+        memset(buf1, 0, sizeof(buf1));
+        memset(buf2, 0, sizeof(buf2));
+        r1 = json_setf(docs[i], n, &out1, paths[k], fmt, "X");
+        r2 = json_index_setf(&idx, &out2, paths[k], fmt, "X");
+        if (r1 != r2 || strcmp(buf1, buf2) != 0) differ++;
+      }
+    }
+    ASSERT(differ == 0);
+  }
+
+  {
+    /* Setting a string replaces the text between the quotes */
+    const char *s2 = "{\"a\": \"x\", \"b\": []}";
+    char buf[100];
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    ASSERT(json_index(s2, strlen(s2), tokens, 10, &idx) == 3);
+    ASSERT(json_index_setf(&idx, &out, ".a", "%s", "y") == 1);
+    ASSERT(strcmp(buf, "{\"a\": \"y\", \"b\": []}") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_index_setf(&idx, &out, ".b[]", "%d", 1) == 0);
+    ASSERT(strcmp(buf, "{\"a\": \"x\", \"b\": [1]}") == 0);
+  }
+
+  return NULL;
+}
+
+static const char *test_scan(void) {
+  struct {
+    scan_fn_t spaces, plain;
+  } impls[4];
+  size_t n = 0, i, j, k;
+  char buf[200];
+
+  impls[n].spaces = scan_spaces_generic;
+  impls[n++].plain = scan_plain_generic;
+#ifdef SCAN_SSE2
+  impls[n].spaces = scan_spaces_sse2;
+  impls[n++].plain = scan_plain_sse2;
+#endif
+#ifdef SCAN_X86_DISPATCH
+  if (__builtin_cpu_supports("avx2")) {
+    impls[n].spaces = scan_spaces_avx2;
+    impls[n++].plain = scan_plain_avx2;
+  }
+  if (__builtin_cpu_supports("avx512bw")) {
+    impls[n].spaces = scan_spaces_avx512;
+    impls[n++].plain = scan_plain_avx512;
+  }
+#endif
+
+  /* Put a stop byte at every position, check that every scanner finds it */
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < 150; i++) {
+      int ok = 1;
+      memset(buf, ' ', sizeof(buf));
+      buf[i] = 'x';
+      for (j = 0; j <= i; j++) {
+        ok &= impls[k].spaces(buf + j, buf + sizeof(buf)) == buf + i;
+        ok &= impls[k].spaces(buf + j, buf + i) == buf + i;
+      }
+      memset(buf, 'a', sizeof(buf));
+      buf[i] = "\"\\\x01\x80\xff"[i % 5];
+      for (j = 0; j <= i; j++) {
+        ok &= impls[k].plain(buf + j, buf + sizeof(buf)) == buf + i;
+        ok &= impls[k].plain(buf + j, buf + i) == buf + i;
+      }
+      ASSERT(ok);
+    }
+  }
+
+  ASSERT(json_scan_spaces(buf, buf) == buf);
+  ASSERT(json_scan_plain(buf, buf) == buf);
+
+  {
+    const char *s = "{\"a]\\\"}\": [1, {}, \"}\"], b: {}} , 1";
+    const char *end = s + strlen(s);
+    ASSERT(json_scan_skip(s, end) == s + 30);
+    ASSERT(json_scan_skip(s, s + 29) == NULL);
+    ASSERT(json_scan_skip(s + 1, end) == s + 8);
+    ASSERT(json_scan_skip(s + 1, s + 6) == NULL);
+    ASSERT(json_scan_skip(end - 1, end) == end);
+    ASSERT(json_scan_skip(s + 11, end) == s + 12);
+    ASSERT(json_scan_skip(end, end) == NULL);
+  }
+
+  {
+    /* Backslash runs across the 64-byte blocks of the skipper */
+    char s[200];
+    int i, k, n, ok = 1;
+    for (i = 50; i < 140; i++) {
+      for (k = 1; k <= 5; k++) {
+        n = sprintf(s, "[{}, \"%*s", i, "");
+        memset(s + n, '\\', k);
+        n += k;
+        n += sprintf(s + n, "%s]\"]", k % 2 ? "\"" : "");
+        ok &= json_walk(s, n, NULL, NULL) == n;
+        ok &= json_scan_skip(s, s + n) == s + n;
+        ok &= json_scan_skip(s, s + n - 1) == NULL;
+      }
+    }
+    ASSERT(ok);
+  }
+
+  {
+    /* Long strings and indentation go through the block scanners */
+    const char *s =
+        "{\n                                        \"key\": "
+        "\"0123456789012345678901234567890123456789\\n0123456789012345678"
+        "90123456789\xd0\xb1\",\n                    \"k\":\"\"}";
+    ASSERT(json_walk(s, strlen(s), NULL, NULL) == (int) strlen(s));
+    ASSERT(json_walk(s, strlen(s) - 30, NULL, NULL) == JSON_STRING_INCOMPLETE);
+  }
+
   return NULL;
 }
 
 static const char *run_all_tests(void) {
   RUN_TEST(test_json_next);
+  RUN_TEST(test_skip_value);
   RUN_TEST(test_prettify);
   RUN_TEST(test_eos);
   RUN_TEST(test_scanf);
+  RUN_TEST(test_scanf_plan);
+  RUN_TEST(test_scanf_numbers);
+  RUN_TEST(test_scanf_arena);
+  RUN_TEST(test_scanf_borrowed);
+  RUN_TEST(test_scan_struct);
+  RUN_TEST(test_scanf_array);
   RUN_TEST(test_errors);
   RUN_TEST(test_json_printf);
+  RUN_TEST(test_printf_template);
+  RUN_TEST(test_printf_dynbuf);
+  RUN_TEST(test_printf_numbers);
+  RUN_TEST(test_printf_fd);
+  RUN_TEST(test_printf_iov);
   RUN_TEST(test_callback_api);
   RUN_TEST(test_callback_api_long_path);
+  RUN_TEST(test_walk_ex);
+  RUN_TEST(test_walk64);
+  RUN_TEST(test_walk_filtered);
+  RUN_TEST(test_deep_nesting);
+  RUN_TEST(test_walk_max_depth);
+  RUN_TEST(test_parser);
+  RUN_TEST(test_walk_lines);
+  RUN_TEST(test_walk_array);
   RUN_TEST(test_json_unescape);
   RUN_TEST(test_parse_string);
   RUN_TEST(test_fprintf);
   RUN_TEST(test_json_setf);
+  RUN_TEST(test_index);
+  RUN_TEST(test_scan);
   return NULL;
 }
 